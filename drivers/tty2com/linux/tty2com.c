@@ -37,9 +37,11 @@
 #include <linux/version.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include <linux/proc_fs.h>
 #include <linux/device.h>
+#include <linux/list.h>
+#include <linux/poll.h>
 
 /*
  * Default number of virtual tty devices this driver can create.
@@ -87,6 +89,16 @@
 #define SLB 0x0003
 #define CLB 0x0004
 
+/* Type of event records read from /proc/sp_vmpscrdk (struct sp_evt_rec) */
+#define SP_EVT_ADDED    0x0001
+#define SP_EVT_REMOVED  0x0002
+#define SP_EVT_OPENED   0x0003
+#define SP_EVT_CLOSED   0x0004
+#define SP_EVT_MSR      0x0005
+
+/* Number of event records queued for each open file of /proc/sp_vmpscrdk, power of 2 */
+#define SP_EVT_QUEUE_LEN  256
+
 //### BREAK in swicth case for badurate
 //### proc_create_single
 
@@ -127,6 +139,28 @@ struct vtty_dev {
 	struct device *device;
 };
 
+/*
+ * One event as returned by read() on /proc/sp_vmpscrdk. The seq is incremented for every event
+ * generated by driver, a gap tells that reader fell behind and records were lost.
+ */
+struct sp_evt_rec {
+	/* SP_EVT_XXX */
+	u32 type;
+	/* index of device this event is about */
+	u32 index;
+	/* peer index for SP_EVT_ADDED, TIOCM_CAR/CTS/DSR/RI bits for SP_EVT_MSR, 0 otherwise */
+	u32 state;
+	u32 seq;
+};
+
+/* Events waiting to be read by one open file of /proc/sp_vmpscrdk */
+struct sp_evt_queue {
+	struct list_head list;
+	unsigned int head;
+	unsigned int tail;
+	struct sp_evt_rec rec[SP_EVT_QUEUE_LEN];
+};
+
 /* Current driver design is such that the vtty_info for a device with index x will be placed at
  * index x in array index_manager. */
 struct vtty_info {
@@ -180,6 +214,7 @@ static ssize_t sp_ostats_show(struct device *dev, struct device_attribute *attr,
 
 static int sp_vcard_proc_open(struct inode *inode, struct  file *file);
 static int sp_vcard_proc_close(struct inode *inode, struct file *file);
+static __poll_t sp_vcard_proc_poll(struct file *file, poll_table *wait);
 static ssize_t sp_vcard_proc_read(struct file *file, char __user *buf, size_t size, loff_t *ppos);
 static ssize_t sp_vcard_proc_write(struct file *file, const char __user *buf, size_t length, loff_t * ppos);
 
@@ -208,6 +243,13 @@ static struct tty_driver *spvtty_driver;
 static DEFINE_MUTEX(adaptlock);           /*  atomically create/destroy tty devices  */
 static struct vtty_info *index_manager = NULL;   /*  keep track of indexes in use currently */
 
+/* Event queues of all open files of proc entry, sequence number of last event and unload flag */
+static DEFINE_SPINLOCK(evtlock);
+static LIST_HEAD(evt_queues);
+static DECLARE_WAIT_QUEUE_HEAD(evt_wait);
+static u32 evt_seq;
+static int evt_closing;
+
 /* Per device sysfs entries to emulate frame, parity and overrun error events during data
  * reception and providing some informations about device. The 'proc entries' are used to
  * interact with driver state as a whole while 'sysfs enteries' are used to interact with
@@ -256,6 +298,74 @@ static const struct tty_port_operations spvtty_port_ops = {
 	/*.dtr_rts        = sp_port_dtr_rts,  */
 };
 
+/*
+ * Converts shadow modem status register to TIOCM_XXX bits.
+ *
+ * @msr_reg: value of modem status register.
+ *
+ * @return bit mask of TIOCM_CAR, TIOCM_RI, TIOCM_CTS and TIOCM_DSR.
+ */
+static u32 sp_msr_to_tiocm(int msr_reg)
+{
+	return ((msr_reg & SP_MSR_DCD) ? TIOCM_CAR : 0) |
+		   ((msr_reg & SP_MSR_RI)  ? TIOCM_RI  : 0) |
+		   ((msr_reg & SP_MSR_CTS) ? TIOCM_CTS : 0) |
+		   ((msr_reg & SP_MSR_DSR) ? TIOCM_DSR : 0);
+}
+
+/*
+ * Queues an event record to every open file of /proc/sp_vmpscrdk and wakes up readers blocked in
+ * read() or poll(). If a reader's queue is full the event is not queued for it. Callable from any context.
+ *
+ * @type: one of SP_EVT_XXX.
+ * @index: index of device this event is about.
+ * @state: event specific value, see struct sp_evt_rec.
+ */
+static void sp_post_event(u32 type, u32 index, u32 state)
+{
+	int wake = 0;
+	unsigned long flags;
+	struct sp_evt_rec *rec;
+	struct sp_evt_queue *q;
+
+	spin_lock_irqsave(&evtlock, flags);
+	evt_seq++;
+	list_for_each_entry(q, &evt_queues, list) {
+		if ((q->head - q->tail) >= SP_EVT_QUEUE_LEN)
+			continue;
+		rec = &q->rec[q->head & (SP_EVT_QUEUE_LEN - 1)];
+		rec->type  = type;
+		rec->index = index;
+		rec->state = state;
+		rec->seq   = evt_seq;
+		q->head++;
+		wake = 1;
+	}
+	spin_unlock_irqrestore(&evtlock, flags);
+
+	if (wake)
+		wake_up_interruptible(&evt_wait);
+}
+
+/*
+ * Tells whether read() on the file owning given queue should return now.
+ *
+ * @q: event queue of the file.
+ *
+ * @return 1 if events are queued or driver is being unloaded, 0 otherwise.
+ */
+static int sp_evt_ready(struct sp_evt_queue *q)
+{
+	int ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&evtlock, flags);
+	ret = (q->head != q->tail) || evt_closing;
+	spin_unlock_irqrestore(&evtlock, flags);
+
+	return ret;
+}
+
 /*
  * Notifies tty layer that a framing/parity/overrun error has happend while receiving data on serial port. 
  * The serial port on which the given error/event is to be emulated must have been opened before causing 
@@ -313,7 +423,7 @@ static ssize_t sp_evt_store(struct device *dev, struct device_attribute *attr, c
 	/* Ensure required structure has been allocated, initialized and port has been opened. */
 	if ((!tty_to_write) || (tty_to_write->port == NULL) || (tty_to_write->port->count <= 0))
 		return -EIO;
-	if (!test_bit(ASYNCB_INITIALIZED, &tty_to_write->port->flags))
+	if (!tty_port_initialized(tty_to_write->port))
 		return -EIO;
 
 	mutex_lock(&local_vttydev->lock);
@@ -340,11 +450,13 @@ static ssize_t sp_evt_store(struct device *dev, struct device_attribute *attr, c
 	case '4' :
 		local_vttydev->msr_reg |= SP_MSR_RI;
 		local_vttydev->icount.rng++;
+		sp_post_event(SP_EVT_MSR, local_vttydev->own_index, sp_msr_to_tiocm(local_vttydev->msr_reg));
 		push = -1;
 		break;
 	case '5' :
 		local_vttydev->msr_reg &= ~SP_MSR_RI;
 		local_vttydev->icount.rng++;
+		sp_post_event(SP_EVT_MSR, local_vttydev->own_index, sp_msr_to_tiocm(local_vttydev->msr_reg));
 		push = -1;
 		break;
 	case '6' :
@@ -751,6 +863,8 @@ static int sp_update_modem_lines(struct tty_struct *tty, unsigned int set, unsig
 	}
 
 	local_vttydev->mcr_reg = mcr_ctrl_reg;
+	if (vttydev->msr_reg != msr_state_reg)
+		sp_post_event(SP_EVT_MSR, vttydev->own_index, sp_msr_to_tiocm(msr_state_reg));
 	vttydev->msr_reg = msr_state_reg;
 
 	evicount = &vttydev->icount;
@@ -861,6 +975,9 @@ static int sp_open(struct tty_struct *tty, struct file *filp)
 	if (ret < 0) 
 		return ret;
 
+	if (tty->port->count == 1)
+		sp_post_event(SP_EVT_OPENED, local_vttydev->own_index, 0);
+
 	tty->port->close_delay  = 0;
 	tty->port->closing_wait = ASYNC_CLOSING_WAIT_NONE;
 	tty->port->drain_delay  = 0;
@@ -882,8 +999,11 @@ static void sp_close(struct tty_struct *tty, struct file *filp)
 	if (test_bit(TTY_IO_ERROR, &tty->flags))
 		return;
 
-	if (tty && filp && tty->port && (tty->port->count > 0))
+	if (tty && filp && tty->port && (tty->port->count > 0)) {
 		tty_port_close(tty->port, tty, filp);
+		if (tty->port->count < 1)
+			sp_post_event(SP_EVT_CLOSED, tty->index, 0);
+	}
 
 	if (tty && C_HUPCL(tty) && tty->port && (tty->port->count < 1))
 		sp_update_modem_lines(tty, 0, TIOCM_DTR | TIOCM_RTS);
@@ -1234,7 +1354,7 @@ static int sp_check_msr_delta(struct tty_struct *tty, struct vtty_dev *local_vtt
 	int delta = 0;
 
 	/* Use tty-port initialised flag to detect all hangups including the disconnect(device destroy) event */
-	if (!test_bit(ASYNCB_INITIALIZED, &tty->port->flags))
+	if (!tty_port_initialized(tty->port))
 		return 1;
 
 	mutex_lock(&local_vttydev->lock);
@@ -1273,7 +1393,7 @@ static int sp_wait_msr_change(struct tty_struct *tty, unsigned long mask)
 
 	local_vttydev->waiting_msr_chg = 0;
 
-	if (!ret && !test_bit(ASYNCB_INITIALIZED, &tty->port->flags))
+	if (!ret && !tty_port_initialized(tty->port))
 		ret = -EIO;
 
 	return ret;
@@ -1663,10 +1783,61 @@ static void sp_port_destruct(struct tty_port *port)
     //kfree(port);
 }
 
+/*
+ * Returns queued event records (struct sp_evt_rec) to the reader. Blocks until at least one event is
+ * available unless file was opened with O_NONBLOCK. Returns 0 when driver is being unloaded.
+ *
+ * @file: file for proc file.
+ * @buf: user space buffer that will contain records when this function returns.
+ * @size: size of buf, a multiple of size of struct sp_evt_rec.
+ *
+ * @return number of bytes copied to user buffer on success or negative error code on error.
+ */
+static ssize_t sp_vcard_evt_read(struct file *file, char __user *buf, size_t size)
+{
+	int ret = 0;
+	size_t n = 0;
+	unsigned long flags;
+	struct sp_evt_rec rec;
+	struct sp_evt_queue *q = file->private_data;
+
+	if ((q == NULL) || (size < sizeof(rec)) || (size % sizeof(rec)))
+		return -EINVAL;
+
+	if (!sp_evt_ready(q)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(evt_wait, sp_evt_ready(q));
+		if (ret)
+			return ret;
+	}
+
+	while (n < size) {
+		spin_lock_irqsave(&evtlock, flags);
+		if (q->head == q->tail) {
+			spin_unlock_irqrestore(&evtlock, flags);
+			break;
+		}
+		rec = q->rec[q->tail & (SP_EVT_QUEUE_LEN - 1)];
+		q->tail++;
+		spin_unlock_irqrestore(&evtlock, flags);
+
+		if (copy_to_user(buf + n, &rec, sizeof(rec)))
+			return n ? n : -EFAULT;
+		n += sizeof(rec);
+	}
+
+	return n;
+}
+
 /*
  * Gives next available index and last used index for virtual tty devices created. Invoke as shown below:
  * $ head -c 52 /proc/sp_vmpscrdk
  *
+ * Any other read size which is a multiple of size of struct sp_evt_rec returns events instead. Device
+ * added or removed, first open and last close and modem status change of every device are reported, so
+ * that watchers can sleep in poll()/epoll instead of rescanning devices periodically.
+ *
  * @file: file for proc file.
  * @buf: user space buffer that will contain data when this function returns.
  * @size: number of character returned in buf.
@@ -1689,7 +1860,7 @@ static ssize_t sp_vcard_proc_read(struct file *file, char __user *buf, size_t si
 	memset(data, '\0', 64);
 
 	if (size != 52)
-		return -EINVAL;
+		return sp_vcard_evt_read(file, buf, size);
 
 	mutex_lock(&adaptlock);
 
@@ -1784,6 +1955,71 @@ static int sp_extract_pin_mapping(char data[], int x)
 	return mapping;
 }
 
+/*
+ * Deletes the virtual device at the given index together with its peer if it is one end of a null
+ * modem pair. Open devices are hung up first, as is done when a usb serial device is unplugged.
+ *
+ * @idx: index of the device to delete.
+ *
+ * @return 0 on success or -EINVAL if there is no device at this index.
+ */
+static int sp_delete_vdev(unsigned int idx)
+{
+	int x = -1;
+	int y = -1;
+	struct vtty_dev *vttydev1 = NULL;
+	struct vtty_dev *vttydev2 = NULL;
+	struct tty_struct *tty;
+
+	if ((idx >= max_num_vtty_dev) || (index_manager[idx].index == -1))
+		return -EINVAL;
+
+	mutex_lock(&adaptlock);
+
+	x = index_manager[idx].index;
+	vttydev1 = index_manager[x].vttydev;
+	sysfs_remove_group(&vttydev1->device->kobj, &sp_info_attr_group);
+	tty_unregister_device(spvtty_driver, index_manager[x].index);
+	if (vttydev1 && vttydev1->own_tty && vttydev1->own_tty->port) {
+		tty = tty_port_tty_get(vttydev1->own_tty->port);
+		if (tty) {
+			tty_vhangup(tty);
+			tty_kref_put(tty);
+		}
+	}
+
+	if (vttydev1->own_index != vttydev1->peer_index) {
+		y = index_manager[vttydev1->peer_index].index;
+		vttydev2 = index_manager[y].vttydev;
+		sysfs_remove_group(&vttydev2->device->kobj, &sp_info_attr_group);
+		tty_unregister_device(spvtty_driver, index_manager[y].index);
+		if (vttydev2 && vttydev2->own_tty && vttydev2->own_tty->port) {
+			tty = tty_port_tty_get(vttydev2->own_tty->port);
+			if (tty) {
+				tty_vhangup(tty);
+				tty_kref_put(tty);
+			}
+		}
+	}
+
+	if (x != -1) {
+		kfree(index_manager[x].vttydev);
+		index_manager[x].index = -1;
+		sp_post_event(SP_EVT_REMOVED, x, 0);
+	}
+	if (y != -1) {
+		kfree(index_manager[y].vttydev);
+		index_manager[y].index = -1;
+		sp_post_event(SP_EVT_REMOVED, y, 0);
+		--total_nm_pair;
+	} else {
+		--total_lb_devs;
+	}
+
+	mutex_unlock(&adaptlock);
+	return 0;
+}
+
 /*
  * This function is equivalent to a typical 'probe' function in linux device driver model for this virtual
  * card.
@@ -2122,6 +2358,10 @@ static ssize_t sp_vcard_proc_write(struct file *file, const char __user *buf, si
 			}
 		}
 
+		sp_post_event(SP_EVT_ADDED, i, vttydev1->peer_index);
+		if (is_loopback != 1)
+			sp_post_event(SP_EVT_ADDED, y, vttydev2->peer_index);
+
 		mutex_unlock(&adaptlock);
 	} else {
 		/* Destroy device command sent */
@@ -2157,6 +2397,7 @@ static ssize_t sp_vcard_proc_write(struct file *file, const char __user *buf, si
 						}
 						tty_unregister_device(spvtty_driver, index_manager[x].index);
 						kfree(index_manager[x].vttydev);
+						sp_post_event(SP_EVT_REMOVED, x, 0);
 					}
 					index_manager[x].index = -1;
 				}
@@ -2179,59 +2420,13 @@ static ssize_t sp_vcard_proc_write(struct file *file, const char __user *buf, si
 				x++;
 			}
 
-			x = -1;
-			y = -1;
-
 			ret = kstrtouint(tmp, 10, &vdev1idx);
 			if (ret != 0)
 				return ret;
 
-			if ((vdev1idx >= 0) && (vdev1idx <= 65535) && (index_manager[vdev1idx].index != -1)) {
-				mutex_lock(&adaptlock);
-
-				x = index_manager[vdev1idx].index;
-				vttydev1 = index_manager[x].vttydev;
-				sysfs_remove_group(&vttydev1->device->kobj, &sp_info_attr_group);
-				tty_unregister_device(spvtty_driver, index_manager[x].index);
-				if (vttydev1 && vttydev1->own_tty && vttydev1->own_tty->port) {
-					tty = tty_port_tty_get(vttydev1->own_tty->port);
-					if (tty) {
-						tty_vhangup(tty);
-						tty_kref_put(tty);
-					}
-				}
-
-				if (vttydev1->own_index != vttydev1->peer_index) {
-					y = index_manager[vttydev1->peer_index].index;
-					vttydev2 = index_manager[y].vttydev;
-					sysfs_remove_group(&vttydev2->device->kobj, &sp_info_attr_group);
-					tty_unregister_device(spvtty_driver, index_manager[y].index);
-					if (vttydev2 && vttydev2->own_tty && vttydev2->own_tty->port) {
-						tty = tty_port_tty_get(vttydev2->own_tty->port);
-						if (tty) {
-							tty_vhangup(tty);
-							tty_kref_put(tty);
-						}
-					}
-				}
-
-				if (x != -1) {
-					kfree(index_manager[x].vttydev);
-					index_manager[x].index = -1;
-				}
-				if (y != -1) {
-					kfree(index_manager[y].vttydev);
-					index_manager[y].index = -1;
-					--total_nm_pair;
-				} else {
-					--total_lb_devs;
-				}
-
-				mutex_unlock(&adaptlock);
-
-			} else {
-				return -EINVAL;
-			}
+			ret = sp_delete_vdev(vdev1idx);
+			if (ret < 0)
+				return ret;
 		}
 	}
 
@@ -2255,15 +2450,30 @@ fail_arg:
 
 /*
  * Invoked when user space process opens /proc/sp_vmpscrdk file to create/destroy
- * virtual tty device(s).
+ * virtual tty device(s). Files opened for reading get an event queue.
  *
  * @inode: inode in file system corresponding to this file
  * @file: file representing sp proc file
  *
- * @return 0 on success.
+ * @return 0 on success or negative error code on failure.
  */
 static int sp_vcard_proc_open(struct inode *inode, struct  file *file)
 {
+	unsigned long flags;
+	struct sp_evt_queue *q = NULL;
+
+	if (!(file->f_mode & FMODE_READ))
+		return 0;
+
+	q = kzalloc(sizeof(struct sp_evt_queue), GFP_KERNEL);
+	if (q == NULL)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&evtlock, flags);
+	list_add_tail(&q->list, &evt_queues);
+	spin_unlock_irqrestore(&evtlock, flags);
+
+	file->private_data = q;
 	return 0;
 }
 
@@ -2277,15 +2487,50 @@ static int sp_vcard_proc_open(struct inode *inode, struct  file *file)
  */
 static int sp_vcard_proc_close(struct inode *inode, struct file *file)
 {
+	unsigned long flags;
+	struct sp_evt_queue *q = file->private_data;
+
+	if (q == NULL)
+		return 0;
+
+	spin_lock_irqsave(&evtlock, flags);
+	list_del(&q->list);
+	spin_unlock_irqrestore(&evtlock, flags);
+
+	kfree(q);
 	return 0;
 }
 
-static const struct file_operations sp_vcard_proc_fops = {
-	.owner   = THIS_MODULE,
-	.open    = sp_vcard_proc_open,
-	.read    = sp_vcard_proc_read,
-	.write   = sp_vcard_proc_write,
-	.release = sp_vcard_proc_close,
+/*
+ * Invoked when user space process calls poll()/select()/epoll on /proc/sp_vmpscrdk file.
+ *
+ * @file: file representing sp proc file.
+ * @wait: poll table of the caller.
+ *
+ * @return EPOLLIN when events can be read, EPOLLHUP when driver is being unloaded.
+ */
+static __poll_t sp_vcard_proc_poll(struct file *file, poll_table *wait)
+{
+	__poll_t mask = 0;
+	struct sp_evt_queue *q = file->private_data;
+
+	if (q == NULL)
+		return EPOLLERR;
+
+	poll_wait(file, &evt_wait, wait);
+
+	if (sp_evt_ready(q))
+		mask |= evt_closing ? EPOLLHUP : (EPOLLIN | EPOLLRDNORM);
+
+	return mask;
+}
+
+static const struct proc_ops sp_vcard_proc_ops = {
+	.proc_open    = sp_vcard_proc_open,
+	.proc_read    = sp_vcard_proc_read,
+	.proc_write   = sp_vcard_proc_write,
+	.proc_poll    = sp_vcard_proc_poll,
+	.proc_release = sp_vcard_proc_close,
 };
 
 static const struct tty_operations sp_serial_ops = {
@@ -2314,6 +2559,10 @@ static const struct tty_operations sp_serial_ops = {
 	.get_icount      = sp_get_icount,
 };
 
+#ifdef TTY2COM_KUNIT
+#include "tty2com_kunit.c"
+#endif
+
 /*
  * Invoked when this driver is loaded. If the user supplies correct number of virtual devices
  * to be created when this module is loaded, the virtual devices will be made, otherwise they
@@ -2382,7 +2631,7 @@ static int __init sp_tty2com_init(void)
 
 	/* Application should read/write to this file to create/destroy tty device and query informations associated
 	 * with them */
-	pde = proc_create("sp_vmpscrdk", 0666, NULL, &sp_vcard_proc_fops);
+	pde = proc_create("sp_vmpscrdk", 0666, NULL, &sp_vcard_proc_ops);
 	if (pde == NULL) {
 		ret = -ENOMEM;
 		goto failed_proc;
@@ -2405,6 +2654,10 @@ static int __init sp_tty2com_init(void)
 	}
 
 	pr_info("Serial port null modem emulation driver v1.0\n");
+
+#ifdef TTY2COM_KUNIT
+	sp_kunit_run();
+#endif
 	return 0;
 
 failed_proc:
@@ -2427,6 +2680,17 @@ static void __exit sp_tty2com_exit(void)
 	int x = 0;
 	struct vtty_dev *vttydev = NULL;
 	struct tty_struct *tty;
+	unsigned long flags;
+
+#ifdef TTY2COM_KUNIT
+	sp_kunit_exit();
+#endif
+
+	/* Readers blocked on proc file would keep remove_proc_entry() waiting */
+	spin_lock_irqsave(&evtlock, flags);
+	evt_closing = 1;
+	spin_unlock_irqrestore(&evtlock, flags);
+	wake_up_interruptible_all(&evt_wait);
 
 	remove_proc_entry("sp_vmpscrdk", NULL);
 
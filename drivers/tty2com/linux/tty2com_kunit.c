@@ -0,0 +1,471 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Serial port null modem emulation driver (tty2com), KUnit tests
+ *
+ * Copyright (c) 2020, Rishi Gupta <gupt21@gmail.com>
+ *
+ * Included by tty2com.c when built with TTYVS_KUNIT=1, so that the tests can reach static functions
+ * of the driver. Same as the tests of ttyvs in ttyvs_kunit.c these need no hardware and run under
+ * UML or QEMU on a 5.12 or 5.13 kernel with CONFIG_KUNIT; see there how to run them.
+ *
+ * Every case creates a fresh standard null modem pair through sp_vcard_proc_write(), as module init
+ * does, and opens both ends from the kernel. Bytes reaching the receiver's tty buffer are captured
+ * in place of the line discipline. As sp_write() inserts data into the receiver's flip buffer right
+ * away, the cases exercise the whole data path of this driver.
+ *
+ * The tty2com_bench suite reports bytes/s and ns/write for a range of write sizes and is built only
+ * with TTYVS_KUNIT_BENCH=1.
+ */
+
+#include <kunit/test.h>
+
+#define SP_TEST_BUF      4096
+#define SP_TEST_TIMEOUT  (2 * HZ)
+
+struct sp_test_ctx {
+	int idx[2];
+	struct tty_struct *tty[2];
+	/* received by each end, first SP_TEST_BUF bytes are kept */
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	size_t rx_total[2];
+	unsigned char rx[2][SP_TEST_BUF];
+};
+
+/* Client operations of the ports point to the running test */
+static struct sp_test_ctx *sp_test_cur;
+
+static int sp_test_receive_buf(struct tty_port *port, const unsigned char *p, const unsigned char *f,
+		size_t count)
+{
+	int end;
+	size_t off, n;
+	unsigned long flags;
+	struct sp_test_ctx *ctx = sp_test_cur;
+
+	end = (port == ctx->tty[0]->port) ? 0 : 1;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	off = ctx->rx_total[end];
+	if (off < SP_TEST_BUF) {
+		n = min_t(size_t, count, SP_TEST_BUF - off);
+		memcpy(&ctx->rx[end][off], p, n);
+	}
+	ctx->rx_total[end] += count;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	wake_up(&ctx->wait);
+	return count;
+}
+
+/* sp_unthrottle() wakes up the writer of the other end */
+static void sp_test_write_wakeup(struct tty_port *port)
+{
+	wake_up(&sp_test_cur->wait);
+}
+
+static const struct tty_port_client_operations sp_test_client_ops = {
+	.receive_buf  = sp_test_receive_buf,
+	.write_wakeup = sp_test_write_wakeup,
+};
+
+static size_t sp_test_rx_total(struct sp_test_ctx *ctx, int end)
+{
+	size_t n;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	n = ctx->rx_total[end];
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return n;
+}
+
+/* Waits until end has received at least n bytes, returns 0 on timeout */
+static int sp_test_wait_rx(struct sp_test_ctx *ctx, int end, size_t n)
+{
+	return wait_event_timeout(ctx->wait, sp_test_rx_total(ctx, end) >= n, SP_TEST_TIMEOUT);
+}
+
+/* Opens device at given index as tty core would for open() */
+static struct tty_struct *sp_test_open(int idx)
+{
+	int ret;
+	struct tty_struct *tty;
+
+	tty = tty_kopen_exclusive(MKDEV(spvtty_driver->major, spvtty_driver->minor_start + idx));
+	if (IS_ERR(tty))
+		return tty;
+
+	/* no file, tty_port_open() does not wait for carrier */
+	ret = sp_open(tty, NULL);
+	tty_unlock(tty);
+	if (ret) {
+		tty_kclose(tty);
+		return ERR_PTR(ret);
+	}
+
+	tty->port->client_ops = &sp_test_client_ops;
+	return tty;
+}
+
+/* sp_close() needs a file, so port is closed here and the tty is forgotten before it is freed */
+static void sp_test_close(struct tty_struct *tty)
+{
+	struct vtty_dev *local_vttydev = index_manager[tty->index].vttydev;
+	struct vtty_dev *remote_vttydev = index_manager[local_vttydev->peer_index].vttydev;
+
+	tty_lock(tty);
+	tty_port_close(tty->port, tty, NULL);
+	local_vttydev->own_tty = NULL;
+	if (remote_vttydev->peer_tty == tty)
+		remote_vttydev->peer_tty = NULL;
+	tty_unlock(tty);
+	tty_kclose(tty);
+}
+
+/* Applies same c_cflag to both ends, as mismatched ends drop data */
+static void sp_test_set_cflag(struct sp_test_ctx *ctx, tcflag_t cflag)
+{
+	int x;
+	struct ktermios kt;
+
+	for (x = 0; x < 2; x++) {
+		kt = ctx->tty[x]->termios;
+		kt.c_cflag = cflag;
+		tty_set_termios(ctx->tty[x], &kt);
+	}
+}
+
+/*
+ * KUnit calls exit even when init failed, so the context is given to the test before anything
+ * needs undoing and exit undoes only what init got done.
+ */
+static int sp_test_init(struct kunit *test)
+{
+	int x, ret;
+	struct sp_test_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if (ctx == NULL)
+		return -ENOMEM;
+
+	ctx->idx[0] = ctx->idx[1] = -1;
+	spin_lock_init(&ctx->lock);
+	init_waitqueue_head(&ctx->wait);
+	test->priv = ctx;
+
+	/* standard null modem pair, as with init_num_nm_pair */
+	ret = sp_vcard_proc_write(NULL, NULL, 2, NULL);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&adaptlock);
+	ctx->idx[0] = last_nmdev1_idx;
+	ctx->idx[1] = last_nmdev2_idx;
+	mutex_unlock(&adaptlock);
+
+	sp_test_cur = ctx;
+	for (x = 0; x < 2; x++) {
+		ctx->tty[x] = sp_test_open(ctx->idx[x]);
+		if (IS_ERR(ctx->tty[x])) {
+			ret = PTR_ERR(ctx->tty[x]);
+			ctx->tty[x] = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void sp_test_exit(struct kunit *test)
+{
+	int x;
+	struct sp_test_ctx *ctx = test->priv;
+
+	if (ctx == NULL)
+		return;
+
+	for (x = 0; x < 2; x++) {
+		if (ctx->tty[x])
+			sp_test_close(ctx->tty[x]);
+	}
+
+	if (ctx->idx[0] >= 0)
+		sp_delete_vdev(ctx->idx[0]);
+	sp_test_cur = NULL;
+}
+
+/* Both ends exist, point to each other and carry standard mappings */
+static void sp_test_pair_create(struct kunit *test)
+{
+	int x;
+	struct vtty_dev *vttydev[2];
+	struct sp_test_ctx *ctx = test->priv;
+
+	KUNIT_EXPECT_NE(test, ctx->idx[0], ctx->idx[1]);
+
+	for (x = 0; x < 2; x++) {
+		vttydev[x] = index_manager[ctx->idx[x]].vttydev;
+		KUNIT_ASSERT_NOT_NULL(test, vttydev[x]);
+	}
+
+	for (x = 0; x < 2; x++) {
+		KUNIT_EXPECT_EQ(test, vttydev[x]->own_index, (unsigned int)ctx->idx[x]);
+		KUNIT_EXPECT_EQ(test, vttydev[x]->peer_index, (unsigned int)ctx->idx[!x]);
+		KUNIT_EXPECT_EQ(test, vttydev[x]->rts_mappings, SP_CON_CTS);
+		KUNIT_EXPECT_EQ(test, vttydev[x]->dtr_mappings, SP_CON_DSR | SP_CON_DCD);
+		KUNIT_EXPECT_EQ(test, vttydev[x]->odevtyp, SNM);
+		KUNIT_EXPECT_TRUE(test, vttydev[x]->own_tty == ctx->tty[x]);
+		KUNIT_EXPECT_TRUE(test, vttydev[x]->peer_tty == ctx->tty[!x]);
+	}
+}
+
+/* Data written on one end arrives unchanged on the other, both ways */
+static void sp_test_write_delivery(struct kunit *test)
+{
+	int x, ret;
+	unsigned char buf[300];
+	struct sp_test_ctx *ctx = test->priv;
+
+	for (x = 0; x < sizeof(buf); x++)
+		buf[x] = x;
+
+	for (x = 0; x < 2; x++) {
+		ret = sp_write(ctx->tty[x], buf, sizeof(buf));
+		KUNIT_EXPECT_EQ(test, ret, (int)sizeof(buf));
+
+		KUNIT_ASSERT_TRUE(test, sp_test_wait_rx(ctx, !x, sizeof(buf)));
+		KUNIT_EXPECT_EQ(test, sp_test_rx_total(ctx, !x), sizeof(buf));
+		KUNIT_EXPECT_EQ(test, memcmp(ctx->rx[!x], buf, sizeof(buf)), 0);
+	}
+}
+
+/* sp_put_char() delivers single bytes in order */
+static void sp_test_put_char(struct kunit *test)
+{
+	struct sp_test_ctx *ctx = test->priv;
+
+	KUNIT_EXPECT_EQ(test, sp_put_char(ctx->tty[0], 'a'), 1);
+	KUNIT_EXPECT_EQ(test, sp_put_char(ctx->tty[0], 'b'), 1);
+
+	KUNIT_ASSERT_TRUE(test, sp_test_wait_rx(ctx, 1, 2));
+	KUNIT_EXPECT_EQ(test, ctx->rx[1][0], (unsigned char)'a');
+	KUNIT_EXPECT_EQ(test, ctx->rx[1][1], (unsigned char)'b');
+}
+
+/* Upper bits beyond character size of the receiver are lost as on a real line */
+static void sp_test_data_bits(struct kunit *test)
+{
+	static const struct {
+		tcflag_t csize;
+		unsigned char mask;
+	} sizes[] = {
+		{ CS5, 0x1F }, { CS6, 0x3F }, { CS7, 0x7F }, { CS8, 0xFF },
+	};
+	int x, y;
+	size_t done = 0;
+	unsigned char buf[64];
+	struct sp_test_ctx *ctx = test->priv;
+	tcflag_t cflag = ctx->tty[0]->termios.c_cflag & ~CSIZE;
+
+	memset(buf, 0xFF, sizeof(buf));
+	buf[0] = 0xA5;
+
+	for (x = 0; x < ARRAY_SIZE(sizes); x++) {
+		sp_test_set_cflag(ctx, cflag | sizes[x].csize);
+
+		KUNIT_EXPECT_EQ(test, sp_write(ctx->tty[0], buf, sizeof(buf)), (int)sizeof(buf));
+		done += sizeof(buf);
+		KUNIT_ASSERT_TRUE(test, sp_test_wait_rx(ctx, 1, done));
+
+		KUNIT_EXPECT_EQ(test, ctx->rx[1][done - sizeof(buf)], (unsigned char)(0xA5 & sizes[x].mask));
+		for (y = 1; y < sizeof(buf); y++)
+			KUNIT_EXPECT_EQ(test, ctx->rx[1][done - sizeof(buf) + y], sizes[x].mask);
+	}
+}
+
+/*
+ * With RTS/CTS flow control, a throttled receiver drops its RTS and with it CTS of the sender,
+ * which stops taking data until unthrottled.
+ */
+static void sp_test_throttle(struct kunit *test)
+{
+	unsigned char ch = 'x';
+	struct vtty_dev *tx_vttydev;
+	struct sp_test_ctx *ctx = test->priv;
+
+	tx_vttydev = index_manager[ctx->idx[0]].vttydev;
+	sp_test_set_cflag(ctx, ctx->tty[0]->termios.c_cflag | CRTSCTS);
+	KUNIT_EXPECT_TRUE(test, sp_tiocmget(ctx->tty[0]) & TIOCM_CTS);
+
+	sp_throttle(ctx->tty[1]);
+	KUNIT_EXPECT_FALSE(test, sp_tiocmget(ctx->tty[1]) & TIOCM_RTS);
+	KUNIT_EXPECT_FALSE(test, sp_tiocmget(ctx->tty[0]) & TIOCM_CTS);
+	KUNIT_EXPECT_EQ(test, tx_vttydev->tx_paused, 1);
+	KUNIT_EXPECT_EQ(test, sp_write_room(ctx->tty[0]), 0);
+	KUNIT_EXPECT_EQ(test, sp_write(ctx->tty[0], &ch, 1), 0);
+
+	sp_unthrottle(ctx->tty[1]);
+	KUNIT_EXPECT_TRUE(test, sp_tiocmget(ctx->tty[1]) & TIOCM_RTS);
+	KUNIT_EXPECT_TRUE(test, sp_tiocmget(ctx->tty[0]) & TIOCM_CTS);
+	KUNIT_EXPECT_EQ(test, tx_vttydev->tx_paused, 0);
+	KUNIT_EXPECT_GT(test, sp_write_room(ctx->tty[0]), 0);
+
+	KUNIT_EXPECT_EQ(test, sp_write(ctx->tty[0], &ch, 1), 1);
+	KUNIT_EXPECT_TRUE(test, sp_test_wait_rx(ctx, 1, 1));
+}
+
+/* Standard pin out: RTS drives peer's CTS, DTR drives its DSR and DCD */
+static void sp_test_modem_lines(struct kunit *test)
+{
+	int msr;
+	struct sp_test_ctx *ctx = test->priv;
+
+	sp_tiocmset(ctx->tty[0], 0, TIOCM_RTS | TIOCM_DTR);
+	msr = sp_tiocmget(ctx->tty[1]);
+	KUNIT_EXPECT_FALSE(test, msr & (TIOCM_CTS | TIOCM_DSR | TIOCM_CAR));
+
+	sp_tiocmset(ctx->tty[0], TIOCM_RTS, 0);
+	msr = sp_tiocmget(ctx->tty[1]);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_CTS);
+	KUNIT_EXPECT_FALSE(test, msr & (TIOCM_DSR | TIOCM_CAR));
+
+	sp_tiocmset(ctx->tty[0], TIOCM_DTR, TIOCM_RTS);
+	msr = sp_tiocmget(ctx->tty[1]);
+	KUNIT_EXPECT_FALSE(test, msr & TIOCM_CTS);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_DSR);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_CAR);
+	KUNIT_EXPECT_FALSE(test, msr & TIOCM_RI);
+
+	/* lines of the writer itself follow what it set */
+	msr = sp_tiocmget(ctx->tty[0]);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_DTR);
+	KUNIT_EXPECT_FALSE(test, msr & TIOCM_RTS);
+}
+
+static struct kunit_case sp_test_cases[] = {
+	KUNIT_CASE(sp_test_pair_create),
+	KUNIT_CASE(sp_test_write_delivery),
+	KUNIT_CASE(sp_test_put_char),
+	KUNIT_CASE(sp_test_data_bits),
+	KUNIT_CASE(sp_test_throttle),
+	KUNIT_CASE(sp_test_modem_lines),
+	{}
+};
+
+static struct kunit_suite sp_test_suite = {
+	.name = "tty2com",
+	.init = sp_test_init,
+	.exit = sp_test_exit,
+	.test_cases = sp_test_cases,
+};
+
+#ifdef TTY2COM_KUNIT_BENCH
+
+/*
+ * Bytes written but not yet received at most. sp_write() has no transmit queue of its own and drops
+ * what does not fit in the receiver's flip buffer, so the writer waits for the receiver beyond this.
+ */
+#define SP_BENCH_WINDOW  (16 * 1024)
+
+/*
+ * Writes 'total' bytes in writes of 'size' bytes as fast as the receiver takes them and times until
+ * the last byte reached the receiver.
+ */
+static void sp_bench_one(struct kunit *test, int size, size_t total)
+{
+	int n, ret;
+	u64 ns, writes = 0;
+	size_t done = 0;
+	ktime_t start;
+	unsigned char *buf;
+	struct sp_test_ctx *ctx = test->priv;
+	size_t base = sp_test_rx_total(ctx, 1);
+
+	buf = kunit_kmalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	memset(buf, 0x55, size);
+
+	start = ktime_get();
+	while (done < total) {
+		n = min_t(size_t, size, total - done);
+		if (done + n > SP_BENCH_WINDOW)
+			KUNIT_ASSERT_TRUE(test, sp_test_wait_rx(ctx, 1, base + done + n - SP_BENCH_WINDOW));
+
+		ret = sp_write(ctx->tty[0], buf, n);
+		KUNIT_ASSERT_EQ(test, ret, n);
+		done += n;
+		writes++;
+	}
+	KUNIT_ASSERT_TRUE(test, sp_test_wait_rx(ctx, 1, base + total));
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start)) ? : 1;
+
+	kunit_info(test, "write size %4d: %llu bytes/s, %llu ns/write\n", size,
+			div64_u64((u64)total * NSEC_PER_SEC, ns), div64_u64(ns, writes));
+}
+
+static void sp_bench_write(struct kunit *test)
+{
+	static const int sizes[] = { 1, 16, 64, 256, 1024, 4096 };
+	int x;
+
+	for (x = 0; x < ARRAY_SIZE(sizes); x++)
+		sp_bench_one(test, sizes[x], (sizes[x] == 1) ? (64 * 1024) : (4 * 1024 * 1024));
+}
+
+static struct kunit_case sp_bench_cases[] = {
+	KUNIT_CASE(sp_bench_write),
+	{}
+};
+
+static struct kunit_suite sp_bench_suite = {
+	.name = "tty2com_bench",
+	.init = sp_test_init,
+	.exit = sp_test_exit,
+	.test_cases = sp_bench_cases,
+};
+
+#endif
+
+#ifdef MODULE
+
+static struct kunit_suite *sp_kunit_suites[] = {
+	&sp_test_suite,
+#ifdef TTY2COM_KUNIT_BENCH
+	&sp_bench_suite,
+#endif
+	NULL,
+};
+
+/*
+ * Called at the end of sp_tty2com_init() and start of sp_tty2com_exit(). Suites are not registered
+ * with kunit_test_suites() as in a module that would add a second module_init.
+ */
+static void sp_kunit_run(void)
+{
+	__kunit_test_suites_init(sp_kunit_suites);
+}
+
+static void sp_kunit_exit(void)
+{
+	__kunit_test_suites_exit(sp_kunit_suites);
+}
+
+#else
+
+/* Built in, KUnit runs the suites once all initcalls are done, see Kconfig */
+kunit_test_suites(&sp_test_suite);
+#ifdef TTY2COM_KUNIT_BENCH
+kunit_test_suites(&sp_bench_suite);
+#endif
+
+static void sp_kunit_run(void)
+{
+}
+
+static void sp_kunit_exit(void)
+{
+}
+
+#endif
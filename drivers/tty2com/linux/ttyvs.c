@@ -15,6 +15,11 @@
  * ports (tty devices). The virtual tty devices created by this card
  * are used in exactly the same way as the real tty devices using
  * standard termios and Linux/Posix APIs.
+ *
+ * Kernel versions:
+ * This driver is written against tty driver API of Linux 5.12 and 5.13
+ * (int returning write_room, put_tty_driver and the _irq flavour of
+ * u64_stats readers) and does not build elsewhere.
  */
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
@@ -33,8 +38,39 @@
 #include <linux/sched.h>
 #include <linux/version.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/kref.h>
+#include <linux/spinlock.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/device.h>
 #include <linux/miscdevice.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/random.h>
+#include <linux/capability.h>
+#include <linux/firmware.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+
+#include "ttyvs.h"
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)) || \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
+#error "ttyvs supports Linux 5.12 and 5.13 only"
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "ttyvs_trace.h"
 
 /*
  * By default 128 devices can be created. This number can be
@@ -42,11 +78,70 @@
  */
 #define DEFAULT_VS_DEV_MAX  128
 
-/* Pin out configurations definitions */
-#define VS_CON_CTS    0x0001
-#define VS_CON_DCD    0x0002
-#define VS_CON_DSR    0x0004
-#define VS_CON_RI     0x0008
+/*
+ * Size of the transmit ring of each device. Data written by an
+ * application is queued here and delivered to the receiver's tty
+ * buffer asynchronously. Must be a power of 2.
+ */
+#define VS_TX_RING_SIZE     4096
+
+/*
+ * Maximum number of bytes put_char stages in the transmit ring before
+ * delivery is started without waiting for flush_chars.
+ */
+#define VS_PUTCHAR_BATCH    64
+
+/*
+ * In paced mode, minimum interval between two consecutive deliveries.
+ * At high baudrates characters due in this interval are delivered
+ * together instead of arming a timer for every character.
+ */
+#define VS_PACE_MIN_NS      (100 * NSEC_PER_USEC)
+
+/*
+ * When the receiver uses flow control and its tty buffer is full,
+ * delivery is retried after this many milli seconds in case no
+ * unthrottle arrives to restart it.
+ */
+#define VS_TX_RETRY_MS      2
+
+/*
+ * Data which can not be moved straight from the transmit ring into
+ * the receiver's tty buffer, as on an RS-485 bus or with receive
+ * address filter, is taken off the ring in chunks of this many bytes.
+ */
+#define VS_TX_CHUNK         256
+
+/* Largest capture ring of a tap, see struct vs_tap_attach */
+#define VS_TAP_RING_MAX     (64 << 20)
+
+/* Data longer than this is recorded by a tap as multiple records */
+#define VS_TAP_MAX_DATA     1024
+
+/* Records an event channel holds, default and largest */
+#define VS_EVT_QUEUE_LEN    1024
+#define VS_EVT_QUEUE_MAX    65536
+
+/*
+ * Writes in flight tracked per receiver for latency measurement, must
+ * be a power of 2. Writes beyond this many are not sampled.
+ */
+#define VS_LAT_MARKS        64
+#define VS_LAT_IDX(x)       ((x) & (VS_LAT_MARKS - 1))
+
+/* Latency histogram buckets, bucket X counts samples of 2^X ns */
+#define VS_LAT_BUCKETS      40
+
+/*
+ * Delayed writes tracked per impaired device, must be a power of 2.
+ * Beyond this writes are merged with the last one and wait as long
+ * as the later of the two.
+ */
+#define VS_IMP_HOLDS        64
+#define VS_IMP_IDX(x)       ((x) & (VS_IMP_HOLDS - 1))
+
+/* Largest delay plus jitter of an impaired line in micro seconds */
+#define VS_IMP_DELAY_MAX    (10 * USEC_PER_SEC)
 
 /* Modem control register definitions */
 #define VS_MCR_DTR    0x0001
@@ -75,11 +170,41 @@
 #define VS_STOP_1        0x1000
 #define VS_STOP_2        0x2000
 
-/* Constants for the device type (odevtyp) */
-#define VS_SNM 0x0001
-#define VS_CNM 0x0002
-#define VS_SLB 0x0003
-#define VS_CLB 0x0004
+/*
+ * Receive address filter, kept in one word so that the delivery path
+ * reads a consistent copy without locking.
+ */
+#define VS_RXF_ON           0x10000
+#define VS_RXF_ADDR(f)      ((f) & 0xFF)
+#define VS_RXF_MASK(f)      (((f) >> 8) & 0xFF)
+
+/* Traffic counters, same order as in struct vs_ioc_stats */
+enum {
+	VS_STAT_TX_BYTES,
+	VS_STAT_RX_BYTES,
+	VS_STAT_WRITE_CALLS,
+	VS_STAT_DROP_MISMATCH,
+	VS_STAT_DROP_FAULTY,
+	VS_STAT_DROP_NOREADER,
+	VS_STAT_DROP_OVERRUN,
+	VS_STAT_THROTTLE,
+	VS_STAT_NUM,
+};
+
+/*
+ * Per CPU copy of traffic counters of a device. Counters are updated
+ * from both process and softirq context, syncp keeps 64 bit reads
+ * consistent on 32 bit systems.
+ */
+struct vs_pcpu_stats {
+	u64 cnt[VS_STAT_NUM];
+	struct u64_stats_sync syncp;
+};
+
+struct vs_bus;
+struct vs_tap;
+struct vs_lat;
+struct vs_imp;
 
 /* Represents a virtual tty device in this virtual card */
 struct vs_dev {
@@ -98,8 +223,8 @@ struct vs_dev {
 	int set_odtr_at_open;
 	int set_pdtr_at_open;
 	int odevtyp;
-	/* mutual exclusion at device level */
-	struct mutex lock;
+	/* protects modem lines, break and flow control state */
+	spinlock_t lock;
 	int is_break_on;
 	/* currently active baudrate */
 	int baud;
@@ -107,11 +232,227 @@ struct vs_dev {
 	int waiting_msr_chg;
 	int tx_paused;
 	int faulty_cable;
+	/* set while at least one file has this device open */
+	int is_open;
+	/*
+	 * tty open on this device, set and cleared under tx_lock while an
+	 * open file holds the tty; use vs_tty_get() outside tty operations
+	 * of this device itself
+	 */
 	struct tty_struct *own_tty;
-	struct tty_struct *peer_tty;
 	struct serial_struct serial;
 	struct async_icount icount;
 	struct device *device;
+	/* data written but not yet delivered to the receiver */
+	DECLARE_KFIFO_PTR(tx_fifo, unsigned char);
+	/*
+	 * protects tx_fifo and own_tty, held by both writer and drain work;
+	 * data goes into the peer's tty buffer only under this lock
+	 */
+	spinlock_t tx_lock;
+	/*
+	 * depth of emulated UART transmit FIFO, bytes which may be queued
+	 * in tx_fifo at a time; protected by tx_lock
+	 */
+	unsigned int fifo_depth;
+	/* moves data from tx_fifo into the receiver's tty buffer */
+	struct delayed_work tx_work;
+	/* deliver data at the rate of configured baudrate and frame */
+	int paced;
+	/* time to shift out one character on line in nano seconds */
+	u64 char_time_ns;
+	/* delivers characters as they complete in paced mode */
+	struct hrtimer pace_timer;
+	/* bytes queued by put_char since delivery was last started */
+	int put_staged;
+	/* line time upto which characters have been accounted */
+	ktime_t pace_last;
+	/* pace_timer is armed, protected by tx_lock */
+	int pace_running;
+	struct vs_pcpu_stats __percpu *stats;
+	/* device at the other end, self for loop back, NULL once deleted */
+	struct vs_dev __rcu *peer;
+	/* set when device is deleted, no more delivery is started */
+	int removed;
+	/* one reference held by db[] and one by each installed tty */
+	struct kref kref;
+	struct rcu_head rcu;
+	/* RS-485 bus this device is member of, fixed at creation */
+	struct vs_bus *bus;
+	/* settings given by TIOCSRS485, protected by lock */
+	struct serial_rs485 rs485;
+	/* receive address filter, VS_RXF_xxx, 0 if off */
+	int rx_filter;
+	/* last address byte received selected this device */
+	int rx_addr_match;
+	/* tap recording traffic of this device, NULL if none */
+	struct vs_tap __rcu *tap;
+	/* latency of data received by this device, NULL if not measured */
+	struct vs_lat __rcu *lat;
+	/* impairment of data sent by this device, NULL for a clean line */
+	struct vs_imp __rcu *imp;
+	/* CPU delivering data to this device, -1 for the sender's CPU */
+	int rxcpu;
+};
+
+/*
+ * Emulated half duplex RS-485 bus shared by two or more devices. Data
+ * sent by a member is delivered to all other members by the sender's
+ * delivery work, so adding members costs one copy per member and no
+ * extra tty. The bus lives as long as any of its members.
+ */
+struct vs_bus {
+	/* index of the first member, identifies the bus */
+	unsigned int id;
+	int collision_detect;
+	/* serializes deliveries on the bus, protects fields below */
+	spinlock_t lock;
+	/* member whose data is on the bus now, may be stale */
+	struct vs_dev *driver;
+	unsigned long collisions;
+	/* one reference held by each member */
+	struct kref kref;
+	int nmembers;
+	struct vs_dev *members[];
+};
+
+/*
+ * Read only tap recording traffic and line events of a set of devices
+ * into a ring mapped by user space, see struct vs_tap_hdr. A tap is
+ * owned by the file of /dev/ttyvs_card it was attached with.
+ */
+struct vs_tap {
+	/* serializes writers of records */
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	/* vmalloc_user() area, header page followed by the ring */
+	struct vs_tap_hdr *hdr;
+	unsigned char *data;
+	u64 data_size;
+	/* private copy of head, user space may scribble on the header */
+	u64 head;
+	u64 lost;
+	size_t map_size;
+	/* devices tapped, a reference is held to each */
+	int ndevs;
+	struct vs_dev *devs[];
+};
+
+/*
+ * Event channel opened with VS_IOC_EVT_OPEN, see struct vs_evt_open.
+ * Channels are looked up when an event happens, so devices need not
+ * know about them and may come and go while a channel is open.
+ */
+struct vs_evt_chan {
+	/* in vs_evt_chans */
+	struct list_head node;
+	/* protects the queue */
+	spinlock_t lock;
+	/* one reader at a time, only readers move 'tail' */
+	struct mutex read_lock;
+	wait_queue_head_t wait;
+	u32 first;
+	u32 last;
+	u32 mask;
+	/* free running record counts, 'size' is a power of 2 */
+	u32 head;
+	u32 tail;
+	u32 size;
+	/* events lost since the queue became full */
+	u32 lost;
+	struct vs_evt ring[];
+};
+
+/* Latency distribution of one stage, times in nano seconds */
+struct vs_lat_hist {
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u32 bucket[VS_LAT_BUCKETS];
+};
+
+/* A write in flight, 'seq' is position of its first byte in a stream */
+struct vs_lat_mark {
+	u32 seq;
+	u64 write_ns;
+	u64 deliver_ns;
+};
+
+/*
+ * Latency measurement of the data received by a device, see
+ * latency_store(). A write is marked with its time and the position of
+ * its first byte in the sender's transmit ring. When delivery moves
+ * that byte into the receiver's tty buffer the mark moves over to the
+ * stream of bytes given to the tty buffer, and the sample completes
+ * when line discipline consumes the byte. Positions are free running
+ * byte counts, compared with wrap around.
+ */
+struct vs_lat {
+	/* protects everything below, nests inside sender's tx_lock */
+	spinlock_t lock;
+	/* bytes taken out of sender's transmit ring */
+	u32 tx_out;
+	/* bytes given to and consumed from receiver's tty buffer */
+	u32 rx_in;
+	u32 rx_out;
+	/* free running indexes of the mark rings below */
+	unsigned int tx_head;
+	unsigned int tx_tail;
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	struct vs_lat_mark tx_mark[VS_LAT_MARKS];
+	struct vs_lat_mark rx_mark[VS_LAT_MARKS];
+	/* write() to receiver's tty buffer, i.e. queueing in this driver */
+	struct vs_lat_hist queue;
+	/* write() to line discipline of receiver */
+	struct vs_lat_hist e2e;
+	struct rcu_head rcu;
+};
+
+/* Data of one write held back by an impaired line until 'due_ns' */
+struct vs_imp_hold {
+	u32 len;
+	u64 due_ns;
+};
+
+/*
+ * Line impairment applied to data written to a device, see
+ * impair_store(). Configuration is fixed once published, a new one
+ * replaces the whole structure. Probabilities are scaled to 2^32.
+ * The held writes describe the last 'held' bytes of transmit ring;
+ * bytes in front of them are ready for delivery.
+ */
+struct vs_imp {
+	/* configuration as given by user */
+	u64 seed;
+	u32 ber;
+	u32 burst;
+	u32 burst_len;
+	u32 drop;
+	u32 dup;
+	u32 delay_us;
+	u32 jitter_us;
+	u32 p_bit;
+	u32 p_byte;
+	u32 p_burst;
+	u32 p_drop;
+	u32 p_dup;
+	/* state below is protected by tx_lock of the device */
+	struct rnd_state rnd;
+	u32 burst_left;
+	u64 flipped;
+	u64 bursts;
+	u64 dropped;
+	u64 duplicated;
+	u32 held;
+	u64 last_due;
+	unsigned int hold_head;
+	unsigned int hold_tail;
+	struct vs_imp_hold hold[VS_IMP_HOLDS];
+	/* impaired copy of the data, duplication may double it */
+	unsigned char buf[2 * VS_TX_RING_SIZE];
+	struct rcu_head rcu;
 };
 
 /*
@@ -120,1931 +461,5362 @@ struct vs_dev {
  */
 struct vs_info {
 	int index;
-	struct vs_dev *vsdev;
+	struct vs_dev __rcu *vsdev;
+};
+
+/* Describes a null modem pair or a loop back device to be created */
+struct vs_spec {
+	int is_loopback;
+	/* index of each end, -1 means first free index */
+	int idx1;
+	int idx2;
+	int rts1;
+	int dtr1;
+	int rts2;
+	int dtr2;
+	/* assert DTR when the end is opened */
+	int odtr1;
+	int odtr2;
+	/* number of members if an RS-485 bus is to be created */
+	int bus_members;
+	int bus_collision;
+	/* indexes of members after the first, NULL for first free ones */
+	const int *member_idx;
 };
 
+/* Creation commands for standard null modem pair and loop back */
+static const char vs_std_nm_cmd[] =
+	"gennm#xxxxx#xxxxx#7-8,x,x,x#4-1,6,x,x#7-8,x,x,x#4-1,6,x,x#y#y";
+static const char vs_std_lb_cmd[] =
+	"genlb#xxxxx#xxxxx#7-8,x,x,x#4-1,6,x,x#x-x,x,x,x#x-x,x,x,x#y#x";
+
 /*
  * Root of database of all devices managed by this driver. Devices
  * are referenced using this root. For ex; to retreive struct vs_dev
- * of 3rd device use db[3].vsdev.
+ * of 3rd device use vs_dev_locked(3).
+ *
+ * Entries are published with RCU and changed only with adaptlock
+ * held. The tty operations never look up this table except when a
+ * tty is installed; they use tty->driver_data which holds a reference
+ * to the device and reach the other end through vsdev->peer under
+ * rcu_read_lock(). A deleted device is freed after a grace period
+ * once its last tty is released, so the data path runs lock free
+ * against creation and deletion of devices.
  */
 static struct vs_info *db;
 
+/*
+ * Index allocator. Bit X of vs_idx_map is set when ttyvsX is in use
+ * and bit Y of vs_idx_full is set when all the indexes in word Y of
+ * vs_idx_map are in use. Finding a free index therefore scans only
+ * the small summary bitmap and one word of vs_idx_map. Bits beyond
+ * max_num_vs_dev are permanently set. Protected by adaptlock.
+ */
+static unsigned long *vs_idx_map;
+static unsigned long *vs_idx_full;
+
 /*
  * Synchronization at adapter level for ex; creating/destroying
  * devices must be atomic.
  */
 static DEFINE_MUTEX(adaptlock);
 
+/* Open event channels, changed with adaptlock held, walked with RCU */
+static LIST_HEAD(vs_evt_chans);
+
 /* Describes this driver kernel module */
 static struct tty_driver *ttyvs_driver;
 
+/* Runs delivery work of all devices, see vs_tx_queue() */
+static struct workqueue_struct *vs_wq;
+
 static int minor_begin;
+static bool highpri_wq;
 static ushort max_num_vs_dev = DEFAULT_VS_DEV_MAX;
 static ushort init_num_nm_pair;
 static ushort init_num_lb_dev;
+static char *topology;
 
 static ushort total_nm_pair;
 static ushort total_lb_devs;
+static ushort total_buses;
 static int last_lbdev_idx   = -1;
 static int last_nmdev1_idx  = -1;
 static int last_nmdev2_idx  = -1;
 
+/* Gives the device at index 'idx'. Caller holds adaptlock. */
+static struct vs_dev *vs_dev_locked(int idx)
+{
+	return rcu_dereference_protected(db[idx].vsdev,
+					lockdep_is_held(&adaptlock));
+}
+
 /*
- * Notifies tty core that a framing/parity/overrun error has happend
- * while receiving data on serial port. When frame or parity error
- * happens, -7 (randomly selected number by this driver) is sent as
- * byte that got corrupted to tty core. For emulation purpose 0 can
- * not be taken as corrupted byte because parity and break both will
- * have same sequence (octal \377 \0 \0) and therefore application
- * will not be able to differentiate between these two.
- *
- * This is also used for asserting/de-asserting ring event on line and
- * notifies tty core when a break condition has been detected on line.
- *
- * 1. Emulate framing error:
- * $ echo "1" > /sys/devices/virtual/tty/ttyVS0/event
- *
- * 2. Emulate parity error:
- * $ echo "2" > /sys/devices/virtual/tty/ttyVS0/event
- *
- * 3. Emulate overrun error:
- * $ echo "3" > /sys/devices/virtual/tty/ttyVS0/event
- *
- * 4. Emulate ring indicator (set RI signal):
- * $ echo "4" > /sys/devices/virtual/tty/ttyVS0/event
- *
- * 5. Emulate ring indicator (unset RI signal):
- * $ echo "5" > /sys/devices/virtual/tty/ttyVS0/event
- *
- * 6. Emulate break received:
- * $ echo "6" > /sys/devices/virtual/tty/ttyVS0/event
+ * Gives index of the device the given device is connected to. For an
+ * RS-485 bus member this is the index of the first member.
  */
-static ssize_t event_store(struct device *dev,
-		struct device_attribute *attr, const char *buf, size_t count)
+static unsigned int vs_peer_index(const struct vs_dev *vsdev)
 {
-	int ret, push = 1;
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
-	struct tty_struct *tty_to_write = local_vsdev->own_tty;
+	return vsdev->bus ? vsdev->bus->id : vsdev->peer_index;
+}
 
-	if (!buf || (count <= 0))
-		return -EINVAL;
+static void vs_bus_release(struct kref *kref)
+{
+	kfree(container_of(kref, struct vs_bus, kref));
+}
 
-	/*
-	 * Ensure required structure has been allocated, initialized and
-	 * port has been opened
-	 */
-	if (!tty_to_write || (tty_to_write->port == NULL)
-			|| (tty_to_write->port->count <= 0))
-		return -EIO;
-	if (!test_bit(ASYNCB_INITIALIZED, &tty_to_write->port->flags))
-		return -EIO;
+static void vs_dev_free_rcu(struct rcu_head *head)
+{
+	struct vs_dev *vsdev = container_of(head, struct vs_dev, rcu);
+
+	if (vsdev->bus)
+		kref_put(&vsdev->bus->kref, vs_bus_release);
+	kfree(rcu_dereference_protected(vsdev->lat, 1));
+	kfree(rcu_dereference_protected(vsdev->imp, 1));
+	free_percpu(vsdev->stats);
+	kfifo_free(&vsdev->tx_fifo);
+	kfree(vsdev);
+}
 
-	mutex_lock(&local_vsdev->lock);
+/*
+ * Invoked when the last reference to a device is dropped. Its other
+ * end may still be reading it under rcu_read_lock(), hence memory is
+ * released after a grace period.
+ */
+static void vs_dev_release(struct kref *kref)
+{
+	struct vs_dev *vsdev = container_of(kref, struct vs_dev, kref);
 
-	switch (buf[0]) {
-	case '1':
-		ret = tty_insert_flip_char(tty_to_write->port, -7, TTY_FRAME);
-		if (ret < 0)
-			goto fail;
-		local_vsdev->icount.frame++;
-		break;
-	case '2':
-		ret = tty_insert_flip_char(tty_to_write->port, -7, TTY_PARITY);
-		if (ret < 0)
-			goto fail;
-		local_vsdev->icount.parity++;
-		break;
-	case '3':
-		ret = tty_insert_flip_char(tty_to_write->port, 0, TTY_OVERRUN);
-		if (ret < 0)
-			goto fail;
-		local_vsdev->icount.overrun++;
-		break;
-	case '4':
-		local_vsdev->msr_reg |= VS_MSR_RI;
-		local_vsdev->icount.rng++;
-		push = -1;
-		break;
-	case '5':
-		local_vsdev->msr_reg &= ~VS_MSR_RI;
-		local_vsdev->icount.rng++;
-		push = -1;
-		break;
-	case '6':
-		ret = tty_insert_flip_char(tty_to_write->port, 0, TTY_BREAK);
-		if (ret < 0)
-			goto fail;
-		local_vsdev->icount.brk++;
-		break;
-	default:
-		mutex_unlock(&local_vsdev->lock);
-		return -EINVAL;
-	}
+	call_rcu(&vsdev->rcu, vs_dev_free_rcu);
+}
 
-	if (push)
-		tty_flip_buffer_push(tty_to_write->port);
+/* Adds 'n' to the given traffic counter of the device on this CPU */
+static void vs_stat_add(struct vs_dev *vsdev, int stat, u64 n)
+{
+	unsigned long flags;
+	struct vs_pcpu_stats *stats = get_cpu_ptr(vsdev->stats);
 
-	mutex_unlock(&local_vsdev->lock);
-	return count;
+	flags = u64_stats_update_begin_irqsave(&stats->syncp);
+	stats->cnt[stat] += n;
+	u64_stats_update_end_irqrestore(&stats->syncp, flags);
+	put_cpu_ptr(vsdev->stats);
+}
 
-fail:
-	mutex_unlock(&local_vsdev->lock);
-	return ret;
+/* Sums up per CPU traffic counters of the given device */
+static void vs_stat_read(struct vs_dev *vsdev, struct vs_ioc_stats *out)
+{
+	int cpu;
+	unsigned int start;
+	u64 cnt[VS_STAT_NUM];
+	struct vs_pcpu_stats *stats;
+
+	memset(out, 0, sizeof(struct vs_ioc_stats));
+	out->index = vsdev->own_index;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(vsdev->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&stats->syncp);
+			memcpy(cnt, stats->cnt, sizeof(cnt));
+		} while (u64_stats_fetch_retry_irq(&stats->syncp, start));
+
+		out->tx_bytes += cnt[VS_STAT_TX_BYTES];
+		out->rx_bytes += cnt[VS_STAT_RX_BYTES];
+		out->write_calls += cnt[VS_STAT_WRITE_CALLS];
+		out->drop_mismatch += cnt[VS_STAT_DROP_MISMATCH];
+		out->drop_faulty += cnt[VS_STAT_DROP_FAULTY];
+		out->drop_noreader += cnt[VS_STAT_DROP_NOREADER];
+		out->drop_overrun += cnt[VS_STAT_DROP_OVERRUN];
+		out->throttle += cnt[VS_STAT_THROTTLE];
+	}
 }
-static DEVICE_ATTR_WO(event);
 
 /*
- * Emulates a faulty cable condition. Data is sent successfully from
- * sender end but receiving end will not receive the data at all.
- *
- * 1. Emulate cable is faulty:
- * $ echo "1" > /sys/devices/virtual/tty/ttyVS0/faultycable
- *
- * 2. Emulate cable is not faulty (default on startup):
- * $ echo "0" > /sys/devices/virtual/tty/ttyVS0/faultycable
+ * Queues delivery work of the given device after 'delay' jiffies, or
+ * modifies the delay of already queued work if 'mod' is set. The work
+ * runs on the CPU selected by the receiver through its rxcpu attribute
+ * if that CPU is online, otherwise on the calling CPU.
  */
-static ssize_t faultycable_store(struct device *dev,
-		struct device_attribute *attr, const char *buf, size_t count)
+static void vs_tx_queue(struct vs_dev *tx_vsdev, unsigned long delay, int mod)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
-
-	if (!buf || (count <= 0))
-		return -EINVAL;
+	int x, cpu = WORK_CPU_UNBOUND;
+	struct vs_dev *rx_vsdev;
 
-	switch (buf[0]) {
-	case '0':
-		local_vsdev->faulty_cable = 0;
-		break;
-	case '1':
-		local_vsdev->faulty_cable = 1;
-		break;
-	default:
-		return -EINVAL;
+	rcu_read_lock();
+	rx_vsdev = rcu_dereference(tx_vsdev->peer);
+	if (rx_vsdev) {
+		x = READ_ONCE(rx_vsdev->rxcpu);
+		if ((x >= 0) && cpu_online(x))
+			cpu = x;
 	}
+	rcu_read_unlock();
 
-	return count;
+	if (mod)
+		mod_delayed_work_on(cpu, vs_wq, &tx_vsdev->tx_work, delay);
+	else
+		queue_delayed_work_on(cpu, vs_wq, &tx_vsdev->tx_work, delay);
 }
-static DEVICE_ATTR_WO(faultycable);
 
 /*
- * Gives index of the tty device corresponding to this sysfs node.
- * $ cat /sys/devices/virtual/tty/ttyVS0/ownidx
+ * Returns a reference to the tty open on the given device, NULL if the
+ * device is not open. The tty stays valid until the caller drops it
+ * with tty_kref_put(), even if the device gets closed meanwhile.
  */
-static ssize_t ownidx_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static struct tty_struct *vs_tty_get(struct vs_dev *vsdev)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	unsigned long flags;
+	struct tty_struct *tty;
 
-	if (!buf)
-		return -EINVAL;
+	spin_lock_irqsave(&vsdev->tx_lock, flags);
+	tty = tty_kref_get(vsdev->own_tty);
+	spin_unlock_irqrestore(&vsdev->tx_lock, flags);
 
-	return sprintf(buf, "%u\n", local_vsdev->own_index);
+	return tty;
 }
-static DEVICE_ATTR_RO(ownidx);
 
-/*
- * Gives index of the tty device to which given tty devices is
- * connected.
- * $ cat /sys/devices/virtual/tty/ttyVS0/peeridx
- */
-static ssize_t peeridx_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+/* Sets the tty being opened on the given device */
+static void vs_tty_set(struct vs_dev *vsdev, struct tty_struct *tty)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	unsigned long flags;
 
-	if (!buf)
-		return -EINVAL;
-
-	return sprintf(buf, "%u\n", local_vsdev->peer_index);
+	spin_lock_irqsave(&vsdev->tx_lock, flags);
+	vsdev->own_tty = tty;
+	spin_unlock_irqrestore(&vsdev->tx_lock, flags);
 }
-static DEVICE_ATTR_RO(peeridx);
 
 /*
- * Gives RTS line connections for the given tty device.
- * $ cat /sys/devices/virtual/tty/ttyVS0/ortsmap
+ * Forgets the given tty once it is closed for the last time or hung
+ * up, so that no one takes a new reference to it from now on.
  */
-static ssize_t ortsmap_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static void vs_tty_clear(struct vs_dev *vsdev, struct tty_struct *tty)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	unsigned long flags;
 
-	if (!buf)
-		return -EINVAL;
+	spin_lock_irqsave(&vsdev->tx_lock, flags);
+	if (vsdev->own_tty == tty)
+		vsdev->own_tty = NULL;
+	spin_unlock_irqrestore(&vsdev->tx_lock, flags);
+}
 
-	return sprintf(buf, "%u\n", local_vsdev->rts_mappings);
+/* Wakes up writer blocked on the given device, if it is open */
+static void vs_tty_wakeup(struct vs_dev *vsdev)
+{
+	struct tty_struct *tty = vs_tty_get(vsdev);
+
+	if (tty) {
+		tty_port_tty_wakeup(tty->port);
+		tty_kref_put(tty);
+	}
 }
-static DEVICE_ATTR_RO(ortsmap);
 
 /*
- * Gives DTR line connections for the given tty device.
- * $ cat /sys/devices/virtual/tty/ttyVS0/odtrmap
+ * Puts a character with the given flag into the tty buffer of the
+ * given device and pushes it; 'tty' is the device's referenced tty.
+ * A tty buffer takes one producer at a time, so everything put into
+ * it goes in under the lock its delivery runs under: tx_lock of the
+ * peer sending to it, bus lock for a bus member. Returns 1 if the
+ * character was put, 0 otherwise.
  */
-static ssize_t odtrmap_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static int vs_rx_put_char(struct vs_dev *rx_vsdev, struct tty_struct *tty,
+				unsigned char ch, char flag)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	int ret = 0;
+	unsigned long flags;
+	spinlock_t *lock;
+	struct vs_dev *tx_vsdev;
 
-	if (!buf)
-		return -EINVAL;
+	rcu_read_lock();
 
-	return sprintf(buf, "%u\n", local_vsdev->dtr_mappings);
+	/* nothing is delivered to a device being deleted */
+	tx_vsdev = rcu_dereference(rx_vsdev->peer);
+	if (tx_vsdev == NULL)
+		goto out;
+
+	lock = rx_vsdev->bus ? &rx_vsdev->bus->lock : &tx_vsdev->tx_lock;
+	spin_lock_irqsave(lock, flags);
+	ret = tty_insert_flip_char(tty->port, ch, flag);
+	if (ret)
+		tty_flip_buffer_push(tty->port);
+	spin_unlock_irqrestore(lock, flags);
+
+out:
+	rcu_read_unlock();
+	return ret;
 }
-static DEVICE_ATTR_RO(odtrmap);
 
 /*
- * Gives RTS line connections of the tty device to which the
- * given tty device is connected.
- * $ cat /sys/devices/virtual/tty/ttyVS0/prtsmap
+ * Sets depth of the emulated transmit FIFO of the given device, 0 for
+ * the default of whole transmit ring.
  */
-static ssize_t prtsmap_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static int vs_set_fifo_depth(struct vs_dev *vsdev, unsigned int depth)
 {
-	struct vs_dev *remote_vsdev;
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	unsigned long flags;
 
-	if ((local_vsdev->own_index == local_vsdev->peer_index) || !buf)
+	if (depth > VS_TX_RING_SIZE)
 		return -EINVAL;
+	if (depth == 0)
+		depth = VS_TX_RING_SIZE;
+
+	spin_lock_irqsave(&vsdev->tx_lock, flags);
+	WRITE_ONCE(vsdev->fifo_depth, depth);
+	spin_unlock_irqrestore(&vsdev->tx_lock, flags);
+
+	/* deeper FIFO may have room for a blocked writer now */
+	vs_tty_wakeup(vsdev);
 
-	remote_vsdev = db[local_vsdev->peer_index].vsdev;
-	return sprintf(buf, "%u\n", remote_vsdev->rts_mappings);
+	return 0;
 }
-static DEVICE_ATTR_RO(prtsmap);
 
 /*
- * Gives DTR line connections of the tty device to which the
- * given tty device is connected.
- * $ cat /sys/devices/virtual/tty/ttyVS0/pdtrmap
+ * Writes one record into the ring of the given tap. The record is
+ * lost if reader has not left enough space. Callable from any context.
  */
-static ssize_t pdtrmap_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static void vs_tap_put(struct vs_tap *tap, u32 index, u16 type,
+			const void *payload, int len)
 {
-	struct vs_dev *remote_vsdev;
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	u64 tail, pos, pad;
+	unsigned long flags;
+	struct vs_tap_rec *rec;
+	u64 size = ALIGN(sizeof(struct vs_tap_rec) + len, VS_TAP_ALIGN);
+
+	spin_lock_irqsave(&tap->lock, flags);
+
+	tail = smp_load_acquire(&tap->hdr->tail);
+	pos = tap->head & (tap->data_size - 1);
+	pad = (pos + size > tap->data_size) ? tap->data_size - pos : 0;
+	if (tap->head + pad + size - tail > tap->data_size) {
+		tap->lost++;
+		WRITE_ONCE(tap->hdr->lost, tap->lost);
+		spin_unlock_irqrestore(&tap->lock, flags);
+		return;
+	}
 
-	if ((local_vsdev->own_index == local_vsdev->peer_index) || !buf)
-		return -EINVAL;
+	/* records never wrap around, skip the tail end of the ring */
+	if (pad) {
+		rec = (struct vs_tap_rec *)(tap->data + pos);
+		rec->time_ns = 0;
+		rec->index = index;
+		rec->type = VS_TAP_PAD;
+		rec->len = pad - sizeof(struct vs_tap_rec);
+		pos = 0;
+	}
 
-	remote_vsdev = db[local_vsdev->peer_index].vsdev;
-	return sprintf(buf, "%u\n", remote_vsdev->dtr_mappings);
-}
-static DEVICE_ATTR_RO(pdtrmap);
+	rec = (struct vs_tap_rec *)(tap->data + pos);
+	rec->time_ns = ktime_get_ns();
+	rec->index = index;
+	rec->type = type;
+	rec->len = len;
+	memcpy(rec + 1, payload, len);
 
-/*
- * Gives type (loopback / null modem) of the given tty device.
- * $ cat /sys/devices/virtual/tty/ttyVS0/odevtyp
- */
-static ssize_t odevtyp_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
-{
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	tap->head += pad + size;
+	smp_store_release(&tap->hdr->head, tap->head);
 
-	if (!buf)
-		return -EINVAL;
+	spin_unlock_irqrestore(&tap->lock, flags);
 
-	return sprintf(buf, "%u\n", local_vsdev->odevtyp);
+	if (waitqueue_active(&tap->wait))
+		wake_up_interruptible(&tap->wait);
 }
-static DEVICE_ATTR_RO(odevtyp);
 
 /*
- * Return value of 1 means, DTR signal will be asserted when given
- * this tty device is opeded. Value 0 means it will not be asserted.
- * $ cat /sys/devices/virtual/tty/ttyVS0/odtropn
+ * Records data sent by the given device if a tap is attached to it.
+ * Costs one pointer test when the device is not tapped.
  */
-static ssize_t odtropn_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static void vs_tap_data(struct vs_dev *vsdev, const unsigned char *buf,
+			int len)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	int n;
+	struct vs_tap *tap;
+
+	rcu_read_lock();
+	tap = rcu_dereference(vsdev->tap);
+	while (tap && (len > 0)) {
+		n = min(len, VS_TAP_MAX_DATA);
+		vs_tap_put(tap, vsdev->own_index, VS_TAP_DATA, buf, n);
+		buf += n;
+		len -= n;
+	}
+	rcu_read_unlock();
+}
 
-	if (!buf)
-		return -EINVAL;
+/* Records a line event of the given device if it is being tapped */
+static void vs_tap_event(struct vs_dev *vsdev, u16 type, u32 value)
+{
+	struct vs_tap *tap;
 
-	return sprintf(buf, "%u\n", local_vsdev->set_odtr_at_open);
+	rcu_read_lock();
+	tap = rcu_dereference(vsdev->tap);
+	if (tap)
+		vs_tap_put(tap, vsdev->own_index, type, &value, sizeof(value));
+	rcu_read_unlock();
+}
+
+/* Gives TIOCM_xxx bits of modem status inputs in the given MSR */
+static u32 vs_msr_to_tiocm(int msr_reg)
+{
+	return ((msr_reg & VS_MSR_DCD) ? TIOCM_CAR : 0) |
+		((msr_reg & VS_MSR_RI)  ? TIOCM_RI  : 0) |
+		((msr_reg & VS_MSR_CTS) ? TIOCM_CTS : 0) |
+		((msr_reg & VS_MSR_DSR) ? TIOCM_DSR : 0);
 }
-static DEVICE_ATTR_RO(odtropn);
 
 /*
- * Return value of 1 means, DTR signal of the peer tty device will
- * be asserted when given peer tty device is opeded. Value 0 means
- * it will not be asserted.
- * $ cat /sys/devices/virtual/tty/ttyVS0/pdtropn
+ * Queues one record to the given channel. When the queue is full,
+ * events are counted and reported by a VS_EVT_LOST record as soon
+ * as there is room for it and the next event.
  */
-static ssize_t pdtropn_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static void vs_evt_put(struct vs_evt_chan *ch, u64 now, u32 index,
+			u16 type, u32 value, u32 changed)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	unsigned long flags;
+	struct vs_evt *ev;
+	u32 room;
 
-	if (!buf)
-		return -EINVAL;
+	spin_lock_irqsave(&ch->lock, flags);
 
-	return sprintf(buf, "%u\n", local_vsdev->set_odtr_at_open);
+	room = ch->size - (ch->head - ch->tail);
+	if (ch->lost) {
+		if (room < 2) {
+			ch->lost++;
+			goto unlock;
+		}
+		ev = &ch->ring[ch->head++ & (ch->size - 1)];
+		memset(ev, 0, sizeof(struct vs_evt));
+		ev->time_ns = now;
+		ev->type = VS_EVT_LOST;
+		ev->value = ch->lost;
+		ch->lost = 0;
+		room--;
+	}
+	if (room == 0) {
+		ch->lost++;
+		goto unlock;
+	}
+
+	ev = &ch->ring[ch->head & (ch->size - 1)];
+	ev->time_ns = now;
+	ev->index = index;
+	ev->type = type;
+	ev->reserved = 0;
+	ev->value = value;
+	ev->changed = changed;
+	ch->head++;
+
+	if (waitqueue_active(&ch->wait))
+		wake_up_interruptible(&ch->wait);
+unlock:
+	spin_unlock_irqrestore(&ch->lock, flags);
 }
-static DEVICE_ATTR_RO(pdtropn);
 
 /*
- * Gives serial port events stats.
- * $ cat /sys/devices/virtual/tty/ttyVS0/ostats
+ * Queues an event of the given device to every channel watching it.
+ * Costs one list test when no channel is open.
  */
-static ssize_t ostats_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static void vs_evt_post(struct vs_dev *vsdev, u16 type, u32 value,
+			u32 changed)
 {
-	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	u64 now;
+	u32 index = vsdev->own_index;
+	struct vs_evt_chan *ch;
 
-	if (!buf)
-		return -EINVAL;
+	if (list_empty(&vs_evt_chans))
+		return;
 
-	return sprintf(buf, "%u#%u#%u#%u#%u#%u#%u#%u#%u#%u#%u#\n",
-			local_vsdev->icount.tx, local_vsdev->icount.rx,
-			local_vsdev->icount.cts, local_vsdev->icount.dcd,
-			local_vsdev->icount.dsr, local_vsdev->icount.brk,
-			local_vsdev->icount.rng, local_vsdev->icount.frame,
-			local_vsdev->icount.parity, local_vsdev->icount.overrun,
-			local_vsdev->icount.buf_overrun);
+	now = ktime_get_ns();
+	rcu_read_lock();
+	list_for_each_entry_rcu(ch, &vs_evt_chans, node) {
+		if ((index < ch->first) || (index > ch->last) ||
+				!(ch->mask & VS_EVT_MASK(type)))
+			continue;
+		vs_evt_put(ch, now, index, type, value, changed);
+	}
+	rcu_read_unlock();
 }
-static DEVICE_ATTR_RO(ostats);
-
-static struct attribute *vs_info_attrs[] = {
-	&dev_attr_event.attr,
-	&dev_attr_faultycable.attr,
-	&dev_attr_ownidx.attr,
-	&dev_attr_peeridx.attr,
-	&dev_attr_ortsmap.attr,
-	&dev_attr_odtrmap.attr,
-	&dev_attr_prtsmap.attr,
-	&dev_attr_pdtrmap.attr,
-	&dev_attr_odevtyp.attr,
-	&dev_attr_odtropn.attr,
-	&dev_attr_pdtropn.attr,
-	&dev_attr_ostats.attr,
-	NULL,
-};
-
-static const struct attribute_group vs_info_attr_group = {
-	.attrs = vs_info_attrs,
-};
 
 /*
- * Checks if the given serial port has received its carrier detect
- * line raised or not. Return 1 if the carrier is raised otherwise 0.
+ * Gives latency measurement of the data sent by the given device, that
+ * is of its receiver, or NULL. Not done on an RS-485 bus. Caller holds
+ * rcu_read_lock().
  */
-static int vs_port_carrier_raised(struct tty_port *port)
+static struct vs_lat *vs_lat_of_tx(struct vs_dev *tx_vsdev)
 {
-	struct vs_dev *local_vsdev = db[port->tty->index].vsdev;
+	struct vs_dev *rx_vsdev;
 
-	return (local_vsdev->msr_reg & VS_MSR_DCD) ? 1 : 0;
+	if (tx_vsdev->bus)
+		return NULL;
+
+	rx_vsdev = rcu_dereference(tx_vsdev->peer);
+	return rx_vsdev ? rcu_dereference(rx_vsdev->lat) : NULL;
 }
 
-/* Shutdown the given serial port */
-static void vs_port_shutdown(struct tty_port *port)
+static void vs_lat_add(struct vs_lat_hist *hist, u64 ns)
 {
-	pr_debug("shutting down the port!\n");
+	int x = ns ? min(fls64(ns) - 1, VS_LAT_BUCKETS - 1) : 0;
+
+	if ((hist->count == 0) || (ns < hist->min))
+		hist->min = ns;
+	if (ns > hist->max)
+		hist->max = ns;
+	hist->count++;
+	hist->sum += ns;
+	hist->bucket[x]++;
 }
 
 /*
- * Invoked when tty is going to be destroyed and driver should
- * release resources.
+ * Marks a write whose first byte was queued behind 'queued' bytes in
+ * transmit ring of the given device. Caller holds tx_lock so that the
+ * ring and tx_out move together.
  */
-static void vs_port_destruct(struct tty_port *port)
-{
-	pr_debug("destroying the port!\n");
-}
-
-/* Activate the given serial port as opposed to shutdown */
-static int vs_port_activate(struct tty_port *port, struct tty_struct *tty)
+static void vs_lat_write(struct vs_dev *tx_vsdev, unsigned int queued)
 {
-	return 0;
+	unsigned long flags;
+	struct vs_lat *lat;
+	struct vs_lat_mark *mark;
+
+	rcu_read_lock();
+	lat = vs_lat_of_tx(tx_vsdev);
+	if (lat) {
+		spin_lock_irqsave(&lat->lock, flags);
+		if (lat->tx_head - lat->tx_tail < VS_LAT_MARKS) {
+			mark = &lat->tx_mark[VS_LAT_IDX(lat->tx_head++)];
+			mark->seq = lat->tx_out + queued;
+			mark->write_ns = ktime_get_ns();
+		}
+		spin_unlock_irqrestore(&lat->lock, flags);
+	}
+	rcu_read_unlock();
 }
 
-static const struct tty_port_operations vs_port_ops = {
-	.carrier_raised = vs_port_carrier_raised,
-	.shutdown       = vs_port_shutdown,
-	.activate       = vs_port_activate,
-	.destruct       = vs_port_destruct,
-};
-
 /*
- * Update modem control and status registers according to the bit
- * mask(s) provided. The RTS and DTR values can be set only if the
- * current handshaking state of the tty device allows direct control
- * of the modem control lines. The pin mappings are honoured.
- *
- * Caller holds lock of thegiven virtual tty device.
+ * Accounts 'taken' bytes taken out of transmit ring of the given device
+ * of which 'received' bytes reached the receiver's tty buffer; either
+ * may be 0. Writes starting within the taken bytes are sampled once per
+ * call, by the oldest one, as they reach the receiver together. Caller
+ * holds tx_lock when 'taken' is not 0.
  */
-static int vs_update_modem_lines(struct tty_struct *tty,
-			unsigned int set, unsigned int clear)
+static void vs_lat_deliver(struct vs_dev *tx_vsdev, int taken, int received)
 {
-	int ctsint = 0;
-	int dcdint = 0;
-	int dsrint = 0;
-	int rngint = 0;
-	int mcr_ctrl_reg = 0;
-	int wakeup_blocked_open = 0;
-	int rts_mappings, dtr_mappings, msr_state_reg;
-	struct async_icount *evicount;
-	struct vs_dev *vsdev, *local_vsdev, *remote_vsdev;
-
-	local_vsdev = db[tty->index].vsdev;
-
-	/* Read modify write MSR register */
-	if (tty->index != local_vsdev->peer_index) {
-		remote_vsdev = db[local_vsdev->peer_index].vsdev;
-		msr_state_reg = remote_vsdev->msr_reg;
-		vsdev = remote_vsdev;
-	} else {
-		msr_state_reg = local_vsdev->msr_reg;
-		vsdev = local_vsdev;
+	u64 now, write_ns = 0;
+	unsigned long flags;
+	struct vs_lat *lat;
+	struct vs_lat_mark *mark;
+
+	rcu_read_lock();
+	lat = vs_lat_of_tx(tx_vsdev);
+	if (lat == NULL)
+		goto out;
+
+	spin_lock_irqsave(&lat->lock, flags);
+
+	lat->tx_out += taken;
+	while (lat->tx_head != lat->tx_tail) {
+		mark = &lat->tx_mark[VS_LAT_IDX(lat->tx_tail)];
+		if ((s32)(mark->seq - lat->tx_out) >= 0)
+			break;
+		if (write_ns == 0)
+			write_ns = mark->write_ns;
+		lat->tx_tail++;
 	}
 
-	rts_mappings = local_vsdev->rts_mappings;
-	dtr_mappings = local_vsdev->dtr_mappings;
-
-	if (set & TIOCM_RTS) {
-		mcr_ctrl_reg |= VS_MCR_RTS;
-		if ((rts_mappings & VS_CON_CTS) == VS_CON_CTS) {
-			msr_state_reg |= VS_MSR_CTS;
-			ctsint++;
-		}
-		if ((rts_mappings & VS_CON_DCD) == VS_CON_DCD) {
-			msr_state_reg |= VS_MSR_DCD;
-			dcdint++;
-			wakeup_blocked_open = 1;
-		}
-		if ((rts_mappings & VS_CON_DSR) == VS_CON_DSR) {
-			msr_state_reg |= VS_MSR_DSR;
-			dsrint++;
-		}
-		if ((rts_mappings & VS_CON_RI) == VS_CON_RI) {
-			msr_state_reg |= VS_MSR_RI;
-			rngint++;
+	if (write_ns && (received > 0)) {
+		now = ktime_get_ns();
+		vs_lat_add(&lat->queue, now - write_ns);
+		if (lat->rx_head - lat->rx_tail < VS_LAT_MARKS) {
+			mark = &lat->rx_mark[VS_LAT_IDX(lat->rx_head++)];
+			mark->seq = lat->rx_in;
+			mark->write_ns = write_ns;
+			mark->deliver_ns = now;
 		}
 	}
+	lat->rx_in += received;
 
-	if (set & TIOCM_DTR) {
-		mcr_ctrl_reg |= VS_MCR_DTR;
-		if ((dtr_mappings & VS_CON_CTS) == VS_CON_CTS) {
-			msr_state_reg |= VS_MSR_CTS;
-			ctsint++;
-		}
-		if ((dtr_mappings & VS_CON_DCD) == VS_CON_DCD) {
-			msr_state_reg |= VS_MSR_DCD;
-			dcdint++;
-			wakeup_blocked_open = 1;
-		}
-		if ((dtr_mappings & VS_CON_DSR) == VS_CON_DSR) {
-			msr_state_reg |= VS_MSR_DSR;
-			dsrint++;
-		}
-		if ((dtr_mappings & VS_CON_RI) == VS_CON_RI) {
-			msr_state_reg |= VS_MSR_RI;
-			rngint++;
-		}
-	}
+	spin_unlock_irqrestore(&lat->lock, flags);
+out:
+	rcu_read_unlock();
+}
 
-	if (clear & TIOCM_RTS) {
-		mcr_ctrl_reg &= ~VS_MCR_RTS;
-		if ((rts_mappings & VS_CON_CTS) == VS_CON_CTS) {
-			msr_state_reg &= ~VS_MSR_CTS;
-			ctsint++;
-		}
-		if ((rts_mappings & VS_CON_DCD) == VS_CON_DCD) {
-			msr_state_reg &= ~VS_MSR_DCD;
-			dcdint++;
-		}
-		if ((rts_mappings & VS_CON_DSR) == VS_CON_DSR) {
-			msr_state_reg &= ~VS_MSR_DSR;
-			dsrint++;
-		}
-		if ((rts_mappings & VS_CON_RI) == VS_CON_RI) {
-			msr_state_reg &= ~VS_MSR_RI;
-			rngint++;
-		}
-	}
+/*
+ * Accounts 'count' bytes consumed by line discipline of the given device
+ * and completes samples of the writes they started. Each sample is also
+ * recorded by the tap of this device if any.
+ */
+static void vs_lat_consume(struct vs_dev *rx_vsdev, int count)
+{
+	u64 now;
+	unsigned long flags;
+	struct vs_lat *lat;
+	struct vs_tap *tap;
+	struct vs_lat_mark *mark;
+	struct vs_tap_latency rec;
 
-	if (clear & TIOCM_DTR) {
-		mcr_ctrl_reg &= ~VS_MCR_DTR;
-		if ((dtr_mappings & VS_CON_CTS) == VS_CON_CTS) {
-			msr_state_reg &= ~VS_MSR_CTS;
-			ctsint++;
-		}
-		if ((dtr_mappings & VS_CON_DCD) == VS_CON_DCD) {
-			msr_state_reg &= ~VS_MSR_DCD;
-			dcdint++;
-		}
-		if ((dtr_mappings & VS_CON_DSR) == VS_CON_DSR) {
-			msr_state_reg &= ~VS_MSR_DSR;
-			dsrint++;
-		}
-		if ((dtr_mappings & VS_CON_RI) == VS_CON_RI) {
-			msr_state_reg &= ~VS_MSR_RI;
-			rngint++;
-		}
-	}
+	rcu_read_lock();
+	lat = rcu_dereference(rx_vsdev->lat);
+	if (lat == NULL)
+		goto out;
 
-	local_vsdev->mcr_reg = mcr_ctrl_reg;
-	vsdev->msr_reg = msr_state_reg;
+	tap = rcu_dereference(rx_vsdev->tap);
+	now = ktime_get_ns();
 
-	evicount = &vsdev->icount;
-	evicount->cts += ctsint;
-	evicount->dsr += dsrint;
-	evicount->dcd += dcdint;
-	evicount->rng += rngint;
+	spin_lock_irqsave(&lat->lock, flags);
 
-	if (vsdev->own_tty && vsdev->own_tty->port) {
-		/* Wake up process blocked on TIOCMIWAIT ioctl */
-		if ((vsdev->waiting_msr_chg == 1) &&
-				(vsdev->own_tty->port->count > 0)) {
-			wake_up_interruptible(&vsdev->own_tty->port->delta_msr_wait);
-		}
+	/*
+	 * Bytes in tty buffer before measurement started, or given to it
+	 * bypassing transmit ring, must not complete later writes early.
+	 */
+	lat->rx_out += count;
+	if ((s32)(lat->rx_out - lat->rx_in) > 0)
+		lat->rx_out = lat->rx_in;
 
-		/* Wake up application blocked on carrier detect signal */
-		if ((wakeup_blocked_open == 1) &&
-				(vsdev->own_tty->port->blocked_open > 0)) {
-			wake_up_interruptible(&vsdev->own_tty->port->open_wait);
+	while (lat->rx_head != lat->rx_tail) {
+		mark = &lat->rx_mark[VS_LAT_IDX(lat->rx_tail)];
+		if ((s32)(mark->seq - lat->rx_out) >= 0)
+			break;
+		vs_lat_add(&lat->e2e, now - mark->write_ns);
+		if (tap) {
+			rec.write_ns = mark->write_ns;
+			rec.deliver_ns = mark->deliver_ns;
+			vs_tap_put(tap, rx_vsdev->own_index, VS_TAP_LATENCY,
+					&rec, sizeof(rec));
 		}
+		lat->rx_tail++;
 	}
 
-	return 0;
+	spin_unlock_irqrestore(&lat->lock, flags);
+out:
+	rcu_read_unlock();
 }
 
 /*
- * Invoked when user space process opens a serial port. The tty core
- * calls this to install tty and initialize the required resources.
+ * Forgets data given to tty buffer of the given device as tty core has
+ * flushed it, it will never be consumed by line discipline.
  */
-static int vs_install(struct tty_driver *drv, struct tty_struct *tty)
+static void vs_lat_rx_reset(struct vs_dev *rx_vsdev)
 {
-	int ret;
-	struct tty_port *port;
-
-	port = kcalloc(1, sizeof(struct tty_port), GFP_KERNEL);
-	if (port == NULL)
-		return -ENOMEM;
-
-	/* First initialize and then set port operations */
-	tty_port_init(port);
-	port->ops = &vs_port_ops;
-
-	ret = tty_port_install(port, drv, tty);
-	if (ret) {
-		kfree(port);
-		return ret;
+	unsigned long flags;
+	struct vs_lat *lat;
+
+	rcu_read_lock();
+	lat = rcu_dereference(rx_vsdev->lat);
+	if (lat) {
+		spin_lock_irqsave(&lat->lock, flags);
+		lat->rx_out = lat->rx_in;
+		lat->rx_tail = lat->rx_head;
+		spin_unlock_irqrestore(&lat->lock, flags);
 	}
-
-	return 0;
+	rcu_read_unlock();
 }
 
 /*
- * Invoked when there exist no user process or tty is to be
- * released explicitly for whatever reason.
- */
-static void vs_cleanup(struct tty_struct *tty)
-{
-	tty_port_put(tty->port);
-}
-
-/*
- * Called when open system call is called on virtual tty device node.
- * The tty core allocates 'struct tty_struct' for this device and
- * set up various resources, sets up line discipline and call this
- * function. For first time allocation happens and from next time
- * onwards only re-opening happens.
+ * Notifies tty core that a framing/parity/overrun error has happend
+ * while receiving data on serial port. When frame or parity error
+ * happens, -7 (randomly selected number by this driver) is sent as
+ * byte that got corrupted to tty core. For emulation purpose 0 can
+ * not be taken as corrupted byte because parity and break both will
+ * have same sequence (octal \377 \0 \0) and therefore application
+ * will not be able to differentiate between these two.
  *
- * The tty core finds the tty driver serving this device node and the
- * index of this tty device as registered by this driver with tty core.
- * From this inded we retrieve the virtual tty device to work on.
+ * This is also used for asserting/de-asserting ring event on line and
+ * notifies tty core when a break condition has been detected on line.
  *
- * If the same serial port is opened more than once, the tty structure
- * passed to this function will be same but filp structure will be
- * different every time. Caller holds tty lock.
+ * 1. Emulate framing error:
+ * $ echo "1" > /sys/devices/virtual/tty/ttyVS0/event
  *
- * This driver does not set CLOCAL by default. This means that the
- * open() system call will block until it find its carrier detect
- * line raised. Application should use O_NONBLOCK/O_NDELAY flag if
- * it does not want to wait for DCD line change.
+ * 2. Emulate parity error:
+ * $ echo "2" > /sys/devices/virtual/tty/ttyVS0/event
+ *
+ * 3. Emulate overrun error:
+ * $ echo "3" > /sys/devices/virtual/tty/ttyVS0/event
+ *
+ * 4. Emulate ring indicator (set RI signal):
+ * $ echo "4" > /sys/devices/virtual/tty/ttyVS0/event
+ *
+ * 5. Emulate ring indicator (unset RI signal):
+ * $ echo "5" > /sys/devices/virtual/tty/ttyVS0/event
+ *
+ * 6. Emulate break received:
+ * $ echo "6" > /sys/devices/virtual/tty/ttyVS0/event
  */
-static int vs_open(struct tty_struct *tty, struct file *filp)
+static ssize_t event_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
-	struct vs_dev *remote_vsdev;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	int ret, old_msr;
+	unsigned long flags;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+	struct tty_struct *tty_to_write;
 
-	local_vsdev->own_tty = tty;
+	if (!buf || (count <= 0))
+		return -EINVAL;
 
 	/*
-	 * If this device is one end of a null modem connection,
-	 * provide its address to remote end.
+	 * Ensure required structure has been allocated, initialized and
+	 * port has been opened
 	 */
-	if (tty->index != local_vsdev->peer_index) {
-		remote_vsdev = db[local_vsdev->peer_index].vsdev;
-		remote_vsdev->peer_tty = tty;
+	tty_to_write = vs_tty_get(local_vsdev);
+	if (!tty_to_write)
+		return -EIO;
+	if ((tty_to_write->port == NULL) || (tty_to_write->port->count <= 0)
+		|| !tty_port_initialized(tty_to_write->port)) {
+		tty_kref_put(tty_to_write);
+		return -EIO;
 	}
 
-	memset(&local_vsdev->serial, 0, sizeof(struct serial_struct));
-	memset(&local_vsdev->icount, 0, sizeof(struct async_icount));
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	old_msr = local_vsdev->msr_reg;
 
-	/*
-	 * Handle DTR raising logic ourselve instead of tty_port helpers
-	 * doing it. Locking virtual tty is not required here.
-	 */
-	if (local_vsdev->set_odtr_at_open == 1)
-		vs_update_modem_lines(tty, TIOCM_DTR | TIOCM_RTS, 0);
+	switch (buf[0]) {
+	case '1':
+		vs_rx_put_char(local_vsdev, tty_to_write, -7, TTY_FRAME);
+		local_vsdev->icount.frame++;
+		vs_evt_post(local_vsdev, VS_EVT_FRAME, 0, 0);
+		break;
+	case '2':
+		vs_rx_put_char(local_vsdev, tty_to_write, -7, TTY_PARITY);
+		local_vsdev->icount.parity++;
+		vs_evt_post(local_vsdev, VS_EVT_PARITY, 0, 0);
+		break;
+	case '3':
+		vs_rx_put_char(local_vsdev, tty_to_write, 0, TTY_OVERRUN);
+		local_vsdev->icount.overrun++;
+		vs_evt_post(local_vsdev, VS_EVT_OVERRUN, 0, 0);
+		break;
+	case '4':
+		local_vsdev->msr_reg |= VS_MSR_RI;
+		local_vsdev->icount.rng++;
+		break;
+	case '5':
+		local_vsdev->msr_reg &= ~VS_MSR_RI;
+		local_vsdev->icount.rng++;
+		break;
+	case '6':
+		vs_rx_put_char(local_vsdev, tty_to_write, 0, TTY_BREAK);
+		local_vsdev->icount.brk++;
+		vs_evt_post(local_vsdev, VS_EVT_BREAK, 0, 0);
+		break;
+	default:
+		ret = -EINVAL;
+		goto fail;
+	}
 
-	/* Associate tty with port and do port level opening. */
-	ret = tty_port_open(tty->port, tty, filp);
-	if (ret < 0)
-		return ret;
+	if (local_vsdev->msr_reg != old_msr)
+		vs_evt_post(local_vsdev, VS_EVT_MODEM,
+				vs_msr_to_tiocm(local_vsdev->msr_reg), TIOCM_RI);
 
-	tty->port->close_delay  = 0;
-	tty->port->closing_wait = ASYNC_CLOSING_WAIT_NONE;
-	tty->port->drain_delay  = 0;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+	tty_kref_put(tty_to_write);
+	return count;
 
+fail:
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+	tty_kref_put(tty_to_write);
 	return ret;
 }
+static DEVICE_ATTR_WO(event);
 
 /*
- * Invoked by tty layer when release() is called on the file pointer
- * that was previously created with a call to open().
+ * Emulates a faulty cable condition. Data is sent successfully from
+ * sender end but receiving end will not receive the data at all.
+ *
+ * 1. Emulate cable is faulty:
+ * $ echo "1" > /sys/devices/virtual/tty/ttyVS0/faultycable
+ *
+ * 2. Emulate cable is not faulty (default on startup):
+ * $ echo "0" > /sys/devices/virtual/tty/ttyVS0/faultycable
  */
-static void vs_close(struct tty_struct *tty, struct file *filp)
+static ssize_t faultycable_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	if (test_bit(TTY_IO_ERROR, &tty->flags))
-		return;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	if (tty && filp && tty->port && (tty->port->count > 0))
-		tty_port_close(tty->port, tty, filp);
+	if (!buf || (count <= 0))
+		return -EINVAL;
 
-	if (tty && C_HUPCL(tty) && tty->port && (tty->port->count < 1))
-		vs_update_modem_lines(tty, 0, TIOCM_DTR | TIOCM_RTS);
+	switch (buf[0]) {
+	case '0':
+		local_vsdev->faulty_cable = 0;
+		break;
+	case '1':
+		local_vsdev->faulty_cable = 1;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return count;
 }
+static DEVICE_ATTR_WO(faultycable);
 
 /*
- * Invoked when write() system call is invoked on device node.
- * This function constructs evry byte as per the current uart
- * frame settings. Finally, the data is inserted into the tty
- * buffer of the receiver tty device.
+ * Emulates actual line speed. When enabled, data is delivered to the
+ * receiver at the rate a real UART would shift it out for the current
+ * baudrate, number of data bits, parity and stop bits. When disabled
+ * (default on startup), data is delivered as fast as possible.
+ *
+ * 1. Enable paced transmission:
+ * $ echo "1" > /sys/devices/virtual/tty/ttyVS0/pacing
+ *
+ * 2. Disable paced transmission:
+ * $ echo "0" > /sys/devices/virtual/tty/ttyVS0/pacing
  */
-static int vs_write(struct tty_struct *tty,
-			const unsigned char *buf, int count)
+static ssize_t pacing_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int x;
-	unsigned char *data = NULL;
-	struct tty_struct *tty_to_write = NULL;
-	struct vs_dev *rx_vsdev = NULL;
-	struct vs_dev *tx_vsdev = db[tty->index].vsdev;
-
-	if (tx_vsdev->tx_paused || !tty || tty->stopped
-			|| (count < 1) || !buf || tty->hw_stopped)
-		return 0;
-
-	if (tx_vsdev->is_break_on == 1) {
-		pr_debug("break condition is on!\n");
-		return -EIO;
-	}
-
-	if (tx_vsdev->faulty_cable == 1)
-		return count;
-
-	if (tty->index != tx_vsdev->peer_index) {
-		/* Null modem */
-		tty_to_write = tx_vsdev->peer_tty;
-		rx_vsdev = db[tx_vsdev->peer_index].vsdev;
-
-		if ((tx_vsdev->baud != rx_vsdev->baud) ||
-			(tx_vsdev->uart_frame != rx_vsdev->uart_frame)) {
-			/*
-			 * Emulate data sent but not received due to
-			 * mismatched baudrate/framing.
-			 */
-			pr_debug("mismatched serial port settings!\n");
-			tx_vsdev->icount.tx++;
-			return count;
-		}
-	} else {
-		/* Loop back */
-		tty_to_write = tty;
-		rx_vsdev = tx_vsdev;
-	}
-
-	if (tty_to_write) {
-		if ((tty_to_write->termios.c_cflag & CSIZE) == CS8) {
-			data = (unsigned char *)buf;
-		} else {
-			data = kcalloc(count, sizeof(unsigned char), GFP_KERNEL);
-			if (!data)
-				return -ENOMEM;
-
-			/* Emulate correct number of data bits */
-			switch (tty_to_write->termios.c_cflag & CSIZE) {
-			case CS7:
-				for (x = 0; x < count; x++)
-					data[x] = buf[x] & 0x7F;
-				break;
-			case CS6:
-				for (x = 0; x < count; x++)
-					data[x] = buf[x] & 0x3F;
-				break;
-			case CS5:
-				for (x = 0; x < count; x++)
-					data[x] = buf[x] & 0x1F;
-				break;
-			default:
-				data = (unsigned char *)buf;
-			}
-		}
+	unsigned long flags;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-		tty_insert_flip_string(tty_to_write->port, data, count);
-		tty_flip_buffer_push(tty_to_write->port);
-		tx_vsdev->icount.tx++;
-		rx_vsdev->icount.rx++;
+	if (!buf || (count <= 0))
+		return -EINVAL;
 
-		if (data != buf)
-			kfree(data);
-	} else {
-		/*
-		 * Other end is still not opened, emulate transmission from
-		 * local end but don't make other end receive it as is the
-		 * case in real world.
-		 */
-		tx_vsdev->icount.tx++;
+	switch (buf[0]) {
+	case '0':
+		local_vsdev->paced = 0;
+		hrtimer_cancel(&local_vsdev->pace_timer);
+		spin_lock_irqsave(&local_vsdev->tx_lock, flags);
+		local_vsdev->pace_running = 0;
+		spin_unlock_irqrestore(&local_vsdev->tx_lock, flags);
+		/* deliver whatever is still pending right away */
+		vs_tx_queue(local_vsdev, 0, 1);
+		break;
+	case '1':
+		local_vsdev->paced = 1;
+		break;
+	default:
+		return -EINVAL;
 	}
 
 	return count;
 }
 
-/* Invoked by tty core to transmit single data byte. */
-static int vs_put_char(struct tty_struct *tty, unsigned char ch)
+static ssize_t pacing_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	unsigned char data;
-	struct tty_struct *tty_to_write;
-	struct vs_dev *rx_vsdev;
-	struct vs_dev *tx_vsdev = db[tty->index].vsdev;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	if (tx_vsdev->tx_paused || !tty || tty->stopped || tty->hw_stopped)
-		return 0;
+	if (!buf)
+		return -EINVAL;
 
-	if (tx_vsdev->is_break_on == 1)
-		return -EIO;
+	return sprintf(buf, "%d\n", local_vsdev->paced);
+}
+static DEVICE_ATTR_RW(pacing);
 
-	if (tx_vsdev->faulty_cable == 1)
-		return 1;
+/*
+ * Receive address filter for 9 bit multi-drop addressing (see
+ * applications/9-bit-data.md); sender marks address bytes with mark
+ * parity and data bytes with space parity. When the filter is on, an
+ * address byte equal to ADDR in the bits set in MASK (default ff)
+ * selects this device and data bytes that follow reach its tty buffer
+ * only while it is selected. Values are given in hex.
+ *
+ * 1. Receive only frames addressed to 0x12:
+ * $ echo "12" > /sys/devices/virtual/tty/ttyVS0/addrfilter
+ *
+ * 2. Receive frames addressed to any of 0x10 to 0x1f:
+ * $ echo "10 f0" > /sys/devices/virtual/tty/ttyVS0/addrfilter
+ *
+ * 3. Receive everything (default on startup):
+ * $ echo "off" > /sys/devices/virtual/tty/ttyVS0/addrfilter
+ */
+static ssize_t addrfilter_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned int addr, mask = 0xFF;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	if (tty->index != tx_vsdev->peer_index) {
-		tty_to_write = tx_vsdev->peer_tty;
-		rx_vsdev = db[tx_vsdev->peer_index].vsdev;
-		if ((tx_vsdev->baud != rx_vsdev->baud) ||
-			(tx_vsdev->uart_frame != rx_vsdev->uart_frame)) {
-			tx_vsdev->icount.tx++;
-			return 1;
-		}
-	} else {
-		tty_to_write = tty;
-		rx_vsdev = tx_vsdev;
-	}
+	if (!buf || (count <= 0))
+		return -EINVAL;
 
-	if (tty_to_write != NULL) {
-		switch (tty_to_write->termios.c_cflag & CSIZE) {
-		case CS8:
-			data = ch;
-			break;
-		case CS7:
-			data = ch & 0x7F;
-			break;
-		case CS6:
-			data = ch & 0x3F;
-			break;
-		case CS5:
-			data = ch & 0x1F;
-			break;
-		default:
-			data = ch;
-		}
-		tty_insert_flip_string(tty_to_write->port, &data, 1);
-		tty_flip_buffer_push(tty_to_write->port);
-		tx_vsdev->icount.tx++;
-		rx_vsdev->icount.rx++;
-	} else {
-		tx_vsdev->icount.tx++;
+	if (sysfs_streq(buf, "off")) {
+		WRITE_ONCE(local_vsdev->rx_filter, 0);
+		return count;
 	}
 
-	return 1;
+	ret = sscanf(buf, "%x %x", &addr, &mask);
+	if ((ret < 1) || (addr > 0xFF) || (mask > 0xFF))
+		return -EINVAL;
+
+	/* nothing is received until a matching address byte arrives */
+	local_vsdev->rx_addr_match = 0;
+	WRITE_ONCE(local_vsdev->rx_filter, VS_RXF_ON | (mask << 8) | addr);
+
+	return count;
 }
 
-/*
- * Flush the data out of serial port. This driver immediately
- * pushes data into receiver's tty buffer hence do nothing here.
- */
-static void vs_flush_chars(struct tty_struct *tty)
+static ssize_t addrfilter_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	pr_debug("flushing the chars!\n");
+	int filter;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	filter = READ_ONCE(local_vsdev->rx_filter);
+	if (!filter)
+		return sprintf(buf, "off\n");
+
+	return sprintf(buf, "%02x %02x\n", VS_RXF_ADDR(filter),
+			VS_RXF_MASK(filter));
 }
+static DEVICE_ATTR_RW(addrfilter);
 
 /*
- * Discard the internal output buffer for this tty device. Typically
- * it may be called when executing IOCTL TCOFLUSH, closing the
- * serial port, when break is received in input stream (flushing
- * is configured) or when hangup occurs.
+ * Measures latency of the data received by this device, written by its
+ * null modem peer or by itself when loop back. For every write() the
+ * time until its first byte reaches this device's tty buffer (queue,
+ * time spent in this driver) and until line discipline consumes it
+ * (e2e) is sampled. What remains to the application's read() is delay
+ * of the application itself. Not available on an RS-485 bus. With a
+ * tap attached to this device each sample is also recorded as a
+ * VS_TAP_LATENCY record.
  *
- * On the other hand, when TCIFLUSH IOCTL is invoked, tty flip buffer
- * and line discipline queue gets emptied without involvement of tty
- * driver. The driver is generally expected not to keep data but send
- * it to tty layer as soon as possible when it receives data.
+ * 1. Start measuring, clears earlier samples:
+ * $ echo "1" > /sys/devices/virtual/tty/ttyVS1/latency
  *
- * As this driver immediately pushes data into receiver's tty buffer
- * hence do nothing here.
+ * 2. Stop measuring (default on startup):
+ * $ echo "0" > /sys/devices/virtual/tty/ttyVS1/latency
  *
- * @tty: tty device whose buffer should be flushed.
+ * 3. Read count and min/avg/max in ns of each stage followed by log2
+ * histogram, samples of 2^X to 2^(X+1)-1 ns in each stage:
+ * $ cat /sys/devices/virtual/tty/ttyVS1/latency
+ * queue 1520 2304 4785 61012
+ * e2e 1520 6150 12770 230448
+ * 11 120 0
+ * 12 1380 15
+ * ...
  */
-static void vs_flush_buffer(struct tty_struct *tty)
-{
-	pr_debug("flushing the buffer!\n");
-}
-
-/* Provides information as a repsonse to TIOCGSERIAL IOCTL */
-static int vs_get_serinfo(struct tty_struct *tty, unsigned long arg)
+static ssize_t latency_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int ret;
-	struct serial_struct info;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
-	struct serial_struct serial = local_vsdev->serial;
-
-	if (!arg)
-		return -EFAULT;
-
-	memset(&info, 0, sizeof(info));
-
-	info.type		    = PORT_UNKNOWN;
-	info.line		    = serial.line;
-	info.port		    = tty->index;
-	info.irq			= 0;
-	info.flags		    = tty->port->flags;
-	info.xmit_fifo_size = 0;
-	info.baud_base	    = 0;
-	info.close_delay	= tty->port->close_delay;
-	info.closing_wait   = tty->port->closing_wait;
-	info.custom_divisor = 0;
-	info.hub6		    = 0;
-	info.io_type		= SERIAL_IO_MEM;
+	unsigned long flags;
+	struct vs_lat *lat = NULL;
+	struct vs_lat *old;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	ret = copy_to_user((void __user *)arg, &info,
-				sizeof(struct serial_struct));
+	if (!buf || (count <= 0) || local_vsdev->bus)
+		return -EINVAL;
 
-	return ret ? -EFAULT : 0;
-}
+	switch (buf[0]) {
+	case '0':
+		break;
+	case '1':
+		lat = kzalloc(sizeof(struct vs_lat), GFP_KERNEL);
+		if (lat == NULL)
+			return -ENOMEM;
+		spin_lock_init(&lat->lock);
+		break;
+	default:
+		return -EINVAL;
+	}
 
-/* Returns number of bytes that can be queued to this device now */
-static int vs_write_room(struct tty_struct *tty)
-{
-	struct vs_dev *tx_vsdev = db[tty->index].vsdev;
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	old = rcu_dereference_protected(local_vsdev->lat,
+				lockdep_is_held(&local_vsdev->lock));
+	rcu_assign_pointer(local_vsdev->lat, lat);
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
 
-	if (tx_vsdev->tx_paused || !tty ||
-			tty->stopped || tty->hw_stopped)
-		return 0;
+	if (old)
+		kfree_rcu(old, rcu);
 
-	return 2048;
+	return count;
 }
 
-/*
- * Invoked when serial terminal settings are chaged. The old_termios
- * contains currently active settings and tty->termios contains new
- * settings to be applied.
- */
-static void vs_set_termios(struct tty_struct *tty,
-				struct ktermios *old_termios)
+static ssize_t latency_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	u32 baud;
-	int uart_frame_settings;
-	unsigned int rts_mappings, dtr_mappings;
-	unsigned int mask = TIOCM_DTR;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	int x, len = 0;
+	u64 avg;
+	unsigned long flags;
+	struct vs_lat *lat;
+	struct vs_lat_hist *hist;
+	static const char * const stages[] = { "queue", "e2e" };
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	rts_mappings = local_vsdev->rts_mappings;
-	dtr_mappings = local_vsdev->dtr_mappings;
+	if (!buf)
+		return -EINVAL;
 
-	mutex_lock(&local_vsdev->lock);
+	/* snapshot, consistent across both stages */
+	hist = kmalloc_array(2, sizeof(struct vs_lat_hist), GFP_KERNEL);
+	if (hist == NULL)
+		return -ENOMEM;
 
-	/*
-	 * Typically B0 is used to terminate the connection.
-	 * Drop RTS and DTR.
-	 */
-	if ((tty->termios.c_cflag & CBAUD) == B0) {
-		vs_update_modem_lines(tty, 0, TIOCM_DTR | TIOCM_RTS);
-		mutex_unlock(&local_vsdev->lock);
-		return;
+	rcu_read_lock();
+	lat = rcu_dereference(local_vsdev->lat);
+	if (lat) {
+		spin_lock_irqsave(&lat->lock, flags);
+		hist[0] = lat->queue;
+		hist[1] = lat->e2e;
+		spin_unlock_irqrestore(&lat->lock, flags);
 	}
+	rcu_read_unlock();
 
-	/* If coming out of B0, raise DTR and RTS. This might get
-	 * overridden in next steps. Applications like minicom when
-	 * opens a serial port, may drop speed to B0 and then back
-	 * to normal speed again.
-	 */
-	if (!old_termios || (old_termios->c_cflag & CBAUD) == B0) {
-		if (!(tty->termios.c_cflag & CRTSCTS) ||
-				!test_bit(TTY_THROTTLED, &tty->flags)) {
-			mask |= TIOCM_RTS;
-			vs_update_modem_lines(tty, mask, 0);
-		}
+	if (lat == NULL) {
+		kfree(hist);
+		return sprintf(buf, "off\n");
 	}
 
-	baud = tty_get_baud_rate(tty);
-	if (!baud)
-		baud = 9600;
+	for (x = 0; x < 2; x++) {
+		avg = hist[x].count ? div64_u64(hist[x].sum, hist[x].count) : 0;
+		len += sprintf(buf + len, "%s %llu %llu %llu %llu\n",
+				stages[x], hist[x].count, hist[x].min, avg,
+				hist[x].max);
+	}
 
-	tty_encode_baud_rate(tty, baud, baud);
+	for (x = 0; x < VS_LAT_BUCKETS; x++) {
+		if (hist[0].bucket[x] || hist[1].bucket[x])
+			len += sprintf(buf + len, "%d %u %u\n", x,
+					hist[0].bucket[x], hist[1].bucket[x]);
+	}
 
-	local_vsdev->baud = baud;
+	kfree(hist);
+	return len;
+}
+static DEVICE_ATTR_RW(latency);
 
-	uart_frame_settings = 0;
-	if (tty->termios.c_cflag & CRTSCTS) {
-		uart_frame_settings |= VS_CRTSCTS;
-	} else if ((tty->termios.c_iflag & IXON) ||
-					(tty->termios.c_iflag & IXOFF)) {
-		uart_frame_settings |= VS_XON;
-	} else {
-		uart_frame_settings |= VS_NONE;
-	}
+/* Probability of 'n' in 'per' scaled to 2^32 */
+static u32 vs_imp_prob(u32 n, u32 per)
+{
+	return min_t(u64, div_u64((u64)n << 32, per), U32_MAX);
+}
 
-	switch (tty->termios.c_cflag & CSIZE) {
-	case CS8:
-		uart_frame_settings |= VS_DATA_8;
-		break;
-	case CS7:
-		uart_frame_settings |= VS_DATA_7;
-		break;
-	case CS6:
-		uart_frame_settings |= VS_DATA_6;
-		break;
-	case CS5:
-		uart_frame_settings |= VS_DATA_5;
-		break;
-	default:
-		uart_frame_settings |= VS_DATA_8;
-	}
+/* Parses impairment settings given to impair_store() into 'imp' */
+static int vs_imp_parse(const char *buf, struct vs_imp *imp)
+{
+	int x, ret = 0;
+	u64 q, r;
+	char *copy, *opts, *key, *val;
 
-	if (tty->termios.c_cflag & CSTOPB)
-		uart_frame_settings |= VS_STOP_2;
-	else
-		uart_frame_settings |= VS_STOP_1;
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (copy == NULL)
+		return -ENOMEM;
 
-	if (tty->termios.c_cflag & PARENB) {
-		if (tty->termios.c_cflag & CMSPAR) {
-			if (tty->termios.c_cflag & PARODD)
-				uart_frame_settings |= VS_PARITY_MARK;
-			else
-				uart_frame_settings |= VS_PARITY_SPACE;
-		} else {
-			if (tty->termios.c_cflag & PARODD)
-				uart_frame_settings |= VS_PARITY_ODD;
-			else
-				uart_frame_settings |= VS_PARITY_EVEN;
+	opts = strim(copy);
+	while ((ret == 0) && ((key = strsep(&opts, " \t")) != NULL)) {
+		if (*key == '\0')
+			continue;
+		val = strchr(key, '=');
+		if (val == NULL) {
+			ret = -EINVAL;
+			break;
 		}
-	} else {
-		uart_frame_settings |= VS_PARITY_NONE;
+		*val++ = '\0';
+
+		if (strcmp(key, "seed") == 0)
+			ret = kstrtou64(val, 0, &imp->seed);
+		else if (strcmp(key, "ber") == 0)
+			ret = kstrtou32(val, 0, &imp->ber);
+		else if (strcmp(key, "drop") == 0)
+			ret = kstrtou32(val, 0, &imp->drop);
+		else if (strcmp(key, "dup") == 0)
+			ret = kstrtou32(val, 0, &imp->dup);
+		else if (strcmp(key, "burst") == 0)
+			ret = (sscanf(val, "%u:%u", &imp->burst,
+					&imp->burst_len) == 2) ? 0 : -EINVAL;
+		else if (strcmp(key, "delay") == 0)
+			ret = (sscanf(val, "%u:%u", &imp->delay_us,
+					&imp->jitter_us) >= 1) ? 0 : -EINVAL;
+		else
+			ret = -EINVAL;
 	}
+	kfree(copy);
+	if (ret < 0)
+		return ret;
 
-	local_vsdev->uart_frame = uart_frame_settings;
+	if ((imp->ber > NSEC_PER_SEC) || (imp->drop > USEC_PER_SEC) ||
+			(imp->dup > USEC_PER_SEC) ||
+			(imp->burst > USEC_PER_SEC) ||
+			(imp->burst && (imp->burst_len == 0)) ||
+			((u64)imp->delay_us + imp->jitter_us > VS_IMP_DELAY_MAX))
+		return -EINVAL;
 
-	mutex_unlock(&local_vsdev->lock);
-}
+	imp->p_bit = vs_imp_prob(imp->ber, NSEC_PER_SEC);
+	imp->p_burst = vs_imp_prob(imp->burst, USEC_PER_SEC);
+	imp->p_drop = vs_imp_prob(imp->drop, USEC_PER_SEC);
+	imp->p_dup = vs_imp_prob(imp->dup, USEC_PER_SEC);
+
+	/* byte has an error with probability 1 - (1 - p_bit)^8 */
+	if (imp->p_bit) {
+		q = (1ULL << 32) - imp->p_bit;
+		r = 1ULL << 32;
+		for (x = 0; x < 8; x++)
+			r = (r * q) >> 32;
+		imp->p_byte = min_t(u64, (1ULL << 32) - r, U32_MAX);
+	}
 
-/*
- * Returns the number of bytes in device's output queue. This is
- * invoked when TIOCOUTQ IOCTL is executed or by tty core as and
- * when required. Because we all push all data into receiver's
- * end tty buffer, always return 0 here.
- */
-static int vs_chars_in_buffer(struct tty_struct *tty)
-{
+	prandom_seed_state(&imp->rnd, imp->seed);
 	return 0;
 }
 
 /*
- * Based on the number od interrupts check if any of the signal
- * line has changed.
+ * Impairs the line from this device to its receiver. Data written to
+ * this device is passed through a pseudo random generator seeded with
+ * 'seed', so the same settings and the same sequence of writes give
+ * the same errors every time. Settings are given as key=value pairs,
+ * missing keys are 0:
+ *
+ * seed=N      seed of the pseudo random generator
+ * ber=N       bit error rate, bits flipped per 10^9 bits
+ * burst=N:L   error bursts per 10^6 bytes, every byte of a burst of L
+ *             bytes is garbled
+ * drop=N      bytes lost per 10^6 bytes
+ * dup=N       bytes received twice per 10^6 bytes
+ * delay=U:J   every write reaches the receiver U plus a random 0 to J
+ *             micro seconds later, in order (max 10 seconds)
+ *
+ * Writing new settings starts over with the seed and releases data
+ * held back by the earlier delay. Reading gives the settings followed
+ * by the number of bits flipped, bursts, bytes dropped and bytes
+ * duplicated so far.
+ *
+ * 1. One bit error in 10^5 bits and 5 ms +/- 1 ms delay:
+ * $ echo "seed=7 ber=10000 delay=4000:2000" > /sys/devices/virtual/tty/ttyVS0/impair
+ *
+ * 2. Clean line (default on startup):
+ * $ echo "off" > /sys/devices/virtual/tty/ttyVS0/impair
  */
-static int vs_check_msr_delta(struct tty_struct *tty,
-		struct vs_dev *local_vsdev, unsigned long mask,
-		struct async_icount *prev)
+static ssize_t impair_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int delta;
-	struct async_icount now;
+	int ret;
+	unsigned long flags;
+	struct vs_imp *imp = NULL;
+	struct vs_imp *old;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	/*
-	 * Use tty-port initialised flag to detect all hangups
-	 * including the disconnect(device destroy) event.
-	 */
-	if (!test_bit(ASYNCB_INITIALIZED, &tty->port->flags))
-		return 1;
+	if (!buf || (count <= 0))
+		return -EINVAL;
 
-	mutex_lock(&local_vsdev->lock);
-	now = local_vsdev->icount;
-	mutex_unlock(&local_vsdev->lock);
-	delta = ((mask & TIOCM_RNG && prev->rng != now.rng) ||
-			 (mask & TIOCM_DSR && prev->dsr != now.dsr) ||
-			 (mask & TIOCM_CAR && prev->dcd != now.dcd) ||
-			 (mask & TIOCM_CTS && prev->cts != now.cts));
+	if (!sysfs_streq(buf, "off")) {
+		imp = kzalloc(sizeof(struct vs_imp), GFP_KERNEL);
+		if (imp == NULL)
+			return -ENOMEM;
+		ret = vs_imp_parse(buf, imp);
+		if (ret < 0) {
+			kfree(imp);
+			return ret;
+		}
+	}
 
-	*prev = now;
-	return delta;
+	spin_lock_irqsave(&local_vsdev->tx_lock, flags);
+	old = rcu_dereference_protected(local_vsdev->imp,
+				lockdep_is_held(&local_vsdev->tx_lock));
+	rcu_assign_pointer(local_vsdev->imp, imp);
+	spin_unlock_irqrestore(&local_vsdev->tx_lock, flags);
+
+	if (old) {
+		if (old->held)
+			vs_tx_queue(local_vsdev, 0, 1);
+		kfree_rcu(old, rcu);
+	}
+
+	return count;
 }
 
-/* Sleeps until at-least one of the modem lines changes */
-static int vs_wait_change(struct tty_struct *tty, unsigned long mask)
+static ssize_t impair_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	int ret;
-	struct async_icount prev;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	int len;
+	unsigned long flags;
+	struct vs_imp *imp;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	mutex_lock(&local_vsdev->lock);
+	if (!buf)
+		return -EINVAL;
 
-	local_vsdev->waiting_msr_chg = 1;
-	prev = local_vsdev->icount;
+	rcu_read_lock();
+	spin_lock_irqsave(&local_vsdev->tx_lock, flags);
+	imp = rcu_dereference(local_vsdev->imp);
+	if (imp == NULL) {
+		len = sprintf(buf, "off\n");
+	} else {
+		len = sprintf(buf, "seed=%llu ber=%u burst=%u:%u drop=%u "
+			"dup=%u delay=%u:%u\n%llu %llu %llu %llu\n", imp->seed,
+			imp->ber,
+			imp->burst, imp->burst_len, imp->drop, imp->dup,
+			imp->delay_us, imp->jitter_us, imp->flipped,
+			imp->bursts, imp->dropped, imp->duplicated);
+	}
+	spin_unlock_irqrestore(&local_vsdev->tx_lock, flags);
+	rcu_read_unlock();
 
-	mutex_unlock(&local_vsdev->lock);
+	return len;
+}
+static DEVICE_ATTR_RW(impair);
 
-	ret = wait_event_interruptible(tty->port->delta_msr_wait,
-			vs_check_msr_delta(tty, local_vsdev, mask, &prev));
+/*
+ * Depth of the emulated UART transmit FIFO in bytes, 1 to 4096. Bytes
+ * written but not yet delivered never exceed it, so write room, TIOCOUTQ
+ * and tcdrain() behave as with a real UART of that FIFO size, e.g. 16
+ * for a 16550A or 256 for an FT232R. Also reported and set through
+ * xmit_fifo_size of TIOCGSERIAL/TIOCSSERIAL.
+ *
+ * 1. Emulate 16550A:
+ * $ echo "16" > /sys/devices/virtual/tty/ttyVS0/fifo
+ *
+ * 2. Use whole transmit ring (default on startup):
+ * $ echo "0" > /sys/devices/virtual/tty/ttyVS0/fifo
+ */
+static ssize_t fifo_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned int depth;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	local_vsdev->waiting_msr_chg = 0;
+	if (!buf || (count <= 0))
+		return -EINVAL;
 
-	if (!ret && !test_bit(ASYNCB_INITIALIZED, &tty->port->flags))
-		ret = -EIO;
+	ret = kstrtouint(buf, 0, &depth);
+	if (ret < 0)
+		return ret;
 
-	return ret;
+	ret = vs_set_fifo_depth(local_vsdev, depth);
+	return ret ? ret : count;
 }
 
-/* Execute IOCTL commands */
-static int vs_ioctl(struct tty_struct *tty,
-				unsigned int cmd, unsigned long arg)
+static ssize_t fifo_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	switch (cmd) {
-	case TIOCGSERIAL:
-		return vs_get_serinfo(tty, arg);
-	case TIOCMIWAIT:
-		return vs_wait_change(tty, arg);
-	}
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	return -ENOIOCTLCMD;
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", READ_ONCE(local_vsdev->fifo_depth));
 }
+static DEVICE_ATTR_RW(fifo);
 
 /*
- * Invoked when tty layer's input buffers are about to get full.
+ * Selects the CPU which moves data written by the other end (or by
+ * this device when loop back or on a bus) into this device's tty
+ * buffer, so that latency critical ports can be kept on reserved
+ * cores. Applies to delivery from workqueue; the timer of paced mode
+ * runs on the CPU which started it. When the CPU goes offline data is
+ * delivered on the writer's CPU.
  *
- * When using RTS/CTS flow control, when RTS line is de-asserted,
- * interrupt will be generated in hardware. The interrupt handler
- * will raise a flag to indicate transmission should be stopped.
- * This is achieved in this driver through tx_paused variable.
+ * 1. Deliver data to this device on CPU 3:
+ * $ echo "3" > /sys/devices/virtual/tty/ttyVS1/rxcpu
+ *
+ * 2. Deliver on the CPU which wrote the data (default on startup):
+ * $ echo "-1" > /sys/devices/virtual/tty/ttyVS1/rxcpu
  */
-static void vs_throttle(struct tty_struct *tty)
+static ssize_t rxcpu_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
-	struct vs_dev *remote_vsdev = db[local_vsdev->peer_index].vsdev;
+	int ret, cpu;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
 
-	if (tty->termios.c_cflag & CRTSCTS) {
-		mutex_lock(&local_vsdev->lock);
-		remote_vsdev->tx_paused = 1;
-		vs_update_modem_lines(tty, 0, TIOCM_RTS);
-		mutex_unlock(&local_vsdev->lock);
-	} else if ((tty->termios.c_iflag & IXON) ||
-				(tty->termios.c_iflag & IXOFF)) {
-		vs_put_char(tty, STOP_CHAR(tty));
-	} else {
-		/* do nothing */
-	}
-}
+	if (!buf || (count <= 0))
+		return -EINVAL;
 
-/*
- * Invoked when the tty layer's input buffers have been emptied out,
- * and it now can accept more data. Throttle/Unthrottle is about
- * notifying remote end to start or stop data as per the currently
+	ret = kstrtoint(buf, 0, &cpu);
+	if (ret < 0)
+		return ret;
+	if ((cpu < -1) || ((cpu >= 0) &&
+			((cpu >= nr_cpu_ids) || !cpu_possible(cpu))))
+		return -EINVAL;
+
+	WRITE_ONCE(local_vsdev->rxcpu, cpu);
+	return count;
+}
+
+static ssize_t rxcpu_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%d\n", READ_ONCE(local_vsdev->rxcpu));
+}
+static DEVICE_ATTR_RW(rxcpu);
+
+/*
+ * Gives index of the tty device corresponding to this sysfs node.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/ownidx
+ */
+static ssize_t ownidx_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", local_vsdev->own_index);
+}
+static DEVICE_ATTR_RO(ownidx);
+
+/*
+ * Gives index of the tty device to which given tty devices is
+ * connected, or of the first member of its RS-485 bus.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/peeridx
+ */
+static ssize_t peeridx_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", vs_peer_index(local_vsdev));
+}
+static DEVICE_ATTR_RO(peeridx);
+
+/*
+ * Gives RTS line connections for the given tty device.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/ortsmap
+ */
+static ssize_t ortsmap_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", local_vsdev->rts_mappings);
+}
+static DEVICE_ATTR_RO(ortsmap);
+
+/*
+ * Gives DTR line connections for the given tty device.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/odtrmap
+ */
+static ssize_t odtrmap_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", local_vsdev->dtr_mappings);
+}
+static DEVICE_ATTR_RO(odtrmap);
+
+/*
+ * Gives RTS line connections of the tty device to which the
+ * given tty device is connected. All members of an RS-485 bus have
+ * the mapping the bus was created with, which is given for them.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/prtsmap
+ */
+static ssize_t prtsmap_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t ret = -ENODEV;
+	struct vs_dev *remote_vsdev;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	if (local_vsdev->bus)
+		return sprintf(buf, "%u\n", local_vsdev->rts_mappings);
+
+	if (local_vsdev->own_index == local_vsdev->peer_index)
+		return -EINVAL;
+
+	rcu_read_lock();
+	remote_vsdev = rcu_dereference(local_vsdev->peer);
+	if (remote_vsdev)
+		ret = sprintf(buf, "%u\n", remote_vsdev->rts_mappings);
+	rcu_read_unlock();
+
+	return ret;
+}
+static DEVICE_ATTR_RO(prtsmap);
+
+/*
+ * Gives DTR line connections of the tty device to which the
+ * given tty device is connected. All members of an RS-485 bus have
+ * the mapping the bus was created with, which is given for them.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/pdtrmap
+ */
+static ssize_t pdtrmap_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t ret = -ENODEV;
+	struct vs_dev *remote_vsdev;
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	if (local_vsdev->bus)
+		return sprintf(buf, "%u\n", local_vsdev->dtr_mappings);
+
+	if (local_vsdev->own_index == local_vsdev->peer_index)
+		return -EINVAL;
+
+	rcu_read_lock();
+	remote_vsdev = rcu_dereference(local_vsdev->peer);
+	if (remote_vsdev)
+		ret = sprintf(buf, "%u\n", remote_vsdev->dtr_mappings);
+	rcu_read_unlock();
+
+	return ret;
+}
+static DEVICE_ATTR_RO(pdtrmap);
+
+/*
+ * Gives type (loopback / null modem) of the given tty device.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/odevtyp
+ */
+static ssize_t odevtyp_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", local_vsdev->odevtyp);
+}
+static DEVICE_ATTR_RO(odevtyp);
+
+/*
+ * Return value of 1 means, DTR signal will be asserted when given
+ * this tty device is opeded. Value 0 means it will not be asserted.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/odtropn
+ */
+static ssize_t odtropn_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", local_vsdev->set_odtr_at_open);
+}
+static DEVICE_ATTR_RO(odtropn);
+
+/*
+ * Return value of 1 means, DTR signal of the peer tty device will
+ * be asserted when given peer tty device is opeded. Value 0 means
+ * it will not be asserted.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/pdtropn
+ */
+static ssize_t pdtropn_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u\n", local_vsdev->set_odtr_at_open);
+}
+static DEVICE_ATTR_RO(pdtropn);
+
+/*
+ * Gives serial port events stats.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/ostats
+ */
+static ssize_t ostats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%u#%u#%u#%u#%u#%u#%u#%u#%u#%u#%u#\n",
+			local_vsdev->icount.tx, local_vsdev->icount.rx,
+			local_vsdev->icount.cts, local_vsdev->icount.dcd,
+			local_vsdev->icount.dsr, local_vsdev->icount.brk,
+			local_vsdev->icount.rng, local_vsdev->icount.frame,
+			local_vsdev->icount.parity, local_vsdev->icount.overrun,
+			local_vsdev->icount.buf_overrun);
+}
+static DEVICE_ATTR_RO(ostats);
+
+/*
+ * Gives number of collisions detected on the RS-485 bus this device
+ * is member of.
+ * $ cat /sys/devices/virtual/tty/ttyVS0/collisions
+ */
+static ssize_t collisions_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct vs_dev *local_vsdev = dev_get_drvdata(dev);
+
+	if (!local_vsdev->bus || !buf)
+		return -EINVAL;
+
+	return sprintf(buf, "%lu\n", READ_ONCE(local_vsdev->bus->collisions));
+}
+static DEVICE_ATTR_RO(collisions);
+
+/*
+ * Traffic counters of this device as struct vs_ioc_stats (see ttyvs.h).
+ * $ od -A d -t u8 -j 8 /sys/devices/virtual/tty/ttyvs0/stats
+ */
+static ssize_t stats_read(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct vs_ioc_stats stats;
+	struct vs_dev *local_vsdev = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (off >= sizeof(stats))
+		return 0;
+	if (count > sizeof(stats) - off)
+		count = sizeof(stats) - off;
+
+	vs_stat_read(local_vsdev, &stats);
+	memcpy(buf, (char *)&stats + off, count);
+
+	return count;
+}
+static BIN_ATTR_RO(stats, sizeof(struct vs_ioc_stats));
+
+static struct bin_attribute *vs_info_bin_attrs[] = {
+	&bin_attr_stats,
+	NULL,
+};
+
+static struct attribute *vs_info_attrs[] = {
+	&dev_attr_event.attr,
+	&dev_attr_faultycable.attr,
+	&dev_attr_pacing.attr,
+	&dev_attr_addrfilter.attr,
+	&dev_attr_latency.attr,
+	&dev_attr_impair.attr,
+	&dev_attr_rxcpu.attr,
+	&dev_attr_fifo.attr,
+	&dev_attr_ownidx.attr,
+	&dev_attr_peeridx.attr,
+	&dev_attr_ortsmap.attr,
+	&dev_attr_odtrmap.attr,
+	&dev_attr_prtsmap.attr,
+	&dev_attr_pdtrmap.attr,
+	&dev_attr_odevtyp.attr,
+	&dev_attr_odtropn.attr,
+	&dev_attr_pdtropn.attr,
+	&dev_attr_ostats.attr,
+	&dev_attr_collisions.attr,
+	NULL,
+};
+
+static const struct attribute_group vs_info_attr_group = {
+	.attrs = vs_info_attrs,
+	.bin_attrs = vs_info_bin_attrs,
+};
+
+/*
+ * Checks if the given serial port has received its carrier detect
+ * line raised or not. Return 1 if the carrier is raised otherwise 0.
+ */
+static int vs_port_carrier_raised(struct tty_port *port)
+{
+	struct vs_dev *local_vsdev = port->tty->driver_data;
+
+	return (local_vsdev->msr_reg & VS_MSR_DCD) ? 1 : 0;
+}
+
+/* Shutdown the given serial port */
+static void vs_port_shutdown(struct tty_port *port)
+{
+	pr_debug("shutting down the port!\n");
+}
+
+/*
+ * Invoked when tty is going to be destroyed and driver should
+ * release resources. This is the last put of the port in
+ * vs_cleanup(), which runs only after every reference taken to the
+ * tty through vs_tty_get() has been dropped and own_tty no longer
+ * points to it, so nothing can reach the port anymore.
+ */
+static void vs_port_destruct(struct tty_port *port)
+{
+	pr_debug("destroying the port!\n");
+	kfree(port);
+}
+
+/* Activate the given serial port as opposed to shutdown */
+static int vs_port_activate(struct tty_port *port, struct tty_struct *tty)
+{
+	return 0;
+}
+
+static const struct tty_port_operations vs_port_ops = {
+	.carrier_raised = vs_port_carrier_raised,
+	.shutdown       = vs_port_shutdown,
+	.activate       = vs_port_activate,
+	.destruct       = vs_port_destruct,
+};
+
+/*
+ * Hands data from tty buffer to the line discipline as tty core would
+ * do itself, the number of bytes taken by ldisc is the consumption
+ * point for latency measurement.
+ */
+static int vs_port_receive_buf(struct tty_port *port,
+		const unsigned char *p, const unsigned char *f, size_t count)
+{
+	int ret;
+	struct tty_struct *tty;
+	struct tty_ldisc *disc;
+	struct vs_dev *vsdev;
+
+	tty = READ_ONCE(port->itty);
+	if (tty == NULL)
+		return 0;
+
+	disc = tty_ldisc_ref(tty);
+	if (disc == NULL)
+		return 0;
+
+	ret = tty_ldisc_receive_buf(disc, p, (char *)f, count);
+
+	tty_ldisc_deref(disc);
+
+	vsdev = tty->driver_data;
+	if (vsdev && (ret > 0))
+		vs_lat_consume(vsdev, ret);
+
+	return ret;
+}
+
+/* Same as tty core's default, tty_port_tty_wakeup() would recurse */
+static void vs_port_write_wakeup(struct tty_port *port)
+{
+	struct tty_struct *tty = tty_port_tty_get(port);
+
+	if (tty) {
+		tty_wakeup(tty);
+		tty_kref_put(tty);
+	}
+}
+
+static const struct tty_port_client_operations vs_port_client_ops = {
+	.receive_buf  = vs_port_receive_buf,
+	.write_wakeup = vs_port_write_wakeup,
+};
+
+/*
+ * Locks the given device and the other end of its connection, lower
+ * index first, as both ends of a null modem pair change the modem
+ * status register and flow control state of each other. Returns the
+ * other end to be passed to vs_unlock_pair(), the device itself for a
+ * loop back device or NULL if the other end is being deleted. Caller
+ * holds rcu read lock until vs_unlock_pair().
+ */
+static struct vs_dev *vs_lock_pair(struct vs_dev *vsdev,
+					unsigned long *flags)
+{
+	struct vs_dev *peer = rcu_dereference(vsdev->peer);
+
+	local_irq_save(*flags);
+	if (!peer || (peer == vsdev)) {
+		spin_lock(&vsdev->lock);
+	} else if (peer->own_index < vsdev->own_index) {
+		spin_lock(&peer->lock);
+		spin_lock_nested(&vsdev->lock, SINGLE_DEPTH_NESTING);
+	} else {
+		spin_lock(&vsdev->lock);
+		spin_lock_nested(&peer->lock, SINGLE_DEPTH_NESTING);
+	}
+
+	return peer;
+}
+
+static void vs_unlock_pair(struct vs_dev *vsdev, struct vs_dev *peer,
+				unsigned long flags)
+{
+	if (peer && (peer != vsdev))
+		spin_unlock(&peer->lock);
+	spin_unlock(&vsdev->lock);
+	local_irq_restore(flags);
+}
+
+/*
+ * Update modem control and status registers according to the bit
+ * mask(s) provided. The RTS and DTR values can be set only if the
+ * current handshaking state of the tty device allows direct control
+ * of the modem control lines. The pin mappings are honoured.
+ *
+ * Caller holds lock of the given virtual tty device and of its other
+ * end, see vs_lock_pair().
+ */
+static int vs_update_modem_lines(struct tty_struct *tty,
+			unsigned int set, unsigned int clear)
+{
+	int ctsint = 0;
+	int dcdint = 0;
+	int dsrint = 0;
+	int rngint = 0;
+	int mcr_ctrl_reg = 0;
+	int wakeup_blocked_open = 0;
+	int rts_mappings, dtr_mappings, msr_state_reg, old_msr;
+	struct async_icount *evicount;
+	struct tty_struct *msr_tty;
+	struct vs_dev *vsdev, *local_vsdev;
+
+	local_vsdev = tty->driver_data;
+
+	rcu_read_lock();
+
+	/*
+	 * Read modify write MSR register of the other end (or self for
+	 * loop back). If the other end is being deleted, only our own
+	 * modem control register changes.
+	 */
+	vsdev = rcu_dereference(local_vsdev->peer);
+	if (vsdev == NULL)
+		vsdev = local_vsdev;
+	msr_state_reg = vsdev->msr_reg;
+	old_msr = msr_state_reg;
+
+	rts_mappings = local_vsdev->rts_mappings;
+	dtr_mappings = local_vsdev->dtr_mappings;
+
+	if (set & TIOCM_RTS) {
+		mcr_ctrl_reg |= VS_MCR_RTS;
+		if ((rts_mappings & VS_CON_CTS) == VS_CON_CTS) {
+			msr_state_reg |= VS_MSR_CTS;
+			ctsint++;
+		}
+		if ((rts_mappings & VS_CON_DCD) == VS_CON_DCD) {
+			msr_state_reg |= VS_MSR_DCD;
+			dcdint++;
+			wakeup_blocked_open = 1;
+		}
+		if ((rts_mappings & VS_CON_DSR) == VS_CON_DSR) {
+			msr_state_reg |= VS_MSR_DSR;
+			dsrint++;
+		}
+		if ((rts_mappings & VS_CON_RI) == VS_CON_RI) {
+			msr_state_reg |= VS_MSR_RI;
+			rngint++;
+		}
+	}
+
+	if (set & TIOCM_DTR) {
+		mcr_ctrl_reg |= VS_MCR_DTR;
+		if ((dtr_mappings & VS_CON_CTS) == VS_CON_CTS) {
+			msr_state_reg |= VS_MSR_CTS;
+			ctsint++;
+		}
+		if ((dtr_mappings & VS_CON_DCD) == VS_CON_DCD) {
+			msr_state_reg |= VS_MSR_DCD;
+			dcdint++;
+			wakeup_blocked_open = 1;
+		}
+		if ((dtr_mappings & VS_CON_DSR) == VS_CON_DSR) {
+			msr_state_reg |= VS_MSR_DSR;
+			dsrint++;
+		}
+		if ((dtr_mappings & VS_CON_RI) == VS_CON_RI) {
+			msr_state_reg |= VS_MSR_RI;
+			rngint++;
+		}
+	}
+
+	if (clear & TIOCM_RTS) {
+		mcr_ctrl_reg &= ~VS_MCR_RTS;
+		if ((rts_mappings & VS_CON_CTS) == VS_CON_CTS) {
+			msr_state_reg &= ~VS_MSR_CTS;
+			ctsint++;
+		}
+		if ((rts_mappings & VS_CON_DCD) == VS_CON_DCD) {
+			msr_state_reg &= ~VS_MSR_DCD;
+			dcdint++;
+		}
+		if ((rts_mappings & VS_CON_DSR) == VS_CON_DSR) {
+			msr_state_reg &= ~VS_MSR_DSR;
+			dsrint++;
+		}
+		if ((rts_mappings & VS_CON_RI) == VS_CON_RI) {
+			msr_state_reg &= ~VS_MSR_RI;
+			rngint++;
+		}
+	}
+
+	if (clear & TIOCM_DTR) {
+		mcr_ctrl_reg &= ~VS_MCR_DTR;
+		if ((dtr_mappings & VS_CON_CTS) == VS_CON_CTS) {
+			msr_state_reg &= ~VS_MSR_CTS;
+			ctsint++;
+		}
+		if ((dtr_mappings & VS_CON_DCD) == VS_CON_DCD) {
+			msr_state_reg &= ~VS_MSR_DCD;
+			dcdint++;
+		}
+		if ((dtr_mappings & VS_CON_DSR) == VS_CON_DSR) {
+			msr_state_reg &= ~VS_MSR_DSR;
+			dsrint++;
+		}
+		if ((dtr_mappings & VS_CON_RI) == VS_CON_RI) {
+			msr_state_reg &= ~VS_MSR_RI;
+			rngint++;
+		}
+	}
+
+	trace_ttyvs_modem(local_vsdev->own_index, vsdev->own_index,
+			local_vsdev->mcr_reg, mcr_ctrl_reg, old_msr,
+			msr_state_reg);
+
+	local_vsdev->mcr_reg = mcr_ctrl_reg;
+	vsdev->msr_reg = msr_state_reg;
+
+	if (msr_state_reg != old_msr)
+		vs_evt_post(vsdev, VS_EVT_MODEM,
+				vs_msr_to_tiocm(msr_state_reg),
+				vs_msr_to_tiocm(msr_state_reg ^ old_msr));
+
+	vs_tap_event(local_vsdev, VS_TAP_MODEM,
+			((mcr_ctrl_reg & VS_MCR_DTR) ? TIOCM_DTR : 0) |
+			((mcr_ctrl_reg & VS_MCR_RTS) ? TIOCM_RTS : 0));
+
+	evicount = &vsdev->icount;
+	evicount->cts += ctsint;
+	evicount->dsr += dsrint;
+	evicount->dcd += dcdint;
+	evicount->rng += rngint;
+
+	msr_tty = vs_tty_get(vsdev);
+	if (msr_tty) {
+		/* Wake up process blocked on TIOCMIWAIT ioctl */
+		if ((vsdev->waiting_msr_chg == 1) &&
+				(msr_tty->port->count > 0)) {
+			wake_up_interruptible(&msr_tty->port->delta_msr_wait);
+		}
+
+		/* Wake up application blocked on carrier detect signal */
+		if ((wakeup_blocked_open == 1) &&
+				(msr_tty->port->blocked_open > 0)) {
+			wake_up_interruptible(&msr_tty->port->open_wait);
+		}
+		tty_kref_put(msr_tty);
+	}
+
+	rcu_read_unlock();
+	return 0;
+}
+
+/* Same as vs_update_modem_lines() for callers holding no lock */
+static int vs_change_modem_lines(struct tty_struct *tty,
+			unsigned int set, unsigned int clear)
+{
+	int ret;
+	unsigned long flags;
+	struct vs_dev *remote_vsdev;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	rcu_read_lock();
+	remote_vsdev = vs_lock_pair(local_vsdev, &flags);
+	ret = vs_update_modem_lines(tty, set, clear);
+	vs_unlock_pair(local_vsdev, remote_vsdev, flags);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Invoked when user space process opens a serial port. The tty core
+ * calls this to install tty and initialize the required resources.
+ * The tty takes a reference to the virtual device, so that all tty
+ * operations can use tty->driver_data even if the device gets
+ * deleted meanwhile.
+ */
+static int vs_install(struct tty_driver *drv, struct tty_struct *tty)
+{
+	int ret;
+	struct tty_port *port;
+	struct vs_dev *vsdev;
+
+	rcu_read_lock();
+	vsdev = rcu_dereference(db[tty->index].vsdev);
+	if (vsdev && (READ_ONCE(vsdev->removed) ||
+				!kref_get_unless_zero(&vsdev->kref)))
+		vsdev = NULL;
+	rcu_read_unlock();
+	if (vsdev == NULL)
+		return -ENODEV;
+
+	port = kcalloc(1, sizeof(struct tty_port), GFP_KERNEL);
+	if (port == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	/* First initialize and then set port operations */
+	tty_port_init(port);
+	port->ops = &vs_port_ops;
+	port->client_ops = &vs_port_client_ops;
+
+	ret = tty_port_install(port, drv, tty);
+	if (ret) {
+		kfree(port);
+		goto fail;
+	}
+
+	tty->driver_data = vsdev;
+	return 0;
+
+fail:
+	kref_put(&vsdev->kref, vs_dev_release);
+	return ret;
+}
+
+/*
+ * Invoked when there exist no user process or tty is to be
+ * released explicitly for whatever reason.
+ */
+static void vs_cleanup(struct tty_struct *tty)
+{
+	struct vs_dev *vsdev = tty->driver_data;
+
+	vs_tty_clear(vsdev, tty);
+	tty->driver_data = NULL;
+	tty_port_put(tty->port);
+	kref_put(&vsdev->kref, vs_dev_release);
+}
+
+/*
+ * Called when open system call is called on virtual tty device node.
+ * The tty core allocates 'struct tty_struct' for this device and
+ * set up various resources, sets up line discipline and call this
+ * function. For first time allocation happens and from next time
+ * onwards only re-opening happens.
+ *
+ * The tty core finds the tty driver serving this device node and the
+ * index of this tty device as registered by this driver with tty core.
+ * From this inded we retrieve the virtual tty device to work on.
+ *
+ * If the same serial port is opened more than once, the tty structure
+ * passed to this function will be same but filp structure will be
+ * different every time. Caller holds tty lock.
+ *
+ * This driver does not set CLOCAL by default. This means that the
+ * open() system call will block until it find its carrier detect
+ * line raised. Application should use O_NONBLOCK/O_NDELAY flag if
+ * it does not want to wait for DCD line change.
+ */
+static int vs_open(struct tty_struct *tty, struct file *filp)
+{
+	int ret;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	/* other end and delivery work find this tty through own_tty */
+	vs_tty_set(local_vsdev, tty);
+
+	memset(&local_vsdev->serial, 0, sizeof(struct serial_struct));
+	memset(&local_vsdev->icount, 0, sizeof(struct async_icount));
+	vs_lat_rx_reset(local_vsdev);
+
+	/*
+	 * Handle DTR raising logic ourselve instead of tty_port helpers
+	 * doing it.
+	 */
+	if (local_vsdev->set_odtr_at_open == 1)
+		vs_change_modem_lines(tty, TIOCM_DTR | TIOCM_RTS, 0);
+
+	/* Associate tty with port and do port level opening. */
+	ret = tty_port_open(tty->port, tty, filp);
+	if (ret < 0)
+		return ret;
+
+	tty->port->close_delay  = 0;
+	tty->port->closing_wait = ASYNC_CLOSING_WAIT_NONE;
+	tty->port->drain_delay  = 0;
+	local_vsdev->is_open = 1;
+
+	return ret;
+}
+
+/*
+ * Invoked by tty layer when release() is called on the file pointer
+ * that was previously created with a call to open().
+ */
+static void vs_close(struct tty_struct *tty, struct file *filp)
+{
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	if (test_bit(TTY_IO_ERROR, &tty->flags))
+		return;
+
+	if (tty && filp && tty->port && (tty->port->count > 0))
+		tty_port_close(tty->port, tty, filp);
+
+	if (tty && tty->port && (tty->port->count < 1)) {
+		local_vsdev->is_open = 0;
+		vs_tty_clear(local_vsdev, tty);
+	}
+
+	if (tty && C_HUPCL(tty) && tty->port && (tty->port->count < 1))
+		vs_change_modem_lines(tty, 0, TIOCM_DTR | TIOCM_RTS);
+}
+
+/*
+ * Gives the mask which emulates the number of data bits currently
+ * configured for the given receiver tty device.
+ */
+static unsigned char vs_data_bits_mask(struct tty_struct *tty)
+{
+	switch (tty->termios.c_cflag & CSIZE) {
+	case CS7:
+		return 0x7F;
+	case CS6:
+		return 0x3F;
+	case CS5:
+		return 0x1F;
+	default:
+		return 0xFF;
+	}
+}
+
+/*
+ * Emulates correct number of data bits by masking off upper bits of
+ * every byte in place. The aligned part of the buffer is processed
+ * a word at a time.
+ */
+static void vs_mask_data_bits(unsigned char *buf, int len,
+				unsigned char mask)
+{
+	unsigned long wmask = (~0UL / 0xFF) * mask;
+
+	while ((len > 0) && !IS_ALIGNED((unsigned long)buf,
+					sizeof(unsigned long))) {
+		*buf++ &= mask;
+		len--;
+	}
+
+	while (len >= (int)sizeof(unsigned long)) {
+		*(unsigned long *)buf &= wmask;
+		buf += sizeof(unsigned long);
+		len -= sizeof(unsigned long);
+	}
+
+	while (len-- > 0)
+		*buf++ &= mask;
+}
+
+/*
+ * Returns 1 if the receiver can not make out data sent with baudrate
+ * and uart frame of the sender. A receiver using address filter takes
+ * both mark and space parity as its parity bit carries address flag.
+ */
+static int vs_frame_mismatch(const struct vs_dev *tx_vsdev,
+				const struct vs_dev *rx_vsdev)
+{
+	int ignore = 0;
+
+	if (READ_ONCE(rx_vsdev->rx_filter))
+		ignore = VS_PARITY_MARK | VS_PARITY_SPACE;
+
+	return ((tx_vsdev->baud != rx_vsdev->baud) ||
+		((tx_vsdev->uart_frame ^ rx_vsdev->uart_frame) & ~ignore));
+}
+
+/*
+ * Returns 1 if the bytes now being sent by the given device are
+ * address bytes, that is sender has set mark parity (9th bit 1). See
+ * applications/9-bit-data.md. Parity is sampled when data leaves the
+ * transmit ring as does a real UART, so sender should use TCSADRAIN
+ * when switching between address and data bytes.
+ */
+static int vs_tx_addr_bytes(const struct vs_dev *tx_vsdev)
+{
+	return (READ_ONCE(tx_vsdev->uart_frame) & VS_PARITY_MARK) ? 1 : 0;
+}
+
+/* Returns 1 if the given address byte selects the filter's device */
+static int vs_rx_addr_match(int filter, unsigned char ch)
+{
+	return ((ch ^ VS_RXF_ADDR(filter)) & VS_RXF_MASK(filter)) ? 0 : 1;
+}
+
+/*
+ * Applies receive address filter to 'len' bytes in place. An address
+ * byte that matches is received and selects the receiver for the data
+ * bytes that follow, any other address byte deselects it. Data bytes
+ * are received only while selected. Returns number of bytes left.
+ */
+static int vs_rx_filter(struct vs_dev *rx_vsdev, int filter, int addr,
+			unsigned char *buf, int len)
+{
+	int x, n = 0;
+
+	if (!addr)
+		return rx_vsdev->rx_addr_match ? len : 0;
+
+	for (x = 0; x < len; x++) {
+		rx_vsdev->rx_addr_match = vs_rx_addr_match(filter, buf[x]);
+		if (rx_vsdev->rx_addr_match)
+			buf[n++] = buf[x];
+	}
+
+	return n;
+}
+
+/*
+ * Returns 1 if the given receiver tty can hold off its sender using
+ * RTS/CTS or XON/XOFF flow control.
+ */
+static int vs_rx_flow_controlled(struct tty_struct *tty)
+{
+	return (C_CRTSCTS(tty) || I_IXOFF(tty)) ? 1 : 0;
+}
+
+/* Runs delivery again after a while, receiver was short of space */
+static void vs_tx_retry(struct vs_dev *tx_vsdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+	if (!tx_vsdev->removed)
+		vs_tx_queue(tx_vsdev, msecs_to_jiffies(VS_TX_RETRY_MS) ? : 1,
+				0);
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+}
+
+/*
+ * Gives number of bytes the writer can queue right now. If receiver
+ * uses flow control, data in transmit ring must also fit into the
+ * receiver's tty buffer, so that the writer sees end to end space.
+ * An RS-485 bus has no flow control. Caller holds tx_lock.
+ */
+static int vs_tx_room_locked(struct vs_dev *tx_vsdev,
+				struct tty_struct *rx_tty)
+{
+	int space;
+	int room = tx_vsdev->fifo_depth - kfifo_len(&tx_vsdev->tx_fifo);
+
+	/* impairment may have duplicated bytes beyond the depth */
+	room = clamp_t(int, room, 0, kfifo_avail(&tx_vsdev->tx_fifo));
+
+	if (rx_tty && !tx_vsdev->bus && vs_rx_flow_controlled(rx_tty)) {
+		space = tty_buffer_space_avail(rx_tty->port) -
+				kfifo_len(&tx_vsdev->tx_fifo);
+		room = min(room, max(space, 0));
+	}
+
+	return room;
+}
+
+/*
+ * Returns 1 if data sent by the given bus member goes out on the bus.
+ * With RS-485 mode enabled (TIOCSRS485) the driver is turned on
+ * whenever there is data to send, otherwise the application controls
+ * driver enable through RTS.
+ */
+static int vs_bus_driver_enabled(struct vs_dev *vsdev)
+{
+	return ((READ_ONCE(vsdev->rs485.flags) & SER_RS485_ENABLED) ||
+		(READ_ONCE(vsdev->mcr_reg) & VS_MCR_RTS)) ? 1 : 0;
+}
+
+/*
+ * Returns 1 if a member other than the given one is still sending
+ * data on the bus. Caller holds bus lock.
+ */
+static int vs_bus_busy(struct vs_bus *bus, struct vs_dev *tx_vsdev)
+{
+	int busy;
+	struct vs_dev *drv = bus->driver;
+
+	if ((drv == NULL) || (drv == tx_vsdev))
+		return 0;
+
+	spin_lock(&drv->tx_lock);
+	busy = !kfifo_is_empty(&drv->tx_fifo);
+	spin_unlock(&drv->tx_lock);
+
+	return busy;
+}
+
+/*
+ * Puts the given character with the given flag (TTY_BREAK/TTY_FRAME)
+ * into every open member of the bus except the sender, as a break or
+ * garbled data on the bus is seen by all the receivers. Caller holds
+ * bus lock.
+ */
+static void vs_bus_signal_locked(struct vs_bus *bus,
+		struct vs_dev *tx_vsdev, unsigned char ch, char flag)
+{
+	int x;
+	struct vs_dev *rx_vsdev;
+	struct tty_struct *tty;
+
+	for (x = 0; x < bus->nmembers; x++) {
+		rx_vsdev = bus->members[x];
+		if (rx_vsdev == tx_vsdev)
+			continue;
+		tty = vs_tty_get(rx_vsdev);
+		if (!tty)
+			continue;
+
+		tty_insert_flip_char(tty->port, ch, flag);
+		tty_flip_buffer_push(tty->port);
+		tty_kref_put(tty);
+		if (flag == TTY_BREAK) {
+			rx_vsdev->icount.brk++;
+			vs_evt_post(rx_vsdev, VS_EVT_BREAK, 0, 0);
+		} else {
+			rx_vsdev->icount.frame++;
+			vs_evt_post(rx_vsdev, VS_EVT_FRAME, 0, 0);
+		}
+	}
+}
+
+/*
+ * Copies a chunk of data seen on the bus into the tty buffer of the
+ * given member as per its uart frame settings. Data sent at a
+ * different baudrate or frame format is not received, nor is data
+ * rejected by the member's address filter. 'addr' tells if the chunk
+ * holds address bytes. Caller holds bus lock.
+ */
+static void vs_bus_rx(struct vs_dev *tx_vsdev, struct vs_dev *rx_vsdev,
+			const unsigned char *buf, int len, int addr)
+{
+	int n, filter, got = 0;
+	unsigned char mask;
+	unsigned char *flipbuf;
+	unsigned char sel[VS_TX_CHUNK];
+	struct tty_struct *tty;
+
+	tty = vs_tty_get(rx_vsdev);
+	if (!tty)
+		return;
+
+	if (vs_frame_mismatch(tx_vsdev, rx_vsdev)) {
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_MISMATCH, len);
+		goto out;
+	}
+
+	/* chunk is shared by all members, filter address bytes in a copy */
+	filter = READ_ONCE(rx_vsdev->rx_filter);
+	if (filter && addr) {
+		memcpy(sel, buf, len);
+		len = vs_rx_filter(rx_vsdev, filter, addr, sel, len);
+		buf = sel;
+	} else if (filter && !rx_vsdev->rx_addr_match) {
+		goto out;
+	}
+
+	mask = vs_data_bits_mask(tty);
+	while (got < len) {
+		n = tty_prepare_flip_string(tty->port, &flipbuf, len - got);
+		if (n <= 0)
+			break;
+		memcpy(flipbuf, buf + got, n);
+		if (mask != 0xFF)
+			vs_mask_data_bits(flipbuf, n, mask);
+		got += n;
+	}
+
+	if (got > 0) {
+		tty_flip_buffer_push(tty->port);
+		trace_ttyvs_flip_push(rx_vsdev->own_index,
+					tx_vsdev->own_index, got);
+		rx_vsdev->icount.rx++;
+		vs_stat_add(rx_vsdev, VS_STAT_RX_BYTES, got);
+	}
+
+	/* receiver overrun, there is no flow control on the bus */
+	if (got < len) {
+		rx_vsdev->icount.buf_overrun += len - got;
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_OVERRUN, len - got);
+		vs_evt_post(rx_vsdev, VS_EVT_BUF_OVERRUN, len - got, 0);
+	}
+
+out:
+	tty_kref_put(tty);
+}
+
+/*
+ * Delivers at most 'max' bytes queued in the transmit ring of the
+ * given bus member to all the other open members in one pass. Returns
+ * number of bytes taken off the transmit ring.
+ *
+ * Data reaches the bus only while the member's driver is enabled. If
+ * collision detection is on and another member is still sending, the
+ * data is lost and all receivers see a framing error. Collisions are
+ * therefore seen mostly in paced mode where data stays on the bus for
+ * its line time.
+ */
+static int vs_bus_deliver(struct vs_dev *tx_vsdev, int max)
+{
+	int x, len, addr;
+	int taken = 0;
+	int dropped = 0;
+	int collided = 0;
+	unsigned long flags;
+	unsigned char chunk[VS_TX_CHUNK];
+	struct vs_bus *bus = tx_vsdev->bus;
+	struct vs_dev *rx_vsdev;
+
+	rcu_read_lock();
+
+	/* other members are not there anymore once this one is deleted */
+	if (rcu_dereference(tx_vsdev->peer) == NULL) {
+		spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+		dropped = kfifo_len(&tx_vsdev->tx_fifo);
+		kfifo_reset_out(&tx_vsdev->tx_fifo);
+		spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+		goto wakeup;
+	}
+
+	spin_lock_irqsave(&bus->lock, flags);
+
+	while (!tx_vsdev->tx_paused && (taken < max)) {
+		spin_lock(&tx_vsdev->tx_lock);
+		len = kfifo_out(&tx_vsdev->tx_fifo, chunk,
+				min_t(int, max - taken, VS_TX_CHUNK));
+		spin_unlock(&tx_vsdev->tx_lock);
+		if (len == 0)
+			break;
+		taken += len;
+
+		if (!vs_bus_driver_enabled(tx_vsdev)) {
+			dropped += len;
+			continue;
+		}
+
+		if (bus->collision_detect && vs_bus_busy(bus, tx_vsdev)) {
+			collided += len;
+			continue;
+		}
+
+		bus->driver = tx_vsdev;
+		addr = vs_tx_addr_bytes(tx_vsdev);
+		for (x = 0; x < bus->nmembers; x++) {
+			rx_vsdev = bus->members[x];
+			if ((rx_vsdev == tx_vsdev) &&
+					!(READ_ONCE(tx_vsdev->rs485.flags) &
+					SER_RS485_RX_DURING_TX))
+				continue;
+			vs_bus_rx(tx_vsdev, rx_vsdev, chunk, len, addr);
+		}
+	}
+
+	if (collided > 0) {
+		WRITE_ONCE(bus->collisions, bus->collisions + 1);
+		vs_bus_signal_locked(bus, tx_vsdev, -7, TTY_FRAME);
+	}
+
+	spin_lock(&tx_vsdev->tx_lock);
+	if ((bus->driver == tx_vsdev) && kfifo_is_empty(&tx_vsdev->tx_fifo))
+		bus->driver = NULL;
+	spin_unlock(&tx_vsdev->tx_lock);
+
+	spin_unlock_irqrestore(&bus->lock, flags);
+
+	if (collided > 0)
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_OVERRUN, collided);
+
+wakeup:
+	if (dropped > 0)
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_NOREADER, dropped);
+
+	rcu_read_unlock();
+
+	vs_tty_wakeup(tx_vsdev);
+
+	return taken;
+}
+
+/*
+ * Forgets held writes whose data has left transmit ring of the device
+ * by delivery or by being discarded. Caller holds tx_lock.
+ */
+static void vs_imp_trim_locked(struct vs_dev *tx_vsdev, struct vs_imp *imp)
+{
+	u32 cut;
+	u32 len = kfifo_len(&tx_vsdev->tx_fifo);
+	struct vs_imp_hold *hold;
+
+	while (imp->held > len) {
+		hold = &imp->hold[VS_IMP_IDX(imp->hold_tail)];
+		cut = min(hold->len, imp->held - len);
+		hold->len -= cut;
+		imp->held -= cut;
+		if (hold->len == 0)
+			imp->hold_tail++;
+	}
+}
+
+/* Draws whether an event of probability 'p' (scaled to 2^32) happens */
+static int vs_imp_hit(struct vs_imp *imp, u32 p)
+{
+	return p && (prandom_u32_state(&imp->rnd) < p);
+}
+
+/*
+ * Queues 'count' bytes into transmit ring of the given device, which
+ * must have room for them, passing them through the line impairment
+ * if one is configured. Bytes duplicated beyond the ring's capacity
+ * are lost. Returns the number of bytes taken from 'buf' which is
+ * 'count' even when some or all of them were dropped. Caller holds
+ * tx_lock and rcu_read_lock().
+ */
+static int vs_tx_in_locked(struct vs_dev *tx_vsdev,
+			const unsigned char *buf, int count)
+{
+	int x, b, n = 0;
+	u32 bits;
+	u64 due;
+	unsigned char ch;
+	struct vs_imp_hold *hold;
+	struct vs_imp *imp = rcu_dereference(tx_vsdev->imp);
+
+	if (imp == NULL)
+		return kfifo_in(&tx_vsdev->tx_fifo, buf, count);
+
+	vs_imp_trim_locked(tx_vsdev, imp);
+
+	for (x = 0; x < count; x++) {
+		ch = buf[x];
+
+		if (vs_imp_hit(imp, imp->p_drop)) {
+			imp->dropped++;
+			continue;
+		}
+
+		if ((imp->burst_left == 0) && vs_imp_hit(imp, imp->p_burst)) {
+			imp->burst_left = imp->burst_len;
+			imp->bursts++;
+		}
+		if (imp->burst_left) {
+			/* every byte of a burst is garbled */
+			bits = prandom_u32_state(&imp->rnd) % 255 + 1;
+			imp->burst_left--;
+			imp->flipped += hweight8(bits);
+			ch ^= bits;
+		}
+
+		/* byte has at least one bit error, pick it, then the rest */
+		if (vs_imp_hit(imp, imp->p_byte)) {
+			bits = 1 << (prandom_u32_state(&imp->rnd) & 7);
+			for (b = 0; b < 8; b++) {
+				if (vs_imp_hit(imp, imp->p_bit))
+					bits |= 1 << b;
+			}
+			imp->flipped += hweight8(bits);
+			ch ^= bits;
+		}
+
+		imp->buf[n++] = ch;
+		if (vs_imp_hit(imp, imp->p_dup)) {
+			imp->buf[n++] = ch;
+			imp->duplicated++;
+		}
+	}
+
+	n = kfifo_in(&tx_vsdev->tx_fifo, imp->buf, n);
+	if ((n == 0) || !(imp->delay_us || imp->jitter_us))
+		return count;
+
+	/* a line keeps order, data never overtakes the previous write */
+	due = ktime_get_ns() + (u64)imp->delay_us * NSEC_PER_USEC;
+	if (imp->jitter_us)
+		due += (u64)(prandom_u32_state(&imp->rnd) %
+				(imp->jitter_us + 1)) * NSEC_PER_USEC;
+	due = max(due, imp->last_due);
+	imp->last_due = due;
+
+	if (imp->hold_head - imp->hold_tail < VS_IMP_HOLDS) {
+		hold = &imp->hold[VS_IMP_IDX(imp->hold_head++)];
+		hold->len = 0;
+	} else {
+		hold = &imp->hold[VS_IMP_IDX(imp->hold_head - 1)];
+	}
+	hold->len += n;
+	hold->due_ns = due;
+	imp->held += n;
+
+	return count;
+}
+
+/*
+ * Limits 'max' to the number of bytes at the front of transmit ring
+ * whose delay on an impaired line has elapsed. If data is still held
+ * delivery is retried when the next write falls due; in paced mode the
+ * running timer takes care of it.
+ */
+static int vs_imp_ready(struct vs_dev *tx_vsdev, int max)
+{
+	u64 now;
+	unsigned long flags;
+	struct vs_imp *imp;
+	struct vs_imp_hold *hold;
+
+	rcu_read_lock();
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+
+	imp = rcu_dereference(tx_vsdev->imp);
+	if (imp == NULL || (imp->held == 0))
+		goto out;
+
+	vs_imp_trim_locked(tx_vsdev, imp);
+	now = ktime_get_ns();
+	while (imp->hold_head != imp->hold_tail) {
+		hold = &imp->hold[VS_IMP_IDX(imp->hold_tail)];
+		if (hold->due_ns > now)
+			break;
+		imp->held -= hold->len;
+		hold->len = 0;
+		imp->hold_tail++;
+	}
+
+	max = min_t(int, max, kfifo_len(&tx_vsdev->tx_fifo) - imp->held);
+	if (imp->held && !tx_vsdev->paced && !tx_vsdev->removed) {
+		hold = &imp->hold[VS_IMP_IDX(imp->hold_tail)];
+		vs_tx_queue(tx_vsdev, nsecs_to_jiffies(hold->due_ns - now) + 1,
+				0);
+	}
+
+out:
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+	rcu_read_unlock();
+	return max;
+}
+
+/*
+ * Delivers at most 'max' bytes queued in the transmit ring of the
+ * given device to the tty buffer of the receiving device. Returns
+ * number of bytes delivered.
+ *
+ * Never more than the space available in the receiver's tty buffer
+ * is delivered. If the receiver uses flow control, the rest stays in
+ * the transmit ring, so the ring fills up and the writer is blocked
+ * until the receiver drains. Without flow control the receiver is
+ * overrun and the rest is discarded as a real UART would do.
+ *
+ * If the receiver has been closed while data was in flight, queued
+ * data is discarded as is the case in real world. The receiver's tty
+ * is referenced while data is handed to it, so it may be closed at any
+ * time. Bytes rejected by receiver's address filter never reach its
+ * tty buffer.
+ */
+static int vs_tx_deliver(struct vs_dev *tx_vsdev, int max)
+{
+	int len, got, room, filter, addr;
+	int stalled = 0;
+	int delivered = 0;
+	int received = 0;
+	int dropped = 0;
+	int lost = 0;
+	int drop_stat = VS_STAT_DROP_NOREADER;
+	unsigned long flags;
+	unsigned char mask;
+	unsigned char *flipbuf;
+	unsigned char chunk[VS_TX_CHUNK];
+	struct tty_struct *tty_to_write;
+	struct vs_dev *rx_vsdev;
+
+	max = vs_imp_ready(tx_vsdev, max);
+	if (max <= 0)
+		return 0;
+
+	if (tx_vsdev->bus)
+		return vs_bus_deliver(tx_vsdev, max);
+
+	rcu_read_lock();
+
+	/* peer of a loop back device is the device itself */
+	rx_vsdev = rcu_dereference(tx_vsdev->peer);
+	tty_to_write = rx_vsdev ? vs_tty_get(rx_vsdev) : NULL;
+
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+
+	if (tty_to_write == NULL) {
+		dropped = kfifo_len(&tx_vsdev->tx_fifo);
+		kfifo_reset_out(&tx_vsdev->tx_fifo);
+		vs_lat_deliver(tx_vsdev, dropped, 0);
+		spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+		goto wakeup;
+	}
+
+	mask = vs_data_bits_mask(tty_to_write);
+	room = tty_buffer_space_avail(tty_to_write->port);
+	filter = READ_ONCE(rx_vsdev->rx_filter);
+	addr = vs_tx_addr_bytes(tx_vsdev);
+
+	while (!tx_vsdev->tx_paused && (delivered < max) &&
+			!kfifo_is_empty(&tx_vsdev->tx_fifo)) {
+		len = min_t(int, max - delivered,
+				kfifo_len(&tx_vsdev->tx_fifo));
+		len = min(len, room);
+		if (filter && (len > 0)) {
+			len = kfifo_out(&tx_vsdev->tx_fifo, chunk,
+					min(len, VS_TX_CHUNK));
+			delivered += len;
+			len = vs_rx_filter(rx_vsdev, filter, addr, chunk, len);
+			if (mask != 0xFF)
+				vs_mask_data_bits(chunk, len, mask);
+			got = tty_insert_flip_string(tty_to_write->port,
+							chunk, len);
+			received += got;
+			room -= got;
+			/*
+			 * Bytes are off the ring already, the rest is lost
+			 * to overrun; remaining data stalls or is dropped
+			 * as in unfiltered delivery below.
+			 */
+			if (got < len) {
+				lost += len - got;
+				room = 0;
+			}
+			continue;
+		}
+		if (len > 0)
+			len = tty_prepare_flip_string(tty_to_write->port,
+						&flipbuf, len);
+		if (len <= 0) {
+			if (vs_rx_flow_controlled(tty_to_write)) {
+				stalled = 1;
+			} else {
+				/* receiver overrun, drop data */
+				dropped = kfifo_len(&tx_vsdev->tx_fifo);
+				drop_stat = VS_STAT_DROP_OVERRUN;
+				kfifo_reset_out(&tx_vsdev->tx_fifo);
+			}
+			break;
+		}
+		len = kfifo_out(&tx_vsdev->tx_fifo, flipbuf, len);
+		if (mask != 0xFF)
+			vs_mask_data_bits(flipbuf, len, mask);
+		delivered += len;
+		received += len;
+		room -= len;
+	}
+
+	vs_lat_deliver(tx_vsdev, delivered, received);
+	if (dropped > 0)
+		vs_lat_deliver(tx_vsdev, dropped, 0);
+
+	/* push belongs to the producer, see vs_rx_put_char() */
+	if (received > 0)
+		tty_flip_buffer_push(tty_to_write->port);
+
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+
+	if (received > 0) {
+		trace_ttyvs_flip_push(rx_vsdev->own_index,
+					tx_vsdev->own_index, received);
+		rx_vsdev->icount.rx++;
+		vs_stat_add(rx_vsdev, VS_STAT_RX_BYTES, received);
+	}
+
+	if (dropped + lost > 0) {
+		rx_vsdev->icount.buf_overrun += dropped + lost;
+		vs_evt_post(rx_vsdev, VS_EVT_BUF_OVERRUN, dropped + lost, 0);
+	}
+	if (lost > 0)
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_OVERRUN, lost);
+
+	/*
+	 * Receiver's ldisc normally unthrottles us once it consumes the
+	 * data, poll in case it never throttled. Timer of paced mode
+	 * keeps running as long as data is pending.
+	 */
+	if (stalled && !tx_vsdev->paced)
+		vs_tx_retry(tx_vsdev);
+
+wakeup:
+	if (dropped > 0)
+		vs_stat_add(tx_vsdev, drop_stat, dropped);
+
+	rcu_read_unlock();
+	tty_kref_put(tty_to_write);
+
+	/* Space is available in transmit ring, wake up blocked writer */
+	vs_tty_wakeup(tx_vsdev);
+
+	return delivered;
+}
+
+/*
+ * Delivers all data queued in the transmit ring. This runs from
+ * workqueue so that the writer does not wait for the receiver.
+ */
+static void vs_tx_work(struct work_struct *work)
+{
+	struct vs_dev *tx_vsdev = container_of(to_delayed_work(work),
+						struct vs_dev, tx_work);
+
+	vs_tx_deliver(tx_vsdev, INT_MAX);
+}
+
+/*
+ * Paced mode timer. Delivers the characters whose line time has
+ * elapsed since the last expiry and re-arms itself as long as data
+ * is pending and transmission is not paused.
+ */
+static enum hrtimer_restart vs_pace_timer_fn(struct hrtimer *timer)
+{
+	u64 due;
+	ktime_t now, next;
+	unsigned long flags;
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	struct vs_dev *tx_vsdev = container_of(timer, struct vs_dev,
+						pace_timer);
+
+	now = hrtimer_cb_get_time(timer);
+	due = div64_u64(ktime_to_ns(ktime_sub(now, tx_vsdev->pace_last)),
+			tx_vsdev->char_time_ns);
+	if (due > 0) {
+		tx_vsdev->pace_last = ktime_add_ns(tx_vsdev->pace_last,
+					due * tx_vsdev->char_time_ns);
+		vs_tx_deliver(tx_vsdev, min_t(u64, due, VS_TX_RING_SIZE));
+	}
+
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+	if (tx_vsdev->tx_paused || kfifo_is_empty(&tx_vsdev->tx_fifo)) {
+		tx_vsdev->pace_running = 0;
+		ret = HRTIMER_NORESTART;
+	}
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+
+	if (ret == HRTIMER_RESTART) {
+		next = ktime_add_ns(tx_vsdev->pace_last,
+					tx_vsdev->char_time_ns);
+		if (ktime_before(next, ktime_add_ns(now, VS_PACE_MIN_NS)))
+			next = ktime_add_ns(now, VS_PACE_MIN_NS);
+		hrtimer_set_expires(timer, next);
+	}
+
+	return ret;
+}
+
+/*
+ * Starts delivery of the data queued in the transmit ring. In paced
+ * mode the first character reaches the receiver after one character
+ * time, otherwise data is delivered right away from workqueue.
+ * Nothing is started once the device has been deleted.
+ */
+static void vs_tx_kick(struct vs_dev *tx_vsdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+	if (tx_vsdev->removed) {
+		/* vs_tx_stop() has been called */
+	} else if (!tx_vsdev->paced) {
+		vs_tx_queue(tx_vsdev, 0, 0);
+	} else if (!tx_vsdev->pace_running) {
+		tx_vsdev->pace_running = 1;
+		tx_vsdev->pace_last = ktime_get();
+		hrtimer_start(&tx_vsdev->pace_timer,
+				ns_to_ktime(tx_vsdev->char_time_ns),
+				HRTIMER_MODE_REL_SOFT);
+	}
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+}
+
+/*
+ * Same as vs_tx_kick() but also cuts short a pending retry, used when
+ * the receiver signals that it has space again.
+ */
+static void vs_tx_resume(struct vs_dev *tx_vsdev)
+{
+	unsigned long flags;
+
+	if (tx_vsdev->paced) {
+		vs_tx_kick(tx_vsdev);
+		return;
+	}
+
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+	if (!tx_vsdev->removed)
+		vs_tx_queue(tx_vsdev, 0, 1);
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+}
+
+/*
+ * Stops delivery of data for good as the device is being deleted,
+ * pending data stays in the transmit ring.
+ */
+static void vs_tx_stop(struct vs_dev *vsdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vsdev->tx_lock, flags);
+	vsdev->removed = 1;
+	spin_unlock_irqrestore(&vsdev->tx_lock, flags);
+
+	hrtimer_cancel(&vsdev->pace_timer);
+	cancel_delayed_work_sync(&vsdev->tx_work);
+}
+
+/*
+ * Time taken to shift one character out on the line for the given
+ * baudrate and uart frame settings; one start bit, data bits, parity
+ * bit if enabled and one or two stop bits.
+ */
+static u64 vs_char_time_ns(int baud, int uart_frame)
+{
+	int bits = 1;
+
+	if (uart_frame & VS_DATA_5)
+		bits += 5;
+	else if (uart_frame & VS_DATA_6)
+		bits += 6;
+	else if (uart_frame & VS_DATA_7)
+		bits += 7;
+	else
+		bits += 8;
+
+	if (uart_frame & (VS_PARITY_ODD | VS_PARITY_EVEN |
+				VS_PARITY_MARK | VS_PARITY_SPACE))
+		bits += 1;
+
+	if (uart_frame & VS_STOP_2)
+		bits += 2;
+	else
+		bits += 1;
+
+	if (baud <= 0)
+		baud = 9600;
+
+	return div_u64((u64)bits * NSEC_PER_SEC, baud);
+}
+
+/*
+ * Invoked when write() system call is invoked on device node.
+ * The data is queued into the transmit ring of this device and
+ * delivered to the receiver tty device asynchronously, where every
+ * byte is constructed as per the receiver's uart frame settings.
+ *
+ * Returns number of bytes queued which may be less than count if
+ * the transmit ring, or with flow control the receiver's tty buffer,
+ * does not have enough space.
+ */
+static int vs_write(struct tty_struct *tty,
+			const unsigned char *buf, int count)
+{
+	int ret, queued;
+	unsigned long flags;
+	struct tty_struct *tty_to_write = NULL;
+	struct vs_dev *rx_vsdev = NULL;
+	struct vs_dev *tx_vsdev = tty->driver_data;
+
+	if (tx_vsdev->tx_paused || !tty || tty->stopped
+			|| (count < 1) || !buf || tty->hw_stopped) {
+		trace_ttyvs_write(tx_vsdev->own_index, count, 0, "stopped");
+		return 0;
+	}
+
+	if (tx_vsdev->is_break_on == 1) {
+		trace_ttyvs_write(tx_vsdev->own_index, count, -EIO, "break");
+		return -EIO;
+	}
+
+	vs_stat_add(tx_vsdev, VS_STAT_WRITE_CALLS, 1);
+
+	if (tx_vsdev->faulty_cable == 1) {
+		trace_ttyvs_write(tx_vsdev->own_index, count, count, "faulty");
+		vs_tap_data(tx_vsdev, buf, count);
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, count);
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_FAULTY, count);
+		return count;
+	}
+
+	rcu_read_lock();
+	rx_vsdev = rcu_dereference(tx_vsdev->peer);
+	if (rx_vsdev == NULL) {
+		/* device is being deleted */
+		tty_to_write = NULL;
+	} else if (tty->index != tx_vsdev->peer_index) {
+		/* Null modem */
+		tty_to_write = vs_tty_get(rx_vsdev);
+
+		if (vs_frame_mismatch(tx_vsdev, rx_vsdev)) {
+			rcu_read_unlock();
+			tty_kref_put(tty_to_write);
+			/*
+			 * Emulate data sent but not received due to
+			 * mismatched baudrate/framing.
+			 */
+			trace_ttyvs_write(tx_vsdev->own_index, count, count,
+						"mismatch");
+			vs_tap_data(tx_vsdev, buf, count);
+			tx_vsdev->icount.tx++;
+			vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, count);
+			vs_stat_add(tx_vsdev, VS_STAT_DROP_MISMATCH, count);
+			return count;
+		}
+	} else {
+		/* Loop back, or RS-485 bus delivering to all its members */
+		tty_to_write = tty_kref_get(tty);
+	}
+
+	if (tty_to_write) {
+		spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+		ret = vs_tx_room_locked(tx_vsdev, tty_to_write);
+		queued = kfifo_len(&tx_vsdev->tx_fifo);
+		ret = vs_tx_in_locked(tx_vsdev, buf, min(count, ret));
+		if (kfifo_len(&tx_vsdev->tx_fifo) > queued)
+			vs_lat_write(tx_vsdev, queued);
+		/* bytes staged by put_char go out along with this data */
+		tx_vsdev->put_staged = 0;
+		spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+
+		trace_ttyvs_write(tx_vsdev->own_index, count, ret,
+					(ret > 0) ? "queued" : "full");
+		if (ret > 0) {
+			vs_tap_data(tx_vsdev, buf, ret);
+			vs_tx_kick(tx_vsdev);
+			tx_vsdev->icount.tx++;
+			vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, ret);
+		} else {
+			/* receiver is full, wake up writer once it drains */
+			vs_tx_retry(tx_vsdev);
+		}
+	} else {
+		/*
+		 * Other end is still not opened, emulate transmission from
+		 * local end but don't make other end receive it as is the
+		 * case in real world.
+		 */
+		trace_ttyvs_write(tx_vsdev->own_index, count, count,
+					"noreader");
+		vs_tap_data(tx_vsdev, buf, count);
+		tx_vsdev->icount.tx++;
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, count);
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_NOREADER, count);
+		ret = count;
+	}
+
+	rcu_read_unlock();
+	tty_kref_put(tty_to_write);
+	return ret;
+}
+
+/*
+ * Transmits a high priority character (XON/XOFF) bypassing the data
+ * already queued in transmit ring, as a real UART sends x-char ahead
+ * of its transmit FIFO.
+ */
+static int vs_xmit_char_now(struct tty_struct *tty, unsigned char ch)
+{
+	int ret, filter;
+	unsigned long flags;
+	unsigned char data;
+	struct tty_struct *tty_to_write;
+	struct vs_dev *rx_vsdev;
+	struct vs_dev *tx_vsdev = tty->driver_data;
+
+	if (tx_vsdev->tx_paused || !tty || tty->stopped || tty->hw_stopped)
+		return 0;
+
+	if (tx_vsdev->is_break_on == 1)
+		return -EIO;
+
+	if (tx_vsdev->faulty_cable == 1) {
+		vs_tap_data(tx_vsdev, &ch, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_FAULTY, 1);
+		return 1;
+	}
+
+	/* Shared bus has no priority path, goes out after queued data */
+	if (tx_vsdev->bus) {
+		spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+		ret = kfifo_put(&tx_vsdev->tx_fifo, ch);
+		spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+		if (ret) {
+			vs_tx_kick(tx_vsdev);
+			tx_vsdev->icount.tx++;
+			vs_tap_data(tx_vsdev, &ch, 1);
+			vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+		}
+		return ret;
+	}
+
+	rcu_read_lock();
+	rx_vsdev = rcu_dereference(tx_vsdev->peer);
+	if (rx_vsdev == NULL) {
+		tty_to_write = NULL;
+	} else if (tty->index != tx_vsdev->peer_index) {
+		tty_to_write = vs_tty_get(rx_vsdev);
+		if (vs_frame_mismatch(tx_vsdev, rx_vsdev)) {
+			rcu_read_unlock();
+			tty_kref_put(tty_to_write);
+			tx_vsdev->icount.tx++;
+			vs_tap_data(tx_vsdev, &ch, 1);
+			vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+			vs_stat_add(tx_vsdev, VS_STAT_DROP_MISMATCH, 1);
+			return 1;
+		}
+	} else {
+		tty_to_write = tty_kref_get(tty);
+	}
+
+	if (tty_to_write != NULL) {
+		data = ch & vs_data_bits_mask(tty_to_write);
+		filter = READ_ONCE(rx_vsdev->rx_filter);
+		if (!filter || vs_rx_filter(rx_vsdev, filter,
+				vs_tx_addr_bytes(tx_vsdev), &data, 1)) {
+			vs_rx_put_char(rx_vsdev, tty_to_write, data,
+					TTY_NORMAL);
+			trace_ttyvs_flip_push(rx_vsdev->own_index,
+						tx_vsdev->own_index, 1);
+			rx_vsdev->icount.rx++;
+			vs_stat_add(rx_vsdev, VS_STAT_RX_BYTES, 1);
+		}
+		tx_vsdev->icount.tx++;
+		vs_tap_data(tx_vsdev, &ch, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+	} else {
+		tx_vsdev->icount.tx++;
+		vs_tap_data(tx_vsdev, &ch, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_NOREADER, 1);
+	}
+
+	rcu_read_unlock();
+	tty_kref_put(tty_to_write);
+	return 1;
+}
+
+/*
+ * Invoked by tty core to transmit single data byte. The byte is
+ * staged in transmit ring without starting delivery; tty core calls
+ * flush_chars after a run of put_char. Delivery is also started if
+ * VS_PUTCHAR_BATCH bytes have been staged meanwhile.
+ */
+static int vs_put_char(struct tty_struct *tty, unsigned char ch)
+{
+	int ret, queued, kick = 0;
+	unsigned long flags;
+	struct tty_struct *tty_to_write;
+	struct vs_dev *rx_vsdev;
+	struct vs_dev *tx_vsdev = tty->driver_data;
+
+	if (tx_vsdev->tx_paused || !tty || tty->stopped || tty->hw_stopped) {
+		trace_ttyvs_put_char(tx_vsdev->own_index, 1, 0, "stopped");
+		return 0;
+	}
+
+	if (tx_vsdev->is_break_on == 1) {
+		trace_ttyvs_put_char(tx_vsdev->own_index, 1, -EIO, "break");
+		return -EIO;
+	}
+
+	if (tx_vsdev->faulty_cable == 1) {
+		trace_ttyvs_put_char(tx_vsdev->own_index, 1, 1, "faulty");
+		vs_tap_data(tx_vsdev, &ch, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_FAULTY, 1);
+		return 1;
+	}
+
+	rcu_read_lock();
+	rx_vsdev = rcu_dereference(tx_vsdev->peer);
+	if (rx_vsdev == NULL) {
+		tty_to_write = NULL;
+	} else if (tty->index != tx_vsdev->peer_index) {
+		tty_to_write = vs_tty_get(rx_vsdev);
+		if (vs_frame_mismatch(tx_vsdev, rx_vsdev)) {
+			rcu_read_unlock();
+			tty_kref_put(tty_to_write);
+			trace_ttyvs_put_char(tx_vsdev->own_index, 1, 1,
+						"mismatch");
+			tx_vsdev->icount.tx++;
+			vs_tap_data(tx_vsdev, &ch, 1);
+			vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+			vs_stat_add(tx_vsdev, VS_STAT_DROP_MISMATCH, 1);
+			return 1;
+		}
+	} else {
+		tty_to_write = tty_kref_get(tty);
+	}
+	rcu_read_unlock();
+
+	if (tty_to_write == NULL) {
+		trace_ttyvs_put_char(tx_vsdev->own_index, 1, 1, "noreader");
+		tx_vsdev->icount.tx++;
+		vs_tap_data(tx_vsdev, &ch, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_DROP_NOREADER, 1);
+		return 1;
+	}
+
+	rcu_read_lock();
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+	queued = kfifo_len(&tx_vsdev->tx_fifo);
+	if (vs_tx_room_locked(tx_vsdev, tty_to_write) == 0)
+		ret = 0;
+	else
+		ret = vs_tx_in_locked(tx_vsdev, &ch, 1);
+	/* a run of put_char is timed as one write from its first byte */
+	if ((tx_vsdev->put_staged == 0) &&
+			(kfifo_len(&tx_vsdev->tx_fifo) > queued))
+		vs_lat_write(tx_vsdev, queued);
+	if (ret && (++tx_vsdev->put_staged >= VS_PUTCHAR_BATCH)) {
+		tx_vsdev->put_staged = 0;
+		kick = 1;
+	}
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+	rcu_read_unlock();
+	tty_kref_put(tty_to_write);
+
+	trace_ttyvs_put_char(tx_vsdev->own_index, 1, ret,
+				ret ? "queued" : "full");
+
+	if (kick)
+		vs_tx_kick(tx_vsdev);
+
+	if (ret) {
+		tx_vsdev->icount.tx++;
+		vs_tap_data(tx_vsdev, &ch, 1);
+		vs_stat_add(tx_vsdev, VS_STAT_TX_BYTES, 1);
+	} else {
+		/* receiver is full, wake up writer once it drains */
+		vs_tx_retry(tx_vsdev);
+	}
+
+	return ret;
+}
+
+/*
+ * Flush the data out of serial port. Starts delivery of the bytes
+ * staged by put_char to the receiver end in one batch.
+ */
+static void vs_flush_chars(struct tty_struct *tty)
+{
+	int staged;
+	unsigned long flags;
+	struct vs_dev *tx_vsdev = tty->driver_data;
+
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+	staged = tx_vsdev->put_staged;
+	tx_vsdev->put_staged = 0;
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+
+	if (staged)
+		vs_tx_kick(tx_vsdev);
+}
+
+/*
+ * Discard the internal output buffer for this tty device. Typically
+ * it may be called when executing IOCTL TCOFLUSH, closing the
+ * serial port, when break is received in input stream (flushing
+ * is configured) or when hangup occurs.
+ *
+ * On the other hand, when TCIFLUSH IOCTL is invoked, tty flip buffer
+ * and line discipline queue gets emptied without involvement of tty
+ * driver. The driver is generally expected not to keep data but send
+ * it to tty layer as soon as possible when it receives data.
+ *
+ * Data still waiting in the transmit ring is discarded here.
+ *
+ * @tty: tty device whose buffer should be flushed.
+ */
+static void vs_flush_buffer(struct tty_struct *tty)
+{
+	unsigned long flags;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	spin_lock_irqsave(&local_vsdev->tx_lock, flags);
+	vs_lat_deliver(local_vsdev, kfifo_len(&local_vsdev->tx_fifo), 0);
+	kfifo_reset_out(&local_vsdev->tx_fifo);
+	spin_unlock_irqrestore(&local_vsdev->tx_lock, flags);
+
+	tty_wakeup(tty);
+}
+
+/* Provides information as a repsonse to TIOCGSERIAL IOCTL */
+static int vs_get_serinfo(struct tty_struct *tty, unsigned long arg)
+{
+	int ret;
+	struct serial_struct info;
+	struct vs_dev *local_vsdev = tty->driver_data;
+	struct serial_struct serial = local_vsdev->serial;
+
+	if (!arg)
+		return -EFAULT;
+
+	memset(&info, 0, sizeof(info));
+
+	info.type		    = PORT_UNKNOWN;
+	info.line		    = serial.line;
+	info.port		    = tty->index;
+	info.irq			= 0;
+	info.flags		    = tty->port->flags;
+	info.xmit_fifo_size = READ_ONCE(local_vsdev->fifo_depth);
+	info.baud_base	    = 0;
+	info.close_delay	= tty->port->close_delay;
+	info.closing_wait   = tty->port->closing_wait;
+	info.custom_divisor = 0;
+	info.hub6		    = 0;
+	info.io_type		= SERIAL_IO_MEM;
+
+	ret = copy_to_user((void __user *)arg, &info,
+				sizeof(struct serial_struct));
+
+	return ret ? -EFAULT : 0;
+}
+
+/*
+ * Sets depth of the emulated transmit FIFO from xmit_fifo_size, 0 gives
+ * the default. Other fields have no meaning for a virtual device and
+ * are ignored.
+ * $ setserial /dev/ttyVS0 xmit_fifo_size 16 (needs CAP_SYS_ADMIN)
+ */
+static int vs_set_serinfo(struct tty_struct *tty, unsigned long arg)
+{
+	struct serial_struct info;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	if (copy_from_user(&info, (void __user *)arg, sizeof(info)))
+		return -EFAULT;
+
+	if (info.xmit_fifo_size == READ_ONCE(local_vsdev->fifo_depth))
+		return 0;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	return vs_set_fifo_depth(local_vsdev, info.xmit_fifo_size);
+}
+
+/*
+ * Returns number of bytes that can be queued to this device now, never
+ * more than space left in its emulated transmit FIFO.
+ */
+static int vs_write_room(struct tty_struct *tty)
+{
+	int room;
+	unsigned long flags;
+	struct tty_struct *rx_tty = NULL;
+	struct vs_dev *rx_vsdev;
+	struct vs_dev *tx_vsdev = tty->driver_data;
+
+	if (tx_vsdev->tx_paused || !tty ||
+			tty->stopped || tty->hw_stopped)
+		return 0;
+
+	rcu_read_lock();
+	rx_vsdev = rcu_dereference(tx_vsdev->peer);
+	if (rx_vsdev && (tty->index != tx_vsdev->peer_index))
+		rx_tty = vs_tty_get(rx_vsdev);
+	else
+		rx_tty = tty_kref_get(tty);
+	rcu_read_unlock();
+
+	spin_lock_irqsave(&tx_vsdev->tx_lock, flags);
+	room = vs_tx_room_locked(tx_vsdev, rx_tty);
+	spin_unlock_irqrestore(&tx_vsdev->tx_lock, flags);
+	tty_kref_put(rx_tty);
+
+	if (room == 0)
+		vs_tx_retry(tx_vsdev);
+
+	return room;
+}
+
+/*
+ * Invoked when serial terminal settings are chaged. The old_termios
+ * contains currently active settings and tty->termios contains new
+ * settings to be applied.
+ */
+static void vs_set_termios(struct tty_struct *tty,
+				struct ktermios *old_termios)
+{
+	unsigned long flags;
+	u32 baud;
+	int uart_frame_settings;
+	unsigned int mask = TIOCM_DTR;
+	struct vs_dev *remote_vsdev;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	rcu_read_lock();
+	remote_vsdev = vs_lock_pair(local_vsdev, &flags);
+
+	/*
+	 * Typically B0 is used to terminate the connection.
+	 * Drop RTS and DTR.
+	 */
+	if ((tty->termios.c_cflag & CBAUD) == B0) {
+		vs_update_modem_lines(tty, 0, TIOCM_DTR | TIOCM_RTS);
+		goto unlock;
+	}
+
+	/* If coming out of B0, raise DTR and RTS. This might get
+	 * overridden in next steps. Applications like minicom when
+	 * opens a serial port, may drop speed to B0 and then back
+	 * to normal speed again.
+	 */
+	if (!old_termios || (old_termios->c_cflag & CBAUD) == B0) {
+		if (!(tty->termios.c_cflag & CRTSCTS) ||
+				!test_bit(TTY_THROTTLED, &tty->flags)) {
+			mask |= TIOCM_RTS;
+			vs_update_modem_lines(tty, mask, 0);
+		}
+	}
+
+	baud = tty_get_baud_rate(tty);
+	if (!baud)
+		baud = 9600;
+
+	tty_encode_baud_rate(tty, baud, baud);
+
+	local_vsdev->baud = baud;
+
+	uart_frame_settings = 0;
+	if (tty->termios.c_cflag & CRTSCTS) {
+		uart_frame_settings |= VS_CRTSCTS;
+	} else if ((tty->termios.c_iflag & IXON) ||
+					(tty->termios.c_iflag & IXOFF)) {
+		uart_frame_settings |= VS_XON;
+	} else {
+		uart_frame_settings |= VS_NONE;
+	}
+
+	switch (tty->termios.c_cflag & CSIZE) {
+	case CS8:
+		uart_frame_settings |= VS_DATA_8;
+		break;
+	case CS7:
+		uart_frame_settings |= VS_DATA_7;
+		break;
+	case CS6:
+		uart_frame_settings |= VS_DATA_6;
+		break;
+	case CS5:
+		uart_frame_settings |= VS_DATA_5;
+		break;
+	default:
+		uart_frame_settings |= VS_DATA_8;
+	}
+
+	if (tty->termios.c_cflag & CSTOPB)
+		uart_frame_settings |= VS_STOP_2;
+	else
+		uart_frame_settings |= VS_STOP_1;
+
+	if (tty->termios.c_cflag & PARENB) {
+		if (tty->termios.c_cflag & CMSPAR) {
+			if (tty->termios.c_cflag & PARODD)
+				uart_frame_settings |= VS_PARITY_MARK;
+			else
+				uart_frame_settings |= VS_PARITY_SPACE;
+		} else {
+			if (tty->termios.c_cflag & PARODD)
+				uart_frame_settings |= VS_PARITY_ODD;
+			else
+				uart_frame_settings |= VS_PARITY_EVEN;
+		}
+	} else {
+		uart_frame_settings |= VS_PARITY_NONE;
+	}
+
+	local_vsdev->uart_frame = uart_frame_settings;
+	local_vsdev->char_time_ns = vs_char_time_ns(baud, uart_frame_settings);
+
+unlock:
+	vs_unlock_pair(local_vsdev, remote_vsdev, flags);
+	rcu_read_unlock();
+}
+
+/*
+ * Returns the number of bytes in device's output queue. This is
+ * invoked when TIOCOUTQ IOCTL is executed or by tty core as and
+ * when required. These are the bytes written by application but
+ * not yet delivered to the receiver end.
+ */
+static int vs_chars_in_buffer(struct tty_struct *tty)
+{
+	int len;
+	unsigned long flags;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	spin_lock_irqsave(&local_vsdev->tx_lock, flags);
+	len = kfifo_len(&local_vsdev->tx_fifo);
+	spin_unlock_irqrestore(&local_vsdev->tx_lock, flags);
+
+	return len;
+}
+
+/*
+ * Based on the number od interrupts check if any of the signal
+ * line has changed.
+ */
+static int vs_check_msr_delta(struct tty_struct *tty,
+		struct vs_dev *local_vsdev, unsigned long mask,
+		struct async_icount *prev)
+{
+	unsigned long flags;
+	int delta;
+	struct async_icount now;
+
+	/*
+	 * Use tty-port initialised flag to detect all hangups
+	 * including the disconnect(device destroy) event.
+	 */
+	if (!tty_port_initialized(tty->port))
+		return 1;
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	now = local_vsdev->icount;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+	delta = ((mask & TIOCM_RNG && prev->rng != now.rng) ||
+			 (mask & TIOCM_DSR && prev->dsr != now.dsr) ||
+			 (mask & TIOCM_CAR && prev->dcd != now.dcd) ||
+			 (mask & TIOCM_CTS && prev->cts != now.cts));
+
+	*prev = now;
+	return delta;
+}
+
+/* Sleeps until at-least one of the modem lines changes */
+static int vs_wait_change(struct tty_struct *tty, unsigned long mask)
+{
+	unsigned long flags;
+	int ret;
+	struct async_icount prev;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+
+	local_vsdev->waiting_msr_chg = 1;
+	prev = local_vsdev->icount;
+
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+
+	ret = wait_event_interruptible(tty->port->delta_msr_wait,
+			vs_check_msr_delta(tty, local_vsdev, mask, &prev));
+
+	local_vsdev->waiting_msr_chg = 0;
+
+	if (!ret && !tty_port_initialized(tty->port))
+		ret = -EIO;
+
+	return ret;
+}
+
+/* Provides RS-485 settings of a bus member for TIOCGRS485 IOCTL */
+static int vs_get_rs485(struct tty_struct *tty,
+				struct serial_rs485 __user *argp)
+{
+	unsigned long flags;
+	struct serial_rs485 rs485;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	if (!local_vsdev->bus)
+		return -ENOIOCTLCMD;
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	rs485 = local_vsdev->rs485;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+
+	if (copy_to_user(argp, &rs485, sizeof(rs485)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Applies RS-485 settings of a bus member given with TIOCSRS485 IOCTL.
+ * SER_RS485_ENABLED turns the driver on automatically while sending,
+ * SER_RS485_RX_DURING_TX makes the member receive its own data. RTS
+ * delays are not emulated, settings in effect are returned back.
+ */
+static int vs_set_rs485(struct tty_struct *tty,
+				struct serial_rs485 __user *argp)
+{
+	unsigned long flags;
+	struct serial_rs485 rs485;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	if (!local_vsdev->bus)
+		return -ENOIOCTLCMD;
+
+	if (copy_from_user(&rs485, argp, sizeof(rs485)))
+		return -EFAULT;
+
+	rs485.flags &= SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND |
+			SER_RS485_RTS_AFTER_SEND | SER_RS485_RX_DURING_TX;
+	rs485.delay_rts_before_send = 0;
+	rs485.delay_rts_after_send = 0;
+	memset(rs485.padding, 0, sizeof(rs485.padding));
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	local_vsdev->rs485 = rs485;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+
+	if (copy_to_user(argp, &rs485, sizeof(rs485)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Execute IOCTL commands */
+static int vs_ioctl(struct tty_struct *tty,
+				unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case TIOCGSERIAL:
+		return vs_get_serinfo(tty, arg);
+	case TIOCSSERIAL:
+		return vs_set_serinfo(tty, arg);
+	case TIOCMIWAIT:
+		return vs_wait_change(tty, arg);
+	case TIOCGRS485:
+		return vs_get_rs485(tty, (struct serial_rs485 __user *)arg);
+	case TIOCSRS485:
+		return vs_set_rs485(tty, (struct serial_rs485 __user *)arg);
+	case TCFLSH:
+		/* tty core has flushed the receive buffer, ldisc does rest */
+		if ((arg == TCIFLUSH) || (arg == TCIOFLUSH))
+			vs_lat_rx_reset(tty->driver_data);
+		break;
+	}
+
+	return -ENOIOCTLCMD;
+}
+
+/*
+ * Invoked when tty layer's input buffers are about to get full.
+ *
+ * When using RTS/CTS flow control, when RTS line is de-asserted,
+ * interrupt will be generated in hardware. The interrupt handler
+ * will raise a flag to indicate transmission should be stopped.
+ * This is achieved in this driver through tx_paused variable.
+ */
+static void vs_throttle(struct tty_struct *tty)
+{
+	unsigned long flags;
+	struct vs_dev *remote_vsdev;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	trace_ttyvs_throttle(local_vsdev->own_index);
+	vs_stat_add(local_vsdev, VS_STAT_THROTTLE, 1);
+
+	/* Two wire bus has no handshake lines, senders are not held off */
+	if (local_vsdev->bus)
+		return;
+
+	if (tty->termios.c_cflag & CRTSCTS) {
+		rcu_read_lock();
+		remote_vsdev = vs_lock_pair(local_vsdev, &flags);
+		if (remote_vsdev)
+			WRITE_ONCE(remote_vsdev->tx_paused, 1);
+		vs_update_modem_lines(tty, 0, TIOCM_RTS);
+		vs_unlock_pair(local_vsdev, remote_vsdev, flags);
+		rcu_read_unlock();
+	} else if ((tty->termios.c_iflag & IXON) ||
+				(tty->termios.c_iflag & IXOFF)) {
+		vs_xmit_char_now(tty, STOP_CHAR(tty));
+	} else {
+		/* do nothing */
+	}
+}
+
+/*
+ * Invoked when the tty layer's input buffers have been emptied out,
+ * and it now can accept more data. Throttle/Unthrottle is about
+ * notifying remote end to start or stop data as per the currently
  * active flow control. On the other hand, Start/Stop is about what
  * action to take at local end itself to start or stop data as per
  * the currently active flow control.
  */
-static void vs_unthrottle(struct tty_struct *tty)
+static void vs_unthrottle(struct tty_struct *tty)
+{
+	unsigned long flags;
+	struct vs_dev *remote_vsdev;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	trace_ttyvs_unthrottle(local_vsdev->own_index);
+
+	if (local_vsdev->bus)
+		return;
+
+	rcu_read_lock();
+	remote_vsdev = rcu_dereference(local_vsdev->peer);
+
+	if (tty->termios.c_cflag & CRTSCTS) {
+		/* hardware (RTS/CTS) flow control */
+		remote_vsdev = vs_lock_pair(local_vsdev, &flags);
+		if (remote_vsdev)
+			WRITE_ONCE(remote_vsdev->tx_paused, 0);
+		vs_update_modem_lines(tty, TIOCM_RTS, 0);
+		vs_unlock_pair(local_vsdev, remote_vsdev, flags);
+	} else if ((tty->termios.c_iflag & IXON) ||
+				(tty->termios.c_iflag & IXOFF)) {
+		/* software flow control */
+		vs_xmit_char_now(tty, START_CHAR(tty));
+	} else {
+		/* do nothing */
+	}
+
+	/*
+	 * Our tty buffer has space again, resume delivery of data held
+	 * in remote's transmit ring right away. Remote's writer is woken
+	 * up once data moves.
+	 */
+	if (remote_vsdev)
+		vs_tx_resume(remote_vsdev);
+
+	rcu_read_unlock();
+}
+
+/*
+ * Invoked when this driver should stop sending data for example
+ * as a part of flow control mechanism.
+ *
+ * Line discipline n_tty calls this function if this device uses
+ * software flow control and an XOFF character is received from
+ * other end.
+ */
+static void vs_stop(struct tty_struct *tty)
+{
+	unsigned long flags;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	trace_ttyvs_stop(local_vsdev->own_index);
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	local_vsdev->tx_paused = 1;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+}
+
+/*
+ * Invoked when this driver should start sending data for example
+ * as a part of flow control mechanism.
+ *
+ * Line discipline n_tty calls this function if this device uses
+ * software flow control and an XON character is received from
+ * other end.
+ */
+static void vs_start(struct tty_struct *tty)
+{
+	unsigned long flags;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	trace_ttyvs_start(local_vsdev->own_index);
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	local_vsdev->tx_paused = 0;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+
+	vs_tx_kick(local_vsdev);
+
+	if (tty && tty->port)
+		tty_port_tty_wakeup(tty->port);
+}
+
+/*
+ * Obtain the modem status bits for the given tty device. Invoked
+ * typically when TIOCMGET IOCTL is executed on the given
+ * tty device.
+ */
+static int vs_tiocmget(struct tty_struct *tty)
+{
+	unsigned long flags;
+	int status, msr_reg, mcr_reg;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	mcr_reg = local_vsdev->mcr_reg;
+	msr_reg = local_vsdev->msr_reg;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+
+	status = ((mcr_reg & VS_MCR_DTR)  ? TIOCM_DTR  : 0) |
+			 ((mcr_reg & VS_MCR_RTS)  ? TIOCM_RTS  : 0) |
+			 ((mcr_reg & VS_MCR_LOOP) ? TIOCM_LOOP : 0) |
+			 ((msr_reg & VS_MSR_DCD)  ? TIOCM_CAR  : 0) |
+			 ((msr_reg & VS_MSR_RI)   ? TIOCM_RI   : 0) |
+			 ((msr_reg & VS_MSR_CTS)  ? TIOCM_CTS  : 0) |
+			 ((msr_reg & VS_MSR_DSR)  ? TIOCM_DSR  : 0);
+
+	return status;
+}
+
+/*
+ * Set the modem status bits. Invoked typically when TIOCMSET IOCTL
+ * is executed on the given tty device.
+ */
+static int vs_tiocmset(struct tty_struct *tty,
+				unsigned int set, unsigned int clear)
+{
+	return vs_change_modem_lines(tty, set, clear);
+}
+
+/*
+ * Unconditionally assert/de-assert break condition of the given
+ * tty device.
+ */
+static int vs_break_ctl(struct tty_struct *tty, int break_state)
+{
+	unsigned long flags;
+	struct tty_struct *tty_to_write;
+	struct vs_dev *brk_rx_vsdev;
+	struct vs_dev *brk_tx_vsdev = tty->driver_data;
+
+	rcu_read_lock();
+
+	brk_rx_vsdev = rcu_dereference(brk_tx_vsdev->peer);
+	if ((brk_rx_vsdev == NULL) || brk_tx_vsdev->bus)
+		tty_to_write = NULL;
+	else
+		tty_to_write = vs_tty_get(brk_rx_vsdev);
+
+	spin_lock_irqsave(&brk_tx_vsdev->lock, flags);
+
+	if (break_state != 0) {
+		if (brk_tx_vsdev->is_break_on == 1)
+			goto unlock;
+
+		brk_tx_vsdev->is_break_on = 1;
+		trace_ttyvs_break(brk_tx_vsdev->own_index, 1);
+		vs_tap_event(brk_tx_vsdev, VS_TAP_BREAK, 1);
+		if (tty_to_write != NULL) {
+			vs_rx_put_char(brk_rx_vsdev, tty_to_write, 0,
+					TTY_BREAK);
+			brk_rx_vsdev->icount.brk++;
+			vs_evt_post(brk_rx_vsdev, VS_EVT_BREAK, 0, 0);
+		} else if (brk_rx_vsdev && brk_tx_vsdev->bus) {
+			/* every member of the bus sees the break */
+			spin_lock(&brk_tx_vsdev->bus->lock);
+			vs_bus_signal_locked(brk_tx_vsdev->bus, brk_tx_vsdev,
+						0, TTY_BREAK);
+			spin_unlock(&brk_tx_vsdev->bus->lock);
+		}
+	} else {
+		brk_tx_vsdev->is_break_on = 0;
+		trace_ttyvs_break(brk_tx_vsdev->own_index, 0);
+		vs_tap_event(brk_tx_vsdev, VS_TAP_BREAK, 0);
+	}
+
+unlock:
+	spin_unlock_irqrestore(&brk_tx_vsdev->lock, flags);
+	rcu_read_unlock();
+	tty_kref_put(tty_to_write);
+	return 0;
+}
+
+/*
+ * Invoked by tty layer to inform this driver that it should hangup
+ * the tty device (lower modem control lines after last process
+ * using tty devices closes the device or exited).
+ *
+ * Drop DTR/RTS if HUPCL is set. This causes any attached modem to
+ * hang up the line.
+ *
+ * On the receiving end, if CLOCAL bit is set, DCD will be ignored
+ * otherwise SIGHUP may be generated to indicate a line disconnect
+ * event.
+ */
+static void vs_hangup(struct tty_struct *tty)
+{
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	trace_ttyvs_hangup(local_vsdev->own_index);
+
+	/* Drops reference to tty, may sleep so done without lock */
+	tty_port_hangup(tty->port);
+
+	/* hung up tty receives nothing, close returns early afterwards */
+	local_vsdev->is_open = 0;
+	vs_tty_clear(local_vsdev, tty);
+
+	if (tty && C_HUPCL(tty))
+		vs_change_modem_lines(tty, 0, TIOCM_DTR | TIOCM_RTS);
+}
+
+/*
+ * Return number of interrupts as response to TIOCGICOUNT IOCTL.
+ * Both 1->0 and 0->1 transitions are counted, except for RI;
+ * where only 0->1 transitions are accounted.
+ */
+static int vs_get_icount(struct tty_struct *tty,
+				struct serial_icounter_struct *icount)
+{
+	unsigned long flags;
+	struct async_icount cnow;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	spin_lock_irqsave(&local_vsdev->lock, flags);
+	cnow = local_vsdev->icount;
+	spin_unlock_irqrestore(&local_vsdev->lock, flags);
+
+	icount->cts = cnow.cts;
+	icount->dsr = cnow.dsr;
+	icount->rng = cnow.rng;
+	icount->dcd = cnow.dcd;
+	icount->tx = cnow.tx;
+	icount->rx = cnow.rx;
+	icount->frame = cnow.frame;
+	icount->parity = cnow.parity;
+	icount->overrun = cnow.overrun;
+	icount->brk = cnow.brk;
+	icount->buf_overrun = cnow.buf_overrun;
+
+	return 0;
+}
+
+/*
+ * Invoked by tty layer to execute TCIOFF and TCION IOCTL commands
+ * generally because user space process called tcflow() function.
+ * It send a high priority character to the tty device end even if
+ * stopped.
+ *
+ * If this function (send_xchar) is defined by tty device driver,
+ * tty core will call this function. If it is not specified then
+ * tty core will first instruct this driver to start transmission
+ * (start()) and then invoke write() of this driver passing character
+ * to be written and then it will call stop() of this driver.
+ */
+static void vs_send_xchar(struct tty_struct *tty, char ch)
+{
+	int was_paused;
+	unsigned long flags;
+	struct vs_dev *remote_vsdev;
+	struct vs_dev *local_vsdev = tty->driver_data;
+
+	/*
+	 * x-char goes out even if other end has paused us. Other end
+	 * changes tx_paused with both locks held, so it can not resume
+	 * or pause us meanwhile.
+	 */
+	rcu_read_lock();
+	remote_vsdev = vs_lock_pair(local_vsdev, &flags);
+	was_paused = local_vsdev->tx_paused;
+	if (was_paused)
+		local_vsdev->tx_paused = 0;
+
+	vs_xmit_char_now(tty, ch);
+	if (was_paused)
+		local_vsdev->tx_paused = 1;
+	vs_unlock_pair(local_vsdev, remote_vsdev, flags);
+	rcu_read_unlock();
+}
+
+/*
+ * Invoked by tty core in response to tcdrain() call. Waits until all
+ * the data queued in transmit ring has been delivered to the receiver
+ * end or the timeout (in jiffies) expires. In paced mode this takes
+ * the line time of the pending characters.
+ */
+static void vs_wait_until_sent(struct tty_struct *tty, int timeout)
+{
+	if (timeout == 0)
+		timeout = MAX_SCHEDULE_TIMEOUT;
+
+	wait_event_interruptible_timeout(tty->write_wait,
+			vs_chars_in_buffer(tty) == 0, timeout);
+}
+
+/*
+ * Gives snapshot of all the devices and their topology in a single
+ * read, one line per device:
+ * $ cat /proc/tty/driver/ttyvs
+ * ttyvs: nmpairs:1 lbdevs:1 max:128 buses:1
+ * 0: peer:1 type:snm rts:0x1 dtr:0x6 odtr:1 open:0
+ * 1: peer:0 type:snm rts:0x1 dtr:0x6 odtr:1 open:1
+ * 2: peer:2 type:slb rts:0x1 dtr:0x6 odtr:1 open:0
+ * 3: peer:3 type:bus rts:0x1 dtr:0x6 odtr:1 open:1
+ * 4: peer:3 type:bus rts:0x1 dtr:0x6 odtr:1 open:1
+ *
+ * Values are same as given by sysfs attributes of each device.
+ */
+static int vs_proc_show(struct seq_file *m, void *v)
+{
+	unsigned int x;
+	struct vs_dev *vsdev;
+	static const char * const types[] = {
+		"-", "snm", "cnm", "slb", "clb", "bus"
+	};
+
+	mutex_lock(&adaptlock);
+
+	seq_printf(m, "ttyvs: nmpairs:%u lbdevs:%u max:%u buses:%u\n",
+			total_nm_pair, total_lb_devs, max_num_vs_dev,
+			total_buses);
+
+	for_each_set_bit(x, vs_idx_map, max_num_vs_dev) {
+		vsdev = vs_dev_locked(x);
+		seq_printf(m, "%u: peer:%u type:%s rts:0x%x dtr:0x%x odtr:%d open:%d\n",
+			x, vs_peer_index(vsdev),
+			types[(vsdev->odevtyp <= VS_BUS) ? vsdev->odevtyp : 0],
+			vsdev->rts_mappings, vsdev->dtr_mappings,
+			vsdev->set_odtr_at_open, READ_ONCE(vsdev->is_open));
+	}
+
+	mutex_unlock(&adaptlock);
+	return 0;
+}
+
+/*
+ * Extract pin mappings from local to remote tty devices. The
+ * given 'data' is to be parsed starting from index 'x'.
+ */
+static int vs_extract_pin_mapping(const char data[], int x)
+{
+	int i, mapping = 0;
+
+	for (i = 0; i < 8; i++) {
+		switch (data[x]) {
+		case '8':
+			mapping |= VS_CON_CTS;
+			break;
+		case '1':
+			mapping |= VS_CON_DCD;
+			break;
+		case '6':
+			mapping |= VS_CON_DSR;
+			break;
+		case '9':
+			mapping |= VS_CON_RI;
+			break;
+		case '#':
+			i = 10; /* causes return from function */
+			break;
+		case 'x':
+		case ',':
+			break;
+		default:
+			return -EINVAL;
+		}
+		x++;
+	}
+
+	return mapping;
+}
+
+/*
+ * Gives the first free index at or after 'start', or -1 if all the
+ * indexes from 'start' onwards are in use. Caller holds adaptlock.
+ */
+static int vs_next_free_index(unsigned int start)
+{
+	unsigned long word, end, idx;
+	unsigned long nwords = BITS_TO_LONGS(max_num_vs_dev);
+
+	if (start >= max_num_vs_dev)
+		return -1;
+
+	word = BIT_WORD(start);
+	if (!test_bit(word, vs_idx_full)) {
+		end = (word + 1) * BITS_PER_LONG;
+		idx = find_next_zero_bit(vs_idx_map, end, start);
+		if (idx < end)
+			return idx;
+	}
+
+	word = find_next_zero_bit(vs_idx_full, nwords, word + 1);
+	if (word >= nwords)
+		return -1;
+
+	return find_next_zero_bit(vs_idx_map, (word + 1) * BITS_PER_LONG,
+					word * BITS_PER_LONG);
+}
+
+/*
+ * Reserves the given index or the first free index if 'want' is -1.
+ * Returns the reserved index or negative error code. Caller holds
+ * adaptlock.
+ */
+static int vs_reserve_index(int want)
+{
+	int idx = want;
+
+	if (idx == -1) {
+		idx = vs_next_free_index(0);
+		if (idx < 0)
+			return -ENOMEM;
+	} else if ((idx < 0) || (idx >= max_num_vs_dev)) {
+		return -EINVAL;
+	} else if (test_bit(idx, vs_idx_map)) {
+		return -EEXIST;
+	}
+
+	__set_bit(idx, vs_idx_map);
+	if (vs_idx_map[BIT_WORD(idx)] == ~0UL)
+		__set_bit(BIT_WORD(idx), vs_idx_full);
+
+	return idx;
+}
+
+/* Makes the given index available again. Caller holds adaptlock. */
+static void vs_release_index(int idx)
+{
+	db[idx].index = -1;
+	RCU_INIT_POINTER(db[idx].vsdev, NULL);
+	__clear_bit(idx, vs_idx_map);
+	__clear_bit(BIT_WORD(idx), vs_idx_full);
+}
+
+/*
+ * Allocates a virtual tty device along with its transmit ring. Meta
+ * information is initialized by the caller.
+ */
+static struct vs_dev *vs_alloc_dev(void)
+{
+	int cpu;
+	struct vs_dev *vsdev;
+
+	vsdev = kcalloc(1, sizeof(struct vs_dev), GFP_KERNEL);
+	if (vsdev == NULL)
+		return NULL;
+
+	if (kfifo_alloc(&vsdev->tx_fifo, VS_TX_RING_SIZE, GFP_KERNEL))
+		goto fail_fifo;
+
+	vsdev->stats = alloc_percpu(struct vs_pcpu_stats);
+	if (vsdev->stats == NULL)
+		goto fail_stats;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(vsdev->stats, cpu)->syncp);
+
+	kref_init(&vsdev->kref);
+	spin_lock_init(&vsdev->lock);
+	spin_lock_init(&vsdev->tx_lock);
+	INIT_DELAYED_WORK(&vsdev->tx_work, vs_tx_work);
+	hrtimer_init(&vsdev->pace_timer, CLOCK_MONOTONIC,
+			HRTIMER_MODE_REL_SOFT);
+	vsdev->pace_timer.function = vs_pace_timer_fn;
+	vsdev->char_time_ns = vs_char_time_ns(9600, VS_DATA_8);
+	vsdev->rxcpu = -1;
+	vsdev->fifo_depth = VS_TX_RING_SIZE;
+
+	return vsdev;
+
+fail_stats:
+	kfifo_free(&vsdev->tx_fifo);
+fail_fifo:
+	kfree(vsdev);
+	return NULL;
+}
+
+/*
+ * Drops reference of db[] to the given virtual tty device. The device
+ * is released once no tty uses it anymore. The caller must have
+ * stopped delivery work of the peer device also as that refers
+ * to this device.
+ */
+static void vs_free_dev(struct vs_dev *vsdev)
+{
+	if (vsdev == NULL)
+		return;
+
+	vs_tx_stop(vsdev);
+	kref_put(&vsdev->kref, vs_dev_release);
+}
+
+/*
+ * Parses index of the device given as 5 decimal digits starting at
+ * data[x]. Returns -1 if index is given as 'xxxxx' meaning any free
+ * index can be used, otherwise the index or negative error code.
+ */
+static int vs_extract_index(const char data[], int x)
+{
+	int ret;
+	unsigned int idx;
+	char tmp[8];
+
+	if (data[x] == 'x')
+		return -1;
+
+	memset(tmp, '\0', sizeof(tmp));
+	memcpy(tmp, &data[x], 5);
+
+	ret = kstrtouint(tmp, 10, &idx);
+	if (ret != 0)
+		return ret;
+	if (idx > 65535)
+		return -EINVAL;
+
+	return idx;
+}
+
+/*
+ * Parses a 61 byte device creation command (gennm#... or genlb#...)
+ * into the given specification.
+ */
+static int vs_parse_create_cmd(const char data[], struct vs_spec *spec)
+{
+	int ret;
+
+	memset(spec, 0, sizeof(struct vs_spec));
+
+	if ((data[0] != 'g') || (data[1] != 'e') || (data[2] != 'n'))
+		return -EINVAL;
+
+	if ((data[3] == 'n') && (data[4] == 'm'))
+		spec->is_loopback = 0;
+	else if ((data[3] == 'l') && (data[4] == 'b'))
+		spec->is_loopback = 1;
+	else
+		return -EINVAL;
+
+	/* 1st device index, used for both null modem and loop back */
+	spec->idx1 = vs_extract_index(data, 6);
+	if (spec->idx1 < -1)
+		return spec->idx1;
+
+	/* 2nd device index if null modem pair is to be created */
+	spec->idx2 = -1;
+	if (spec->is_loopback != 1) {
+		spec->idx2 = vs_extract_index(data, 12);
+		if (spec->idx2 < -1)
+			return spec->idx2;
+	}
+
+	/* rts mappings (dev1) */
+	if ((data[18] != '7') || (data[19] != '-'))
+		return -EINVAL;
+	ret = vs_extract_pin_mapping(data, 20);
+	if (ret < 0)
+		return ret;
+	spec->rts1 = ret;
+
+	/* dtr mapping (dev1) */
+	if ((data[27] != '#') || (data[28] != '4') || (data[29] != '-'))
+		return -EINVAL;
+	ret = vs_extract_pin_mapping(data, 30);
+	if (ret < 0)
+		return ret;
+	spec->dtr1 = ret;
+
+	if (data[37] != '#')
+		return -EINVAL;
+
+	if (spec->is_loopback != 1) {
+		/* rts mappings (dev2) */
+		if ((data[38] != '7') || (data[39] != '-'))
+			return -EINVAL;
+		ret = vs_extract_pin_mapping(data, 40);
+		if (ret < 0)
+			return ret;
+		spec->rts2 = ret;
+
+		/* dtr mapping (dev2) */
+		if ((data[47] != '#') || (data[48] != '4') || (data[49] != '-'))
+			return -EINVAL;
+		ret = vs_extract_pin_mapping(data, 50);
+		if (ret < 0)
+			return ret;
+		spec->dtr2 = ret;
+
+		if (data[57] != '#')
+			return -EINVAL;
+	}
+
+	spec->odtr1 = (data[58] == 'y') ? 1 : 0;
+	spec->odtr2 = (data[60] == 'y') ? 1 : 0;
+
+	return 0;
+}
+
+/*
+ * Registers the given device with tty core and creates its sysfs
+ * attributes. Caller holds adaptlock.
+ */
+static int vs_register_dev(struct vs_dev *vsdev)
+{
+	int ret;
+	struct device *device;
+
+	device = tty_register_device(ttyvs_driver, vsdev->own_index, NULL);
+	if (IS_ERR(device))
+		return PTR_ERR(device);
+
+	vsdev->device = device;
+	dev_set_drvdata(device, vsdev);
+
+	ret = sysfs_create_group(&device->kobj, &vs_info_attr_group);
+	if (ret < 0) {
+		tty_unregister_device(ttyvs_driver, vsdev->own_index);
+		return ret;
+	}
+
+	trace_ttyvs_dev_create(vsdev->own_index, vs_peer_index(vsdev));
+	return 0;
+}
+
+/*
+ * An application may forget to close serial port or it might have
+ * been crashed resulting in unclosed port and hence leaked resources.
+ * We handle such scenarios as disconnected event as done in case of
+ * a plug and play for example usb device. Application is running,
+ * port is opened and then suddenly user removes tty device.
+ *
+ * First tty must be released and than port. Delivery work is stopped
+ * here, the device itself is released by the caller. Caller holds
+ * adaptlock.
+ */
+static void vs_unregister_dev(struct vs_dev *vsdev)
+{
+	struct tty_struct *tty;
+
+	trace_ttyvs_dev_delete(vsdev->own_index, vs_peer_index(vsdev));
+	sysfs_remove_group(&vsdev->device->kobj, &vs_info_attr_group);
+	tty = vs_tty_get(vsdev);
+	if (tty) {
+		tty_vhangup(tty);
+		tty_kref_put(tty);
+	}
+	tty_unregister_device(ttyvs_driver, vsdev->own_index);
+	vs_tx_stop(vsdev);
+
+	/* tty still holding this device now finds nobody at other end */
+	RCU_INIT_POINTER(vsdev->peer, NULL);
+}
+
+/* Initialize meta information of a device being created */
+static void vs_init_dev(struct vs_dev *vsdev, int own, int peer,
+			int rts, int dtr, int odtr)
+{
+	vsdev->own_index = own;
+	vsdev->peer_index = peer;
+	vsdev->own_tty = NULL;
+	vsdev->rts_mappings = rts;
+	vsdev->dtr_mappings = dtr;
+	vsdev->set_odtr_at_open = odtr;
+	vsdev->msr_reg = 0;
+	vsdev->mcr_reg = 0;
+	vsdev->waiting_msr_chg = 0;
+	vsdev->tx_paused = 0;
+	vsdev->faulty_cable = 0;
+	vsdev->is_open = 0;
+	db[own].index = own;
+	rcu_assign_pointer(db[own].vsdev, vsdev);
+}
+
+/*
+ * Creates an RS-485 bus with spec->bus_members members, all of them
+ * configured as the first end in the specification. Returns index of
+ * the first member or negative error code. Caller holds adaptlock.
+ */
+static int vs_create_bus_locked(const struct vs_spec *spec)
+{
+	int x, ret;
+	int nidx = 0;
+	int nreg = 0;
+	struct vs_bus *bus;
+	struct vs_dev *vsdev;
+
+	bus = kzalloc(struct_size(bus, members, spec->bus_members),
+			GFP_KERNEL);
+	if (bus == NULL)
+		return -ENOMEM;
+
+	spin_lock_init(&bus->lock);
+	kref_init(&bus->kref);
+	bus->collision_detect = spec->bus_collision;
+
+	for (x = 0; x < spec->bus_members; x++) {
+		vsdev = vs_alloc_dev();
+		if (vsdev == NULL) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		kref_get(&bus->kref);
+		vsdev->bus = bus;
+		bus->members[bus->nmembers++] = vsdev;
+	}
+
+	for (x = 0; x < bus->nmembers; x++) {
+		if (x == 0)
+			ret = vs_reserve_index(spec->idx1);
+		else if (spec->member_idx)
+			ret = vs_reserve_index(spec->member_idx[x - 1]);
+		else
+			ret = vs_reserve_index(-1);
+		if (ret < 0)
+			goto fail;
+
+		vsdev = bus->members[x];
+		vs_init_dev(vsdev, ret, ret, spec->rts1, spec->dtr1,
+				spec->odtr1);
+		RCU_INIT_POINTER(vsdev->peer, vsdev);
+		vsdev->odevtyp = VS_BUS;
+		vsdev->rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+		nidx++;
+	}
+	bus->id = bus->members[0]->own_index;
+
+	for (x = 0; x < bus->nmembers; x++) {
+		ret = vs_register_dev(bus->members[x]);
+		if (ret < 0)
+			goto fail;
+		nreg++;
+	}
+
+	++total_buses;
+	ret = bus->id;
+	kref_put(&bus->kref, vs_bus_release);
+	return ret;
+
+fail:
+	for (x = 0; x < nreg; x++)
+		vs_unregister_dev(bus->members[x]);
+	for (x = 0; x < bus->nmembers; x++) {
+		if (x < nidx)
+			vs_release_index(bus->members[x]->own_index);
+		vs_free_dev(bus->members[x]);
+	}
+	kref_put(&bus->kref, vs_bus_release);
+	return ret;
+}
+
+/*
+ * Creates a null modem pair, a loop back device or an RS-485 bus as
+ * per the given specification. Returns index of the (first) device
+ * created or negative error code. Caller holds adaptlock.
+ */
+static int vs_create_locked(const struct vs_spec *spec)
+{
+	int ret;
+	int i = -1;
+	int y = -1;
+	struct vs_dev *vsdev1 = NULL;
+	struct vs_dev *vsdev2 = NULL;
+
+	if (spec->bus_members > 0)
+		return vs_create_bus_locked(spec);
+
+	vsdev1 = vs_alloc_dev();
+	if (vsdev1 == NULL)
+		return -ENOMEM;
+
+	if (spec->is_loopback != 1) {
+		vsdev2 = vs_alloc_dev();
+		if (vsdev2 == NULL) {
+			ret = -ENOMEM;
+			goto fail_alloc;
+		}
+	}
+
+	i = vs_reserve_index(spec->idx1);
+	if (i < 0) {
+		ret = i;
+		goto fail_alloc;
+	}
+
+	if (spec->is_loopback != 1) {
+		y = vs_reserve_index(spec->idx2);
+		if (y < 0) {
+			ret = y;
+			goto fail_index;
+		}
+
+		vs_init_dev(vsdev1, i, y, spec->rts1, spec->dtr1, spec->odtr1);
+		vs_init_dev(vsdev2, y, i, spec->rts2, spec->dtr2, spec->odtr2);
+		RCU_INIT_POINTER(vsdev1->peer, vsdev2);
+		RCU_INIT_POINTER(vsdev2->peer, vsdev1);
+		vsdev2->set_pdtr_at_open = vsdev1->set_odtr_at_open;
+		vsdev1->set_pdtr_at_open = vsdev2->set_odtr_at_open;
+	} else {
+		vs_init_dev(vsdev1, i, i, spec->rts1, spec->dtr1, spec->odtr1);
+		RCU_INIT_POINTER(vsdev1->peer, vsdev1);
+	}
+
+	ret = vs_register_dev(vsdev1);
+	if (ret < 0)
+		goto fail_index;
+
+	if (spec->is_loopback != 1) {
+		ret = vs_register_dev(vsdev2);
+		if (ret < 0)
+			goto fail_register;
+
+		last_nmdev1_idx = i;
+		last_nmdev2_idx = y;
+		++total_nm_pair;
+
+		if ((vsdev1->dtr_mappings != (VS_CON_DSR | VS_CON_DCD))
+				|| (vsdev1->rts_mappings != VS_CON_CTS)
+				|| (vsdev1->set_odtr_at_open != 1)
+				|| (vsdev2->dtr_mappings != (VS_CON_DSR | VS_CON_DCD))
+				|| (vsdev2->rts_mappings != VS_CON_CTS)
+				|| (vsdev2->set_odtr_at_open != 1)) {
+			vsdev1->odevtyp = VS_CNM;
+			vsdev2->odevtyp = VS_CNM;
+		} else {
+			vsdev1->odevtyp = VS_SNM;
+			vsdev2->odevtyp = VS_SNM;
+		}
+	} else {
+		last_lbdev_idx = i;
+		++total_lb_devs;
+
+		/* device type */
+		if ((vsdev1->dtr_mappings != (VS_CON_DSR | VS_CON_DCD))
+				|| (vsdev1->rts_mappings != VS_CON_CTS)
+				|| (vsdev1->set_odtr_at_open != 1)) {
+			vsdev1->odevtyp = VS_CLB;
+		} else {
+			vsdev1->odevtyp = VS_SLB;
+		}
+	}
+
+	return i;
+
+fail_register:
+	vs_unregister_dev(vsdev1);
+fail_index:
+	if (y >= 0)
+		vs_release_index(y);
+	vs_release_index(i);
+fail_alloc:
+	vs_free_dev(vsdev2);
+	vs_free_dev(vsdev1);
+	return ret;
+}
+
+/*
+ * Destroys all the members of the given RS-485 bus. The bus itself
+ * goes away along with its last member. Caller holds adaptlock.
+ */
+static void vs_destroy_bus_locked(struct vs_bus *bus)
 {
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
-	struct vs_dev *remote_vsdev = db[local_vsdev->peer_index].vsdev;
+	int x, idx;
+	int n = bus->nmembers;
+	struct vs_dev *vsdev;
 
-	if (tty->termios.c_cflag & CRTSCTS) {
-		/* hardware (RTS/CTS) flow control */
-		mutex_lock(&local_vsdev->lock);
-		remote_vsdev->tx_paused = 0;
-		vs_update_modem_lines(tty, TIOCM_RTS, 0);
-		mutex_unlock(&local_vsdev->lock);
+	for (x = 0; x < n; x++)
+		vs_unregister_dev(bus->members[x]);
 
-		if (remote_vsdev->own_tty && remote_vsdev->own_tty->port)
-			tty_port_tty_wakeup(remote_vsdev->own_tty->port);
-	} else if ((tty->termios.c_iflag & IXON) ||
-				(tty->termios.c_iflag & IXOFF)) {
-		/* software flow control */
-		vs_put_char(tty, START_CHAR(tty));
+	/* members not yet released keep the bus alive */
+	for (x = 0; x < n; x++) {
+		vsdev = bus->members[x];
+		idx = vsdev->own_index;
+		vs_free_dev(vsdev);
+		vs_release_index(idx);
+	}
+
+	--total_buses;
+}
+
+/*
+ * Destroys the device at the given index along with the device it
+ * is connected to (if it is one end of a null modem pair) or all the
+ * members of its RS-485 bus. Caller holds adaptlock.
+ */
+static int vs_destroy_locked(int idx)
+{
+	int peer;
+	struct vs_dev *vsdev1;
+	struct vs_dev *vsdev2 = NULL;
+
+	if ((idx < 0) || (idx >= max_num_vs_dev) ||
+			!test_bit(idx, vs_idx_map))
+		return -EINVAL;
+
+	vsdev1 = vs_dev_locked(idx);
+	if (vsdev1->bus) {
+		vs_destroy_bus_locked(vsdev1->bus);
+		return 0;
+	}
+
+	peer = vsdev1->peer_index;
+	if (peer != idx)
+		vsdev2 = vs_dev_locked(peer);
+
+	vs_unregister_dev(vsdev1);
+	if (vsdev2)
+		vs_unregister_dev(vsdev2);
+
+	vs_free_dev(vsdev1);
+	vs_release_index(idx);
+
+	if (vsdev2) {
+		vs_free_dev(vsdev2);
+		vs_release_index(peer);
+		--total_nm_pair;
+		if ((last_nmdev1_idx == idx) || (last_nmdev2_idx == idx)) {
+			last_nmdev1_idx = -1;
+			last_nmdev2_idx = -1;
+		}
 	} else {
-		/* do nothing */
+		--total_lb_devs;
+		if (last_lbdev_idx == idx)
+			last_lbdev_idx = -1;
+	}
+
+	return 0;
+}
+
+/* Destroys all the devices. Caller holds adaptlock. */
+static void vs_destroy_all_locked(void)
+{
+	int x;
+
+	for_each_set_bit(x, vs_idx_map, max_num_vs_dev)
+		vs_unregister_dev(vs_dev_locked(x));
+
+	/*
+	 * Delivery work of all devices has been stopped, now devices
+	 * can be released in any order.
+	 */
+	for_each_set_bit(x, vs_idx_map, max_num_vs_dev) {
+		vs_free_dev(vs_dev_locked(x));
+		vs_release_index(x);
 	}
+
+	total_nm_pair = 0;
+	total_lb_devs = 0;
+	total_buses = 0;
+	last_lbdev_idx  = -1;
+	last_nmdev1_idx = -1;
+	last_nmdev2_idx = -1;
 }
 
 /*
- * Invoked when this driver should stop sending data for example
- * as a part of flow control mechanism.
- *
- * Line discipline n_tty calls this function if this device uses
- * software flow control and an XOFF character is received from
- * other end.
+ * Creates 'count' devices as per the given specification with
+ * adaptlock taken once. Either all devices are created or none.
+ * Returns 0 or negative error code. Caller holds adaptlock.
  */
-static void vs_stop(struct tty_struct *tty)
+static int vs_create_bulk_locked(const struct vs_spec *spec, int count)
 {
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	int x, ret = 0;
+	int *created;
 
-	mutex_lock(&local_vsdev->lock);
-	local_vsdev->tx_paused = 1;
-	mutex_unlock(&local_vsdev->lock);
+	if (count == 1) {
+		ret = vs_create_locked(spec);
+		return (ret < 0) ? ret : 0;
+	}
+
+	/* Fixed indexes can not be used for more than one device */
+	if ((spec->idx1 != -1) || (spec->idx2 != -1))
+		return -EINVAL;
+
+	created = kmalloc_array(count, sizeof(int), GFP_KERNEL);
+	if (created == NULL)
+		return -ENOMEM;
+
+	for (x = 0; x < count; x++) {
+		ret = vs_create_locked(spec);
+		if (ret < 0)
+			break;
+		created[x] = ret;
+	}
+
+	if (ret < 0) {
+		while (--x >= 0)
+			vs_destroy_locked(created[x]);
+	} else {
+		ret = 0;
+	}
+
+	kfree(created);
+	return ret;
 }
 
 /*
- * Invoked when this driver should start sending data for example
- * as a part of flow control mechanism.
- *
- * Line discipline n_tty calls this function if this device uses
- * software flow control and an XON character is received from
- * other end.
+ * Destroys all the devices whose index lies in the inclusive range
+ * 'first' to 'last'. Caller holds adaptlock.
  */
-static void vs_start(struct tty_struct *tty)
+static void vs_destroy_range_locked(int first, int last)
 {
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	int x;
 
-	mutex_lock(&local_vsdev->lock);
-	local_vsdev->tx_paused = 0;
-	mutex_unlock(&local_vsdev->lock);
+	if (last >= max_num_vs_dev)
+		last = max_num_vs_dev - 1;
 
-	if (tty && tty->port)
-		tty_port_tty_wakeup(tty->port);
+	for (x = find_next_bit(vs_idx_map, last + 1, first); x <= last;
+			x = find_next_bit(vs_idx_map, last + 1, x + 1))
+		vs_destroy_locked(x);
 }
 
 /*
- * Obtain the modem status bits for the given tty device. Invoked
- * typically when TIOCMGET IOCTL is executed on the given
- * tty device.
+ * Control interface of the virtual card. Following commands are
+ * accepted (see vs_parse_create_cmd() for creation record format):
+ *
+ * 1. Create a null modem pair or a loop back device (61 bytes):
+ * $ echo "gennm#xxxxx#xxxxx#7-8,x,x,x#4-1,6,x,x#7-8,x,x,x#4-1,6,x,x#y#y" > /dev/ttyvs_card
+ *
+ * 2. Create NNNNN null modem pairs or loop back devices in one go,
+ *    creation record follows the bulk prefix (72 bytes):
+ * $ echo "bulk#02000#gennm#xxxxx#xxxxx#7-8,x,x,x#4-1,6,x,x#7-8,x,x,x#4-1,6,x,x#y#y" > /dev/ttyvs_card
+ *
+ * 3. Delete device 5 (and its peer):
+ * $ echo "del#00005#xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" > /dev/ttyvs_card
+ *
+ * 4. Delete all devices with index from 10 to 4009 (and their peers):
+ * $ echo "del#00010-04009#xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" > /dev/ttyvs_card
+ *
+ * 5. Delete all devices:
+ * $ echo "del#xxxxx#xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" > /dev/ttyvs_card
  */
-static int vs_tiocmget(struct tty_struct *tty)
+static ssize_t vs_card_write(struct file *file,
+			const char __user *buf, size_t length, loff_t *ppos)
 {
-	int status, msr_reg, mcr_reg;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	int ret;
+	int count = 1;
+	int vdev1idx, vdev2idx;
+	char *rec;
+	char tmp[8];
+	char data[80];
+	struct vs_spec spec;
 
-	mutex_lock(&local_vsdev->lock);
-	mcr_reg = local_vsdev->mcr_reg;
-	msr_reg = local_vsdev->msr_reg;
-	mutex_unlock(&local_vsdev->lock);
+	memset(data, '\0', sizeof(data));
 
-	status = ((mcr_reg & VS_MCR_DTR)  ? TIOCM_DTR  : 0) |
-			 ((mcr_reg & VS_MCR_RTS)  ? TIOCM_RTS  : 0) |
-			 ((mcr_reg & VS_MCR_LOOP) ? TIOCM_LOOP : 0) |
-			 ((msr_reg & VS_MSR_DCD)  ? TIOCM_CAR  : 0) |
-			 ((msr_reg & VS_MSR_RI)   ? TIOCM_RI   : 0) |
-			 ((msr_reg & VS_MSR_CTS)  ? TIOCM_CTS  : 0) |
-			 ((msr_reg & VS_MSR_DSR)  ? TIOCM_DSR  : 0);
+	if (length == 2) {
+		memcpy(data, vs_std_nm_cmd, 61);
+	} else if (length == 3) {
+		memcpy(data, vs_std_lb_cmd, 61);
+	} else if (((length > 60) && (length < 63)) ||
+			((length > 71) && (length < 74))) {
+		if (copy_from_user(data, buf, length) != 0)
+			return -EFAULT;
+	} else {
+		return -EINVAL;
+	}
 
-	return status;
+	rec = data;
+	if ((length > 71) && (data[0] == 'b') && (data[1] == 'u') &&
+			(data[2] == 'l') && (data[3] == 'k') &&
+			(data[4] == '#') && (data[10] == '#')) {
+		memset(tmp, '\0', sizeof(tmp));
+		memcpy(tmp, &data[5], 5);
+		ret = kstrtoint(tmp, 10, &count);
+		if (ret != 0)
+			return ret;
+		if ((count < 1) || (count > max_num_vs_dev))
+			return -EINVAL;
+		rec = &data[11];
+	} else if (length > 71) {
+		return -EINVAL;
+	}
+
+	if ((rec[0] == 'g') && (rec[1] == 'e') && (rec[2] == 'n')) {
+		/* Create device(s) command sent */
+		ret = vs_parse_create_cmd(rec, &spec);
+		if (ret < 0)
+			return ret;
+
+		/*
+		 * Create serial port (tty device) with lock taken to ensure
+		 * correctness of index in use and associated data.
+		 */
+		mutex_lock(&adaptlock);
+		ret = vs_create_bulk_locked(&spec, count);
+		mutex_unlock(&adaptlock);
+		if (ret < 0)
+			return ret;
+	} else if ((rec == data) && (data[0] == 'd') && (data[1] == 'e') &&
+			(data[2] == 'l')) {
+		/* Destroy device command sent */
+		if (data[4] == 'x') {
+			mutex_lock(&adaptlock);
+			vs_destroy_all_locked();
+			mutex_unlock(&adaptlock);
+			return length;
+		}
+
+		vdev1idx = vs_extract_index(data, 4);
+		if (vdev1idx < 0)
+			return -EINVAL;
+
+		if (data[9] == '-') {
+			vdev2idx = vs_extract_index(data, 10);
+			if ((vdev2idx < 0) || (vdev2idx < vdev1idx))
+				return -EINVAL;
+
+			mutex_lock(&adaptlock);
+			vs_destroy_range_locked(vdev1idx, vdev2idx);
+			mutex_unlock(&adaptlock);
+		} else {
+			mutex_lock(&adaptlock);
+			ret = vs_destroy_locked(vdev1idx);
+			mutex_unlock(&adaptlock);
+			if (ret < 0)
+				return ret;
+		}
+	} else {
+		return -EINVAL;
+	}
+
+	return length;
 }
 
 /*
- * Set the modem status bits. Invoked typically when TIOCMSET IOCTL
- * is executed on the given tty device.
+ * Gives next available index and last used index for virtual
+ * tty devices created.
+ * $ head -c 52 /proc/vs_vmpscrdk
  */
-static int vs_tiocmset(struct tty_struct *tty,
-				unsigned int set, unsigned int clear)
+static ssize_t vs_card_read(struct file *file,
+				char __user *buf, size_t size, loff_t *ppos)
 {
-	int ret;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	int ret = 0;
+	int val = 0;
+	char data[64];
+	int first_avail_idx = -1;
+	int second_avail_idx = -1;
+	struct vs_dev *lbvsdev = NULL;
+	struct vs_dev *nm1vsdev = NULL;
+	struct vs_dev *nm2vsdev = NULL;
+
+	memset(data, '\0', 64);
+
+	if (size != 52)
+		return -EINVAL;
+
+	mutex_lock(&adaptlock);
+
+	/* Find next two available free indexes */
+	first_avail_idx = vs_next_free_index(0);
+	if (first_avail_idx != -1)
+		second_avail_idx = vs_next_free_index(first_avail_idx + 1);
+
+	if ((first_avail_idx != -1) && (second_avail_idx != -1))
+		val = 2;
+	else if ((first_avail_idx != -1) && (second_avail_idx == -1))
+		val = 1;
+	else if ((first_avail_idx == -1) && (second_avail_idx == -1))
+		val = 0;
+
+	if (last_lbdev_idx == -1) {
+		if (last_nmdev1_idx == -1) {
+			snprintf(data, 64,
+				"xxxxx#xxxxx-xxxxx#%05d-%05d#%d#x-x#x-x#x-x#x#x#x\r\n",
+				first_avail_idx, second_avail_idx, val);
+		} else {
+			nm1vsdev = vs_dev_locked(last_nmdev1_idx);
+			nm2vsdev = vs_dev_locked(last_nmdev2_idx);
+			snprintf(data, 64,
+				"xxxxx#%05d-%05d#%05d-%05d#%d#x-x#%d-%d#%d-%d#x#%d#%d\r\n",
+				last_nmdev1_idx, last_nmdev2_idx, first_avail_idx,
+				second_avail_idx, val, nm1vsdev->rts_mappings,
+				nm1vsdev->dtr_mappings, nm2vsdev->rts_mappings,
+				nm2vsdev->dtr_mappings, nm1vsdev->set_odtr_at_open,
+				nm2vsdev->set_odtr_at_open);
+		}
+	} else {
+		if (last_nmdev1_idx == -1) {
+			lbvsdev = vs_dev_locked(last_lbdev_idx);
+			snprintf(data, 64,
+				"%05d#xxxxx-xxxxx#%05d-%05d#%d#%d-%d#x-x#x-x#%d#x#x\r\n",
+				last_lbdev_idx, first_avail_idx,
+				second_avail_idx, val, lbvsdev->rts_mappings,
+				lbvsdev->dtr_mappings, lbvsdev->set_odtr_at_open);
+		} else {
+			lbvsdev = vs_dev_locked(last_lbdev_idx);
+			nm1vsdev = vs_dev_locked(last_nmdev1_idx);
+			nm2vsdev = vs_dev_locked(last_nmdev2_idx);
+			snprintf(data, 64,
+				"%05d#%05d-%05d#%05d-%05d#%d#%d-%d#%d-%d#%d-%d#%d#%d#%d\r\n",
+				last_lbdev_idx, last_nmdev1_idx,
+				last_nmdev2_idx, first_avail_idx, second_avail_idx,
+				val, lbvsdev->rts_mappings, lbvsdev->dtr_mappings,
+				nm1vsdev->rts_mappings, nm1vsdev->dtr_mappings,
+				nm2vsdev->rts_mappings, nm2vsdev->dtr_mappings,
+				lbvsdev->set_odtr_at_open, nm1vsdev->set_odtr_at_open,
+				nm2vsdev->set_odtr_at_open);
+		}
+	}
+
+	mutex_unlock(&adaptlock);
+
+	ret = copy_to_user(buf, &data, 52);
+	if (ret)
+		return -EFAULT;
+
+	return 52;
+}
+
+/* Fills user visible information of the given device. */
+static void vs_fill_ioc_dev(const struct vs_dev *vsdev, struct vs_ioc_dev *info)
+{
+	memset(info, 0, sizeof(struct vs_ioc_dev));
+	info->index = vsdev->own_index;
+	info->peer_index = vs_peer_index(vsdev);
+	info->rts_map = vsdev->rts_mappings;
+	info->dtr_map = vsdev->dtr_mappings;
+	if (vsdev->set_odtr_at_open)
+		info->flags |= VS_IOC_F_DTR_AT_OPEN;
+	if (READ_ONCE(vsdev->is_open))
+		info->flags |= VS_IOC_F_OPEN;
+	if (vsdev->bus && vsdev->bus->collision_detect)
+		info->flags |= VS_IOC_F_BUS_COLLISION;
+	info->type = vsdev->odevtyp;
+}
+
+/* Validates pin mappings and flags of one end given by user space */
+static int vs_ioc_check_end(__u32 rts, __u32 dtr, __u32 flags,
+				__u32 valid_flags)
+{
+	const __u32 pins = VS_CON_CTS | VS_CON_DCD | VS_CON_DSR | VS_CON_RI;
+
+	if ((rts & ~pins) || (dtr & ~pins) || (flags & ~valid_flags))
+		return -EINVAL;
+	return 0;
+}
+
+static int vs_ioc_create(struct vs_ioc_create __user *argp)
+{
+	int ret, ends;
+	__u32 valid_flags = VS_IOC_F_DTR_AT_OPEN;
+	struct vs_ioc_create req;
+	struct vs_spec spec;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if ((req.kind != VS_IOC_NULL_MODEM) && (req.kind != VS_IOC_LOOPBACK)
+			&& (req.kind != VS_IOC_BUS))
+		return -EINVAL;
+	if ((req.count < 1) || (req.count > max_num_vs_dev) || req.reserved)
+		return -EINVAL;
+	if ((req.kind == VS_IOC_BUS) && (req.count < 2))
+		return -EINVAL;
+
+	ends = (req.kind == VS_IOC_NULL_MODEM) ? 2 : 1;
+	if (req.kind == VS_IOC_BUS)
+		valid_flags |= VS_IOC_F_BUS_COLLISION;
+	for (ret = 0; ret < ends; ret++) {
+		if (vs_ioc_check_end(req.rts_map[ret], req.dtr_map[ret],
+					req.flags[ret], valid_flags) < 0)
+			return -EINVAL;
+		if (req.index[ret] < -1)
+			return -EINVAL;
+	}
+
+	memset(&spec, 0, sizeof(struct vs_spec));
+	spec.is_loopback = (ends == 1) ? 1 : 0;
+	spec.idx1 = req.index[0];
+	spec.rts1 = req.rts_map[0];
+	spec.dtr1 = req.dtr_map[0];
+	spec.odtr1 = (req.flags[0] & VS_IOC_F_DTR_AT_OPEN) ? 1 : 0;
+	spec.idx2 = -1;
+	if (ends == 2) {
+		spec.idx2 = req.index[1];
+		spec.rts2 = req.rts_map[1];
+		spec.dtr2 = req.dtr_map[1];
+		spec.odtr2 = (req.flags[1] & VS_IOC_F_DTR_AT_OPEN) ? 1 : 0;
+	}
+	if (req.kind == VS_IOC_BUS) {
+		/* one bus with 'count' members */
+		spec.bus_members = req.count;
+		spec.bus_collision =
+			(req.flags[0] & VS_IOC_F_BUS_COLLISION) ? 1 : 0;
+	}
+
+	mutex_lock(&adaptlock);
+	if ((req.count == 1) || spec.bus_members)
+		ret = vs_create_locked(&spec);
+	else
+		ret = vs_create_bulk_locked(&spec, req.count);
+	mutex_unlock(&adaptlock);
+	if (ret < 0)
+		return ret;
 
-	mutex_lock(&local_vsdev->lock);
-	ret = vs_update_modem_lines(tty, set, clear);
-	mutex_unlock(&local_vsdev->lock);
+	req.created = ((req.count == 1) || spec.bus_members) ? ret : -1;
+	if (copy_to_user(argp, &req, sizeof(req)))
+		return -EFAULT;
 
-	return ret;
+	return 0;
 }
 
-/*
- * Unconditionally assert/de-assert break condition of the given
- * tty device.
- */
-static int vs_break_ctl(struct tty_struct *tty, int break_state)
+static int vs_ioc_delete(struct vs_ioc_delete __user *argp)
 {
-	struct tty_struct *tty_to_write;
-	struct vs_dev *brk_rx_vsdev;
-	struct vs_dev *brk_tx_vsdev = db[tty->index].vsdev;
-
-	if (tty->index != brk_tx_vsdev->peer_index) {
-		tty_to_write = brk_tx_vsdev->peer_tty;
-		brk_rx_vsdev = db[brk_tx_vsdev->peer_index].vsdev;
-	} else {
-		tty_to_write = tty;
-		brk_rx_vsdev = brk_tx_vsdev;
-	}
-
-	mutex_lock(&brk_tx_vsdev->lock);
+	int ret = 0;
+	struct vs_ioc_delete req;
 
-	if (break_state != 0) {
-		if (brk_tx_vsdev->is_break_on == 1)
-			return 0;
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
 
-		brk_tx_vsdev->is_break_on = 1;
-		if (tty_to_write != NULL) {
-			tty_insert_flip_char(tty_to_write->port, 0, TTY_BREAK);
-			tty_flip_buffer_push(tty_to_write->port);
-			brk_rx_vsdev->icount.brk++;
-		}
+	mutex_lock(&adaptlock);
+	if (req.first == -1) {
+		vs_destroy_all_locked();
+	} else if ((req.first < 0) || (req.last < req.first)) {
+		ret = -EINVAL;
+	} else if (req.first == req.last) {
+		ret = vs_destroy_locked(req.first);
 	} else {
-		brk_tx_vsdev->is_break_on = 0;
+		vs_destroy_range_locked(req.first, req.last);
 	}
+	mutex_unlock(&adaptlock);
 
-	mutex_unlock(&brk_tx_vsdev->lock);
-	return 0;
+	return ret;
 }
 
-/*
- * Invoked by tty layer to inform this driver that it should hangup
- * the tty device (lower modem control lines after last process
- * using tty devices closes the device or exited).
- *
- * Drop DTR/RTS if HUPCL is set. This causes any attached modem to
- * hang up the line.
- *
- * On the receiving end, if CLOCAL bit is set, DCD will be ignored
- * otherwise SIGHUP may be generated to indicate a line disconnect
- * event.
- */
-static void vs_hangup(struct tty_struct *tty)
+static int vs_ioc_get_stats(struct vs_ioc_stats __user *argp)
 {
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	__u32 idx;
+	struct vs_ioc_stats stats;
 
-	mutex_lock(&local_vsdev->lock);
+	if (get_user(idx, &argp->index))
+		return -EFAULT;
+	if (idx >= max_num_vs_dev)
+		return -EINVAL;
 
-	/* Drops reference to tty */
-	tty_port_hangup(tty->port);
+	mutex_lock(&adaptlock);
+	if (!test_bit(idx, vs_idx_map)) {
+		mutex_unlock(&adaptlock);
+		return -ENODEV;
+	}
+	vs_stat_read(vs_dev_locked(idx), &stats);
+	mutex_unlock(&adaptlock);
 
-	if (tty && C_HUPCL(tty))
-		vs_update_modem_lines(tty, 0, TIOCM_DTR | TIOCM_RTS);
+	if (copy_to_user(argp, &stats, sizeof(stats)))
+		return -EFAULT;
 
-	mutex_unlock(&local_vsdev->lock);
-	pr_debug("hanged up!\n");
+	return 0;
 }
 
-/*
- * Return number of interrupts as response to TIOCGICOUNT IOCTL.
- * Both 1->0 and 0->1 transitions are counted, except for RI;
- * where only 0->1 transitions are accounted.
- */
-static int vs_get_icount(struct tty_struct *tty,
-				struct serial_icounter_struct *icount)
+static int vs_ioc_query(struct vs_ioc_dev __user *argp)
 {
-	struct async_icount cnow;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
+	__u32 idx;
+	struct vs_ioc_dev info;
 
-	mutex_lock(&local_vsdev->lock);
-	cnow = local_vsdev->icount;
-	mutex_unlock(&local_vsdev->lock);
+	if (get_user(idx, &argp->index))
+		return -EFAULT;
+	if (idx >= max_num_vs_dev)
+		return -EINVAL;
 
-	icount->cts = cnow.cts;
-	icount->dsr = cnow.dsr;
-	icount->rng = cnow.rng;
-	icount->dcd = cnow.dcd;
-	icount->tx = cnow.tx;
-	icount->rx = cnow.rx;
-	icount->frame = cnow.frame;
-	icount->parity = cnow.parity;
-	icount->overrun = cnow.overrun;
-	icount->brk = cnow.brk;
-	icount->buf_overrun = cnow.buf_overrun;
+	mutex_lock(&adaptlock);
+	if (!test_bit(idx, vs_idx_map)) {
+		mutex_unlock(&adaptlock);
+		return -ENODEV;
+	}
+	vs_fill_ioc_dev(vs_dev_locked(idx), &info);
+	mutex_unlock(&adaptlock);
+
+	if (copy_to_user(argp, &info, sizeof(info)))
+		return -EFAULT;
 
 	return 0;
 }
 
 /*
- * Invoked by tty layer to execute TCIOFF and TCION IOCTL commands
- * generally because user space process called tcflow() function.
- * It send a high priority character to the tty device end even if
- * stopped.
- *
- * If this function (send_xchar) is defined by tty device driver,
- * tty core will call this function. If it is not specified then
- * tty core will first instruct this driver to start transmission
- * (start()) and then invoke write() of this driver passing character
- * to be written and then it will call stop() of this driver.
+ * Entries are gathered into a kernel buffer with adaptlock held and
+ * copied to user space after the lock is dropped, so that a fault on
+ * the user buffer never stalls creation/deletion of devices. Entries
+ * are struct vs_ioc_stats if 'stats' is set, else struct vs_ioc_dev.
  */
-static void vs_send_xchar(struct tty_struct *tty, char ch)
+static int vs_ioc_enum(struct vs_ioc_enum __user *argp, int stats)
 {
-	int was_paused;
-	struct vs_dev *local_vsdev = db[tty->index].vsdev;
-
-	was_paused = local_vsdev->tx_paused;
-	if (was_paused)
-		local_vsdev->tx_paused = 0;
+	int ret = 0;
+	unsigned int x, n = 0;
+	struct vs_ioc_enum req;
+	void *info;
+	size_t size = stats ? sizeof(struct vs_ioc_stats) :
+				sizeof(struct vs_ioc_dev);
 
-	vs_put_char(tty, ch);
-	if (was_paused)
-		local_vsdev->tx_paused = 1;
-}
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
 
-/*
- * Invoked by tty core in response to tcdrain() call. As this driver
- * drains on write() itself, we return immediately from here.
- */
-static void vs_wait_until_sent(struct tty_struct *tty, int timeout)
-{
-	pr_debug("returned wait until sent!\n");
-}
+	if (req.reserved)
+		return -EINVAL;
+	if (req.count > max_num_vs_dev)
+		req.count = max_num_vs_dev;
 
-/*
- * Extract pin mappings from local to remote tty devices. The
- * given 'data' is to be parsed starting from index 'x'.
- */
-static int vs_extract_pin_mapping(char data[], int x)
-{
-	int i, mapping = 0;
+	info = NULL;
+	if (req.count) {
+		info = kvmalloc_array(req.count, size, GFP_KERNEL);
+		if (info == NULL)
+			return -ENOMEM;
+	}
 
-	for (i = 0; i < 8; i++) {
-		switch (data[x]) {
-		case '8':
-			mapping |= VS_CON_CTS;
-			break;
-		case '1':
-			mapping |= VS_CON_DCD;
-			break;
-		case '6':
-			mapping |= VS_CON_DSR;
-			break;
-		case '9':
-			mapping |= VS_CON_RI;
-			break;
-		case '#':
-			i = 10; /* causes return from function */
-			break;
-		case 'x':
-		case ',':
-			break;
-		default:
-			return -EINVAL;
-		x++;
-		}
+	mutex_lock(&adaptlock);
+	x = (req.start < max_num_vs_dev) ? req.start : max_num_vs_dev;
+	for (x = find_next_bit(vs_idx_map, max_num_vs_dev, x);
+			(x < max_num_vs_dev) && (n < req.count);
+			x = find_next_bit(vs_idx_map, max_num_vs_dev, x + 1)) {
+		if (stats)
+			vs_stat_read(vs_dev_locked(x),
+				(struct vs_ioc_stats *)info + n);
+		else
+			vs_fill_ioc_dev(vs_dev_locked(x),
+				(struct vs_ioc_dev *)info + n);
+		n++;
 	}
+	mutex_unlock(&adaptlock);
 
-	return mapping;
-}
+	req.next = (x < max_num_vs_dev) ? x : VS_IOC_ENUM_END;
+	req.count = n;
 
-static ssize_t vs_card_write(struct file *file,
-			const char __user *buf, size_t length, loff_t *ppos)
-{
-	int x = -1;
-	int y = -1;
-	int i = -1;
-	int ret = -1;
-	int create = -1;
-	int vdev1idx = -1;
-	int vdev2idx = -1;
-	int vdev1rts = 0;
-	int vdev2rts = 0;
-	int vdev1dtr = 0;
-	int vdev2dtr = 0;
-	int is_loopback = -1;
+	if (n && copy_to_user(u64_to_user_ptr(req.devs), info,
+				n * size))
+		ret = -EFAULT;
+	else if (copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
 
-	char tmp[8];
-	char data[64];
+	kvfree(info);
+	return ret;
+}
 
-	struct vs_dev *vsdev1 = NULL;
-	struct vs_dev *vsdev2 = NULL;
-	struct device *device1 = NULL;
-	struct device *device2 = NULL;
-	struct tty_struct *tty;
+/*
+ * Attaches a tap owned by the given file to the device given in the
+ * request and to the devices it is connected to, fills in map_size.
+ * Ring is allocated before taking adaptlock as it can be large.
+ */
+static int vs_tap_attach(struct file *file, struct vs_tap_attach *req)
+{
+	int x, n, ret = 0;
+	size_t map_size;
+	struct vs_tap_hdr *hdr;
+	struct vs_tap *tap = NULL;
+	struct vs_dev *vsdev;
 
-	if (length == 2) {
-		memcpy(data, "gennm#xxxxx#xxxxx#7-8,x,x,x#4-1,6,x,x#7-8,x,x,x#4-1,6,x,x#y#y", 61);
-	} else if (length == 3) {
-		memcpy(data, "genlb#xxxxx#xxxxx#7-8,x,x,x#4-1,6,x,x#x-x,x,x,x#x-x,x,x,x#y#x", 61);
-	} else if ((length > 60) && (length < 63)) {
-		if (copy_from_user(data, buf, length) != 0)
-			return -EFAULT;
-	} else {
+	if ((req->ring_size < PAGE_SIZE) || (req->ring_size > VS_TAP_RING_MAX)
+			|| !is_power_of_2(req->ring_size))
 		return -EINVAL;
-	}
-	data[62] = '\0';
-
-	/* Initial sanitization */
-	if ((data[0] == 'g') && (data[1] == 'e') && (data[2] == 'n')) {
-		if ((data[3] == 'n') && (data[4] == 'm'))
-		else if ((data[3] == 'l') && (data[4] == 'b'))
-			is_loopback = 1;
-		else
-			return -EINVAL;
-		create = 1;
-	} else if ((data[0] == 'd') && (data[1] == 'e') && (data[2] == 'l')) {
-		create = -1;
-	} else {
+	if (req->index >= max_num_vs_dev)
 		return -EINVAL;
-	}
 
-	if (create == 1) {
-		/* Create device(s) command sent */
-
-		/*
-		 * Extract 1st device index to be used for both
-		 * null modem and loop back.
-		 */
-		x = 6;
-		if (data[6] != 'x') {
-			memset(tmp, '\0', sizeof(tmp));
-			for (i = 0; i < 5; i++) {
-				tmp[i] = data[x];
-				x++;
-			}
-			ret = kstrtouint(tmp, 10, &vdev1idx);
-			if (ret != 0)
-				return ret;
-			if ((vdev1idx < 0) || (vdev1idx > 65535))
-				return -EINVAL;
-		}
-
-		vsdev1 = kcalloc(1, sizeof(struct vs_dev), GFP_KERNEL);
-		if (vsdev1 == NULL)
-			return -ENOMEM;
+	map_size = PAGE_SIZE + req->ring_size;
+	hdr = vmalloc_user(map_size);
+	if (hdr == NULL)
+		return -ENOMEM;
 
-		/*
-		 * Extract 2nd device index if null modem pair is to
-		 * be created.
-		 */
-		if (is_loopback != 1) {
-			x = 12;
-			if (data[x] != 'x') {
-				memset(tmp, '\0', sizeof(tmp));
-				i = 0;
-				for (i = 0; i < 5; i++) {
-					tmp[i] = data[x];
-					x++;
-				}
-				ret = kstrtouint(tmp, 10, &vdev2idx);
-				if (ret != 0)
-					return ret;
-				if ((vdev2idx < 0) || (vdev2idx > 65535)) {
-					ret = -EINVAL;
-					goto fail_arg;
-				}
+	hdr->version = VS_TAP_VERSION;
+	hdr->data_offset = PAGE_SIZE;
+	hdr->data_size = req->ring_size;
 
-			}
+	mutex_lock(&adaptlock);
 
-			vsdev2 = kcalloc(1, sizeof(struct vs_dev), GFP_KERNEL);
-			if (vsdev2 == NULL) {
-				ret = -ENOMEM;
-				goto fail_arg;
-			}
-		}
+	if (file->private_data) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+	if (!test_bit(req->index, vs_idx_map)) {
+		ret = -ENODEV;
+		goto unlock;
+	}
 
-		/* rts mappings (dev1) */
-		if ((data[18] != '7') || (data[19] != '-')) {
-			ret = -EINVAL;
-			goto fail_arg;
-		}
-		ret = vs_extract_pin_mapping(data, 20);
-		if (ret < 0)
-			goto fail_arg;
-		vdev1rts = ret;
+	vsdev = vs_dev_locked(req->index);
+	if (vsdev->bus)
+		n = vsdev->bus->nmembers;
+	else if (vsdev->peer_index != vsdev->own_index)
+		n = 2;
+	else
+		n = 1;
 
-		if ((data[27] != '#') || (data[28] != '4') || (data[29] != '-'))
-			goto fail_arg;
+	tap = kzalloc(struct_size(tap, devs, n), GFP_KERNEL);
+	if (tap == NULL) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
 
-		/* dtr mapping (dev1) */
-		ret = vs_extract_pin_mapping(data, 30);
-		if (ret < 0)
-			goto fail_arg;
-		vdev1dtr = ret;
+	for (x = 0; x < n; x++) {
+		if (vsdev->bus)
+			tap->devs[x] = vsdev->bus->members[x];
+		else
+			tap->devs[x] = (x == 0) ? vsdev :
+					vs_dev_locked(vsdev->peer_index);
+		if (rcu_access_pointer(tap->devs[x]->tap))
+			ret = -EBUSY;
+	}
+	if (ret < 0)
+		goto unlock;
+
+	spin_lock_init(&tap->lock);
+	init_waitqueue_head(&tap->wait);
+	tap->hdr = hdr;
+	tap->data = (unsigned char *)hdr + PAGE_SIZE;
+	tap->data_size = req->ring_size;
+	tap->map_size = map_size;
+	tap->ndevs = n;
+
+	for (x = 0; x < n; x++) {
+		kref_get(&tap->devs[x]->kref);
+		rcu_assign_pointer(tap->devs[x]->tap, tap);
+	}
 
-		if (data[37] != '#')
-			goto fail_arg;
+	/* mmap() and poll() look at the tap without adaptlock */
+	smp_store_release(&file->private_data, tap);
 
-		if (is_loopback != 1) {
-			/* rts mappings (dev2) */
-			if ((data[38] != '7') || (data[39] != '-')) {
-				ret = -EINVAL;
-				goto fail_arg;
-			}
-			ret = vs_extract_pin_mapping(data, 40);
-			if (ret < 0)
-				goto fail_arg;
-			vdev2rts = ret;
+unlock:
+	mutex_unlock(&adaptlock);
+	if (ret < 0) {
+		kfree(tap);
+		vfree(hdr);
+		return ret;
+	}
 
-			/* dtr mapping (dev2) */
-			if ((data[47] != '#') || (data[48] != '4') || (data[49] != '-'))
-				goto fail_arg;
+	req->map_size = map_size;
+	return 0;
+}
 
-			ret = vs_extract_pin_mapping(data, 50);
-			if (ret < 0)
-				goto fail_arg;
-			vdev2dtr = ret;
+static int vs_ioc_tap_attach(struct file *file,
+				struct vs_tap_attach __user *argp)
+{
+	int ret;
+	struct vs_tap_attach req;
 
-			if (data[57] != '#')
-				goto fail_arg;
-		}
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
 
-		/*
-		 * Create serial port (tty device) with lock taken to ensure
-		 * correctness of index in use and associated data.
-		 */
-		mutex_lock(&adaptlock);
+	ret = vs_tap_attach(file, &req);
+	if (ret < 0)
+		return ret;
 
-		i = -1;
-		if (vdev1idx == -1) {
-			for (x = 0; x < max_num_vs_dev; x++) {
-				if (db[x].index == -1) {
-					i = x;
-					break;
-				}
-			}
-		} else {
-			if (db[vdev1idx].index == -1) {
-				i = vdev1idx;
-			} else {
-				ret = -EEXIST;
-				mutex_unlock(&adaptlock);
-				goto fail_arg;
-			}
-		}
-		if (i == -1) {
-			ret = -ENOMEM;
-			mutex_unlock(&adaptlock);
-			goto fail_arg;
-		}
+	if (copy_to_user(argp, &req, sizeof(req)))
+		return -EFAULT;
 
-		/* Initialize meta information and create 1st serial port */
-		if (data[58] == 'y')
-			vsdev1->set_odtr_at_open = 1;
-		else
-			vsdev1->set_odtr_at_open = 0;
-		vsdev1->own_tty = NULL;
-		vsdev1->peer_tty = NULL;
-		vsdev1->own_index = i;
-		vsdev1->peer_index = i;
-		vsdev1->rts_mappings = vdev1rts;
-		vsdev1->dtr_mappings = vdev1dtr;
-		vsdev1->msr_reg = 0;
-		vsdev1->mcr_reg = 0;
-		vsdev1->waiting_msr_chg = 0;
-		vsdev1->tx_paused = 0;
-		vsdev1->faulty_cable = 0;
-		db[i].index = i;
-		db[i].vsdev = vsdev1;
-		mutex_init(&vsdev1->lock);
-
-		if (is_loopback != 1) {
-			y = -1;
-			if (vdev2idx == -1) {
-				for (x = 0; x < max_num_vs_dev; x++) {
-					if (db[x].index == -1) {
-						y = x;
-						break;
-					}
-				}
-			} else {
-				if (db[vdev2idx].index == -1) {
-					y = vdev2idx;
-				} else {
-					ret = -EEXIST;
-					mutex_unlock(&adaptlock);
-					goto fail_arg;
-				}
-			}
-			if (y == -1) {
-				ret = -ENOMEM;
-				mutex_unlock(&adaptlock);
-				goto fail_arg;
-			}
+	return 0;
+}
 
-			/*
-			 * Initialize meta information and create second
-			 * serial port.
-			 */
-			if (data[60] == 'y')
-				vsdev2->set_odtr_at_open = 1;
-			else
-				vsdev2->set_odtr_at_open = 0;
-			vsdev2->set_pdtr_at_open = vsdev1->set_odtr_at_open;
-			vsdev1->set_pdtr_at_open = vsdev2->set_odtr_at_open;
-			vsdev1->own_index = i;
-			vsdev1->peer_index = y;
-			vsdev2->own_index = y;
-			vsdev2->peer_index = i;
-			vsdev2->own_tty = NULL;
-			vsdev2->peer_tty = NULL;
-			vsdev2->rts_mappings = vdev2rts;
-			vsdev2->dtr_mappings = vdev2dtr;
-			vsdev2->msr_reg = 0;
-			vsdev2->mcr_reg = 0;
-			vsdev2->waiting_msr_chg = 0;
-			vsdev2->tx_paused = 0;
-			vsdev2->faulty_cable = 0;
-			db[y].index = y;
-			db[y].vsdev = vsdev2;
-			mutex_init(&vsdev2->lock);
-		}
-
-		device1 = tty_register_device(ttyvs_driver, i, NULL);
-		if (device1 == NULL) {
-			ret = -ENOMEM;
-			mutex_unlock(&adaptlock);
-			goto fail_arg;
-		}
+/*
+ * Detaches the given tap from its devices and releases it. Invoked
+ * when the file owning the tap is closed, which also means that the
+ * ring is not mapped anymore.
+ */
+static void vs_tap_free(struct vs_tap *tap)
+{
+	int x;
 
-		vsdev1->device = device1;
-		dev_set_drvdata(device1, vsdev1);
+	mutex_lock(&adaptlock);
+	for (x = 0; x < tap->ndevs; x++)
+		RCU_INIT_POINTER(tap->devs[x]->tap, NULL);
+	mutex_unlock(&adaptlock);
 
-		x = sysfs_create_group(&device1->kobj, &vs_info_attr_group);
-		if (x < 0) {
-			tty_unregister_device(ttyvs_driver, i);
-			mutex_unlock(&adaptlock);
-			goto fail_arg;
-		}
+	/* wait for records being written */
+	synchronize_rcu();
 
-		if (is_loopback != 1) {
-			device2 = tty_register_device(ttyvs_driver, y, NULL);
-			if (device2 == NULL) {
-				ret = -ENOMEM;
-				mutex_unlock(&adaptlock);
-				goto fail_register;
-			}
+	for (x = 0; x < tap->ndevs; x++)
+		kref_put(&tap->devs[x]->kref, vs_dev_release);
+	vfree(tap->hdr);
+	kfree(tap);
+}
 
-			vsdev2->device = device2;
-			dev_set_drvdata(device2, vsdev2);
+/* Maps header page and ring of the tap attached with this file */
+static int vs_card_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct vs_tap *tap = smp_load_acquire(&file->private_data);
 
-			x = sysfs_create_group(&device2->kobj, &vs_info_attr_group);
-			if (x < 0) {
-				tty_unregister_device(ttyvs_driver, y);
-				db[y].index = -1;
-				mutex_unlock(&adaptlock);
-				goto fail_register;
-			}
+	if (tap == NULL)
+		return -ENODEV;
 
-			last_nmdev1_idx = i;
-			last_nmdev2_idx = y;
-			++total_nm_pair;
-
-			if ((vsdev1->dtr_mappings != (VS_CON_DSR | VS_CON_DCD))
-					|| (vsdev1->rts_mappings != VS_CON_CTS)
-					|| (vsdev1->set_odtr_at_open != 1)
-					|| (vsdev2->dtr_mappings != (VS_CON_DSR | VS_CON_DCD))
-					|| (vsdev2->rts_mappings != VS_CON_CTS)
-					|| (vsdev2->set_odtr_at_open != 1)) {
-				vsdev1->odevtyp = VS_CNM;
-				vsdev2->odevtyp = VS_CNM;
-			} else {
-				vsdev1->odevtyp = VS_SNM;
-				vsdev2->odevtyp = VS_SNM;
-			}
-		} else {
-			last_lbdev_idx = i;
-			++total_lb_devs;
-
-			/* device type */
-			if ((vsdev1->dtr_mappings != (VS_CON_DSR | VS_CON_DCD))
-					|| (vsdev1->rts_mappings != VS_CON_CTS)
-					|| (vsdev1->set_odtr_at_open != 1)) {
-				vsdev1->odevtyp = VS_CLB;
-			} else {
-				vsdev1->odevtyp = VS_SLB;
-			}
-		}
+	if ((vma->vm_pgoff != 0) ||
+			(vma->vm_end - vma->vm_start != tap->map_size))
+		return -EINVAL;
 
-		mutex_unlock(&adaptlock);
-	} else {
-		/* Destroy device command sent */
-		if ((total_nm_pair <= 0) && (total_lb_devs <= 0))
-			return length;
+	return remap_vmalloc_range(vma, tap->hdr, 0);
+}
 
-		/*
-		 * An application may forget to close serial port or it might
-		 * have been crashed resulting in unclosed port and hence
-		 * leaked resources. We handle such scenarios as disconnected
-		 * event as done in case of a plug and play for example usb
-		 * device. Application is running, port is opened and then
-		 * suddenly user removes tty device.
-		 */
-		if (data[8] == 'x') {
+/* Reports if the tap attached with this file has records to read */
+static __poll_t vs_card_poll(struct file *file, poll_table *wait)
+{
+	struct vs_tap *tap = smp_load_acquire(&file->private_data);
 
-			/* Delete all virtual devices */
+	if (tap == NULL)
+		return EPOLLERR;
 
-			mutex_lock(&adaptlock);
+	poll_wait(file, &tap->wait, wait);
 
-			/* First tty must be released and than port. */
-			for (x = 0; x < max_num_vs_dev; x++) {
-				if (db[x].index != -1) {
-
-					vsdev1 = db[x].vsdev;
-					if (vsdev1 != NULL) {
-						sysfs_remove_group(&vsdev1->device->kobj,
-									&vs_info_attr_group);
-						if (vsdev1->own_tty && vsdev1->own_tty->port) {
-							tty = tty_port_tty_get(vsdev1->own_tty->port);
-							if (tty) {
-								tty_vhangup(tty);
-								tty_kref_put(tty);
-							}
-						}
-						tty_unregister_device(ttyvs_driver, db[x].index);
-						kfree(db[x].vsdev);
-					}
-					db[x].index = -1;
-				}
-			}
+	if (READ_ONCE(tap->hdr->tail) != smp_load_acquire(&tap->hdr->head))
+		return EPOLLIN | EPOLLRDNORM;
 
-			total_nm_pair = 0;
-			total_lb_devs = 0;
-			last_lbdev_idx  = -1;
-			last_nmdev1_idx = -1;
-			last_nmdev2_idx = -1;
+	return 0;
+}
 
-			mutex_unlock(&adaptlock);
-		} else {
-			/* Delete a specific virtual device */
-			x = 4;
-			memset(tmp, '\0', sizeof(tmp));
-			i = 0;
-			for (i = 0; i < 5; i++) {
-				tmp[i] = data[x];
-				x++;
-			}
+/*
+ * Gives queued events as whole struct vs_evt records, waits for one
+ * unless the channel was opened non blocking.
+ */
+static ssize_t vs_evt_read(struct file *file, char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+	size_t done = 0;
+	struct vs_evt ev;
+	struct vs_evt_chan *ch = file->private_data;
 
-			x = -1;
-			y = -1;
+	if (count < sizeof(struct vs_evt))
+		return -EINVAL;
 
-			ret = kstrtouint(tmp, 10, &vdev1idx);
-			if (ret != 0)
-				return ret;
+	if (mutex_lock_interruptible(&ch->read_lock))
+		return -ERESTARTSYS;
 
-			if ((vdev1idx >= 0) && (vdev1idx <= 65535) && (db[vdev1idx].index != -1)) {
-				mutex_lock(&adaptlock);
-
-				x = db[vdev1idx].index;
-				vsdev1 = db[x].vsdev;
-				sysfs_remove_group(&vsdev1->device->kobj, &vs_info_attr_group);
-				tty_unregister_device(ttyvs_driver, db[x].index);
-				if (vsdev1 && vsdev1->own_tty && vsdev1->own_tty->port) {
-					tty = tty_port_tty_get(vsdev1->own_tty->port);
-					if (tty) {
-						tty_vhangup(tty);
-						tty_kref_put(tty);
-					}
-				}
-
-				if (vsdev1->own_index != vsdev1->peer_index) {
-					y = db[vsdev1->peer_index].index;
-					vsdev2 = db[y].vsdev;
-					sysfs_remove_group(&vsdev2->device->kobj, &vs_info_attr_group);
-					tty_unregister_device(ttyvs_driver, db[y].index);
-					if (vsdev2 && vsdev2->own_tty && vsdev2->own_tty->port) {
-						tty = tty_port_tty_get(vsdev2->own_tty->port);
-						if (tty) {
-							tty_vhangup(tty);
-							tty_kref_put(tty);
-						}
-					}
-				}
-
-				if (x != -1) {
-					kfree(db[x].vsdev);
-					db[x].index = -1;
-				}
-				if (y != -1) {
-					kfree(db[y].vsdev);
-					db[y].index = -1;
-					--total_nm_pair;
-				} else {
-					--total_lb_devs;
-				}
-
-				mutex_unlock(&adaptlock);
+	spin_lock_irq(&ch->lock);
+	while (ch->head == ch->tail) {
+		spin_unlock_irq(&ch->lock);
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		ret = wait_event_interruptible(ch->wait,
+				READ_ONCE(ch->head) != READ_ONCE(ch->tail));
+		if (ret)
+			goto out;
+		spin_lock_irq(&ch->lock);
+	}
 
-			} else {
-				return -EINVAL;
-			}
+	/*
+	 * Record stays queued until it reached user space, a fault leaves it
+	 * for the next read. Producer never moves 'tail' and never writes
+	 * the slot at 'tail' while it is queued.
+	 */
+	while ((ch->head != ch->tail) && (count - done >= sizeof(ev))) {
+		ev = ch->ring[ch->tail & (ch->size - 1)];
+		spin_unlock_irq(&ch->lock);
+		if (copy_to_user(buf + done, &ev, sizeof(ev))) {
+			ret = done ? done : -EFAULT;
+			goto out;
 		}
+		done += sizeof(ev);
+		spin_lock_irq(&ch->lock);
+		ch->tail++;
 	}
+	spin_unlock_irq(&ch->lock);
+	ret = done;
 
-	return length;
+out:
+	mutex_unlock(&ch->read_lock);
+	return ret;
+}
 
-fail_register:
-	sysfs_remove_group(&device1->kobj, &vs_info_attr_group);
-	tty_unregister_device(ttyvs_driver, i);
+static __poll_t vs_evt_poll(struct file *file, poll_table *wait)
+{
+	struct vs_evt_chan *ch = file->private_data;
+
+	poll_wait(file, &ch->wait, wait);
 
-fail_arg:
-	db[i].index = -1;
+	if (READ_ONCE(ch->head) != READ_ONCE(ch->tail))
+		return EPOLLIN | EPOLLRDNORM;
 
-	if (vsdev2 != NULL)
-		kfree(vsdev2);
+	return 0;
+}
 
-	if (vsdev1 != NULL)
-		kfree(vsdev1);
+static int vs_evt_release(struct inode *inode, struct file *file)
+{
+	struct vs_evt_chan *ch = file->private_data;
 
-	return ret;
+	mutex_lock(&adaptlock);
+	list_del_rcu(&ch->node);
+	mutex_unlock(&adaptlock);
+
+	/* wait for events being queued */
+	synchronize_rcu();
+	kvfree(ch);
+	return 0;
 }
 
+static const struct file_operations vs_evt_fops = {
+	.owner   = THIS_MODULE,
+	.read    = vs_evt_read,
+	.poll    = vs_evt_poll,
+	.release = vs_evt_release,
+	.llseek  = noop_llseek,
+};
+
 /*
- * Gives next available index and last used index for virtual
- * tty devices created.
- * $ head -c 52 /proc/vs_vmpscrdk
+ * Opens an event channel as a new file descriptor. Once the channel
+ * is on vs_evt_chans its file owns it, so failures after that point
+ * release the file instead of the channel.
  */
-static ssize_t vs_card_read(struct file *file,
-				char __user *buf, size_t size, loff_t *ppos)
+static int vs_ioc_evt_open(struct vs_evt_open __user *argp)
 {
-	int x = 0;
-	int ret = 0;
-	int val = 0;
-	char data[64];
-	int first_avail_idx = -1;
-	int second_avail_idx = -1;
-	struct vs_dev *lbvsdev = NULL;
-	struct vs_dev *nm1vsdev = NULL;
-	struct vs_dev *nm2vsdev = NULL;
+	int fd, ret;
+	u32 size;
+	struct file *file;
+	struct vs_evt_open req;
+	struct vs_evt_chan *ch;
 
-	memset(data, '\0', 64);
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
 
-	if (size != 52)
+	size = req.queue_len ? req.queue_len : VS_EVT_QUEUE_LEN;
+	if ((req.first > req.last) || (size > VS_EVT_QUEUE_MAX) ||
+			!is_power_of_2(size) ||
+			(req.flags & ~(O_NONBLOCK | O_CLOEXEC)))
 		return -EINVAL;
 
-	mutex_lock(&adaptlock);
+	ch = kvzalloc(struct_size(ch, ring, size), GFP_KERNEL);
+	if (ch == NULL)
+		return -ENOMEM;
 
-	/* Find next available free index */
-	for (x = 0; x < max_num_vs_dev; x++) {
-		if (db[x].index == -1) {
-			if (first_avail_idx == -1) {
-				first_avail_idx = x;
-			} else {
-				second_avail_idx = x;
-				break;
-			}
-		}
+	spin_lock_init(&ch->lock);
+	mutex_init(&ch->read_lock);
+	init_waitqueue_head(&ch->wait);
+	ch->first = req.first;
+	ch->last = req.last;
+	ch->mask = req.mask ? req.mask : ~0U;
+	ch->size = size;
+
+	fd = get_unused_fd_flags(req.flags & O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto fail_fd;
 	}
 
-	if ((first_avail_idx != -1) && (second_avail_idx != -1))
-		val = 2;
-	else if ((first_avail_idx != -1) && (second_avail_idx == -1))
-		val = 1;
-	else if ((first_avail_idx == -1) && (second_avail_idx == -1))
-		val = 0;
-
-	if (last_lbdev_idx == -1) {
-		if (last_nmdev1_idx == -1) {
-			snprintf(data, 64,
-				"xxxxx#xxxxx-xxxxx#%05d-%05d#%d#x-x#x-x#x-x#x#x#x\r\n",
-				first_avail_idx, second_avail_idx, val);
-		} else {
-			nm1vsdev = db[last_nmdev1_idx].vsdev;
-			nm2vsdev = db[last_nmdev2_idx].vsdev;
-			snprintf(data, 64,
-				"xxxxx#%05d-%05d#%05d-%05d#%d#x-x#%d-%d#%d-%d#x#%d#%d\r\n",
-				last_nmdev1_idx, last_nmdev2_idx, first_avail_idx,
-				second_avail_idx, val, nm1vsdev->rts_mappings,
-				nm1vsdev->dtr_mappings, nm2vsdev->rts_mappings,
-				nm2vsdev->dtr_mappings, nm1vsdev->set_odtr_at_open,
-				nm2vsdev->set_odtr_at_open);
-		}
-	} else {
-		if (last_nmdev1_idx == -1) {
-			lbvsdev = db[last_lbdev_idx].vsdev;
-			snprintf(data, 64,
-				"%05d#xxxxx-xxxxx#%05d-%05d#%d#%d-%d#x-x#x-x#%d#x#x\r\n",
-				last_lbdev_idx, first_avail_idx,
-				second_avail_idx, val, lbvsdev->rts_mappings,
-				lbvsdev->dtr_mappings, lbvsdev->set_odtr_at_open);
-		} else {
-			lbvsdev = db[last_lbdev_idx].vsdev;
-			nm1vsdev = db[last_nmdev1_idx].vsdev;
-			nm2vsdev = db[last_nmdev2_idx].vsdev;
-			snprintf(data, 64,
-				"%05d#%05d-%05d#%05d-%05d#%d#%d-%d#%d-%d#%d-%d#%d#%d#%d\r\n",
-				last_lbdev_idx, last_nmdev1_idx,
-				last_nmdev2_idx, first_avail_idx, second_avail_idx,
-				val, lbvsdev->rts_mappings, lbvsdev->dtr_mappings,
-				nm1vsdev->rts_mappings, nm1vsdev->dtr_mappings,
-				nm2vsdev->rts_mappings, nm2vsdev->dtr_mappings,
-				lbvsdev->set_odtr_at_open, nm1vsdev->set_odtr_at_open,
-				nm2vsdev->set_odtr_at_open);
-		}
+	file = anon_inode_getfile("[ttyvs_evt]", &vs_evt_fops, ch,
+				O_RDONLY | (req.flags & O_NONBLOCK));
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto fail_file;
 	}
 
+	mutex_lock(&adaptlock);
+	list_add_tail_rcu(&ch->node, &vs_evt_chans);
 	mutex_unlock(&adaptlock);
 
-	ret = copy_to_user(buf, &data, 52);
-	if (ret)
+	req.fd = fd;
+	if (copy_to_user(argp, &req, sizeof(req))) {
+		fput(file);
+		put_unused_fd(fd);
 		return -EFAULT;
+	}
 
-	return 52;
+	fd_install(fd, file);
+	return 0;
+
+fail_file:
+	put_unused_fd(fd);
+fail_fd:
+	kvfree(ch);
+	return ret;
+}
+
+/*
+ * Binary control interface of the virtual card, see ttyvs.h. Does
+ * the same job as text commands written to /dev/ttyvs_card without
+ * formatting or parsing strings.
+ */
+static long vs_card_ioctl(struct file *file,
+				unsigned int cmd, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case VS_IOC_GET_VERSION:
+		return put_user((__u32)VS_IOC_ABI_VERSION, (__u32 __user *)argp);
+	case VS_IOC_CREATE:
+		return vs_ioc_create(argp);
+	case VS_IOC_DELETE:
+		return vs_ioc_delete(argp);
+	case VS_IOC_QUERY:
+		return vs_ioc_query(argp);
+	case VS_IOC_ENUM:
+		return vs_ioc_enum(argp, 0);
+	case VS_IOC_GET_STATS:
+		return vs_ioc_get_stats(argp);
+	case VS_IOC_ENUM_STATS:
+		return vs_ioc_enum(argp, 1);
+	case VS_IOC_TAP_ATTACH:
+		return vs_ioc_tap_attach(file, argp);
+	case VS_IOC_EVT_OPEN:
+		return vs_ioc_evt_open(argp);
+	}
+
+	return -ENOTTY;
 }
 
-/* Always return success as we don't have anything needed here */
+/*
+ * misc_open() has set private_data to the misc device, while in this
+ * driver private_data of a card file holds the tap attached through
+ * it, if any.
+ */
 static int vs_card_open(struct inode *inode, struct  file *file)
 {
+	file->private_data = NULL;
 	return 0;
 }
+
+/* Releases the tap if one was attached using this file */
 static int vs_card_close(struct inode *inode, struct file *file)
 {
+	if (file->private_data)
+		vs_tap_free(file->private_data);
 	return 0;
 }
 
+#ifdef TTYVS_KUNIT
+#include "ttyvs_kunit.c"
+#endif
+
 static const struct tty_operations vs_serial_ops = {
 	.install	     = vs_install,
 	.cleanup	     = vs_cleanup,
@@ -2069,6 +5841,7 @@ static const struct tty_operations vs_serial_ops = {
 	.tiocmget	     = vs_tiocmget,
 	.tiocmset	     = vs_tiocmset,
 	.get_icount      = vs_get_icount,
+	.proc_show       = vs_proc_show,
 };
 
 static const struct file_operations vs_vcard_fops = {
@@ -2077,17 +5850,307 @@ static const struct file_operations vs_vcard_fops = {
 	.release = vs_card_close,
 	.read   = vs_card_read,
 	.write   = vs_card_write,
+	.unlocked_ioctl = vs_card_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.mmap    = vs_card_mmap,
+	.poll    = vs_card_poll,
+};
+
+/* Fills topology record of the given device. Caller holds adaptlock. */
+static void vs_topo_fill(const struct vs_dev *vsdev, struct vs_topo_rec *rec)
+{
+	u16 kind, flags = 0;
+
+	if (vsdev->bus)
+		kind = VS_IOC_BUS;
+	else if (vsdev->peer_index == vsdev->own_index)
+		kind = VS_IOC_LOOPBACK;
+	else
+		kind = VS_IOC_NULL_MODEM;
+
+	if (vsdev->set_odtr_at_open)
+		flags |= VS_IOC_F_DTR_AT_OPEN;
+	if (vsdev->bus && vsdev->bus->collision_detect)
+		flags |= VS_IOC_F_BUS_COLLISION;
+
+	memset(rec, 0, sizeof(struct vs_topo_rec));
+	rec->index = cpu_to_le32(vsdev->own_index);
+	rec->peer = cpu_to_le32(vs_peer_index(vsdev));
+	rec->kind = cpu_to_le16(kind);
+	rec->flags = cpu_to_le16(flags);
+	rec->rts_map = vsdev->rts_mappings;
+	rec->dtr_map = vsdev->dtr_mappings;
+}
+
+/*
+ * Copies the part of 'len' bytes at 'src', which lie at offset 'pos'
+ * of the blob, falling in the window of 'count' bytes at 'off' the
+ * reader asked for. Advances 'pos' past them.
+ */
+static void vs_topo_put(char *buf, loff_t off, size_t count, loff_t *pos,
+			const void *src, size_t len)
+{
+	loff_t from = max_t(loff_t, off, *pos);
+	loff_t to = min_t(loff_t, off + count, *pos + len);
+
+	if (from < to)
+		memcpy(buf + (from - off), (const char *)src + (from - *pos),
+				to - from);
+	*pos += len;
+}
+
+/*
+ * Gives current topology of the card, see struct vs_topo_hdr, to be
+ * restored at next load through the 'topology' module parameter:
+ * $ cat /sys/class/misc/ttyvs_card/topology > /lib/firmware/ttyvs.topo
+ * $ insmod ./ttyvs.ko topology=ttyvs.topo
+ *
+ * Blob is read in page sized pieces; devices created or deleted while
+ * it is being read give an inconsistent blob.
+ */
+static ssize_t topology_read(struct file *filp, struct kobject *kobj,
+			struct bin_attribute *attr, char *buf,
+			loff_t off, size_t count)
+{
+	int x;
+	loff_t total, pos = 0;
+	unsigned int n;
+	struct vs_topo_hdr hdr;
+	struct vs_topo_rec rec;
+
+	mutex_lock(&adaptlock);
+
+	n = bitmap_weight(vs_idx_map, max_num_vs_dev);
+	total = sizeof(hdr) + (loff_t)n * sizeof(rec);
+	if (off >= total) {
+		mutex_unlock(&adaptlock);
+		return 0;
+	}
+	count = min_t(loff_t, count, total - off);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = cpu_to_le32(VS_TOPO_MAGIC);
+	hdr.version = cpu_to_le16(VS_TOPO_VERSION);
+	hdr.rec_size = cpu_to_le16(sizeof(rec));
+	hdr.count = cpu_to_le32(n);
+	vs_topo_put(buf, off, count, &pos, &hdr, sizeof(hdr));
+
+	/* records before the window are only counted */
+	for_each_set_bit(x, vs_idx_map, max_num_vs_dev) {
+		if (pos >= off + (loff_t)count)
+			break;
+		if (pos + (loff_t)sizeof(rec) <= off) {
+			pos += sizeof(rec);
+			continue;
+		}
+		vs_topo_fill(vs_dev_locked(x), &rec);
+		vs_topo_put(buf, off, count, &pos, &rec, sizeof(rec));
+	}
+
+	mutex_unlock(&adaptlock);
+	return count;
+}
+static BIN_ATTR_RO(topology, 0);
+
+static struct bin_attribute *vs_card_bin_attrs[] = {
+	&bin_attr_topology,
+	NULL,
+};
+
+static const struct attribute_group vs_card_attr_group = {
+	.bin_attrs = vs_card_bin_attrs,
+};
+
+static const struct attribute_group *vs_card_attr_groups[] = {
+	&vs_card_attr_group,
+	NULL,
 };
 
 static struct miscdevice ttyvs_card_dev = {
 	.minor		= 0,
 	.name		= "ttyvs_card",
 	.fops		= &vs_vcard_fops,
+	.groups		= vs_card_attr_groups,
 };
 
+/*
+ * Creates all the devices described by the given topology blob in
+ * one pass. Blob is checked completely before anything is created;
+ * if creation fails midway, devices created so far are destroyed.
+ * Caller holds adaptlock and no device exists yet.
+ */
+static int vs_topo_load_locked(const u8 *data, size_t size)
+{
+	int ret = -EINVAL;
+	int x, m;
+	unsigned int i, n, idx, peer, kind, flags, valid;
+	/* record number + 1 of each index, 0 if not described */
+	unsigned int *slot = NULL;
+	/* links members of a bus to the next one, from its first member */
+	unsigned int *link = NULL;
+	int *member_idx = NULL;
+	const struct vs_topo_hdr *hdr = (const struct vs_topo_hdr *)data;
+	const struct vs_topo_rec *rec, *r, *p;
+	struct vs_spec spec;
+
+	if (size < sizeof(struct vs_topo_hdr))
+		return -EINVAL;
+	n = le32_to_cpu(hdr->count);
+	if ((le32_to_cpu(hdr->magic) != VS_TOPO_MAGIC)
+			|| (le16_to_cpu(hdr->version) != VS_TOPO_VERSION)
+			|| (le16_to_cpu(hdr->rec_size) != sizeof(*rec))
+			|| (n > max_num_vs_dev)
+			|| (size < sizeof(*hdr) + (size_t)n * sizeof(*rec)))
+		return -EINVAL;
+	rec = (const struct vs_topo_rec *)(hdr + 1);
+
+	slot = kvcalloc(max_num_vs_dev, sizeof(unsigned int), GFP_KERNEL);
+	link = kvcalloc(n + 1, sizeof(unsigned int), GFP_KERNEL);
+	member_idx = kvcalloc(n + 1, sizeof(int), GFP_KERNEL);
+	if (!slot || !link || !member_idx) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		idx = le32_to_cpu(rec[i].index);
+		if ((idx >= max_num_vs_dev) || slot[idx])
+			goto out;
+		slot[idx] = i + 1;
+	}
+
+	/* backwards so that members get chained in record order */
+	for (i = n; i-- > 0; ) {
+		r = &rec[i];
+		idx = le32_to_cpu(r->index);
+		peer = le32_to_cpu(r->peer);
+		kind = le16_to_cpu(r->kind);
+		flags = le16_to_cpu(r->flags);
+
+		valid = VS_IOC_F_DTR_AT_OPEN;
+		if (kind == VS_IOC_BUS)
+			valid |= VS_IOC_F_BUS_COLLISION;
+		if (r->reserved || vs_ioc_check_end(r->rts_map, r->dtr_map,
+					flags, valid) < 0)
+			goto out;
+
+		if (kind == VS_IOC_LOOPBACK) {
+			if (peer != idx)
+				goto out;
+			continue;
+		}
+		if ((kind != VS_IOC_NULL_MODEM) && (kind != VS_IOC_BUS))
+			goto out;
+		if ((peer >= max_num_vs_dev) || !slot[peer])
+			goto out;
+
+		p = &rec[slot[peer] - 1];
+		if (le16_to_cpu(p->kind) != kind)
+			goto out;
+		if (kind == VS_IOC_NULL_MODEM) {
+			if ((peer == idx) || (le32_to_cpu(p->peer) != idx))
+				goto out;
+		} else if (peer != idx) {
+			/* first member of a bus is its own peer */
+			if (le32_to_cpu(p->peer) != peer)
+				goto out;
+			link[i] = link[slot[peer] - 1];
+			link[slot[peer] - 1] = i + 1;
+		}
+	}
+
+	/* a bus has at least 2 members */
+	for (i = 0; i < n; i++) {
+		if ((le16_to_cpu(rec[i].kind) == VS_IOC_BUS) && !link[i] &&
+				(rec[i].peer == rec[i].index))
+			goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		r = &rec[i];
+		idx = le32_to_cpu(r->index);
+		peer = le32_to_cpu(r->peer);
+		kind = le16_to_cpu(r->kind);
+		flags = le16_to_cpu(r->flags);
+
+		/* created along with its null modem peer or bus */
+		if (test_bit(idx, vs_idx_map))
+			continue;
+		if ((kind == VS_IOC_BUS) && (peer != idx))
+			continue;
+
+		memset(&spec, 0, sizeof(struct vs_spec));
+		spec.idx1 = idx;
+		spec.idx2 = -1;
+		spec.rts1 = r->rts_map;
+		spec.dtr1 = r->dtr_map;
+		spec.odtr1 = (flags & VS_IOC_F_DTR_AT_OPEN) ? 1 : 0;
+
+		if (kind == VS_IOC_LOOPBACK) {
+			spec.is_loopback = 1;
+		} else if (kind == VS_IOC_NULL_MODEM) {
+			p = &rec[slot[peer] - 1];
+			spec.idx2 = peer;
+			spec.rts2 = p->rts_map;
+			spec.dtr2 = p->dtr_map;
+			spec.odtr2 = (le16_to_cpu(p->flags) &
+					VS_IOC_F_DTR_AT_OPEN) ? 1 : 0;
+		} else {
+			m = 0;
+			for (x = link[i]; x; x = link[x - 1])
+				member_idx[m++] = le32_to_cpu(rec[x - 1].index);
+			spec.bus_members = m + 1;
+			spec.bus_collision =
+				(flags & VS_IOC_F_BUS_COLLISION) ? 1 : 0;
+			spec.member_idx = member_idx;
+		}
+
+		ret = vs_create_locked(&spec);
+		if (ret < 0) {
+			vs_destroy_all_locked();
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	kvfree(member_idx);
+	kvfree(link);
+	kvfree(slot);
+	return ret;
+}
+
+/*
+ * Restores the topology saved in the given firmware file. Devices
+ * are usually needed soon after boot, so there is no fallback to user
+ * mode helper which would wait for a missing file.
+ */
+static void vs_topo_restore(const char *name)
+{
+	int ret;
+	const struct firmware *fw;
+
+	ret = request_firmware_direct(&fw, name, ttyvs_card_dev.this_device);
+	if (ret) {
+		pr_err("Can't load topology %s %d\n", name, ret);
+		return;
+	}
+
+	mutex_lock(&adaptlock);
+	ret = vs_topo_load_locked(fw->data, fw->size);
+	mutex_unlock(&adaptlock);
+	if (ret < 0)
+		pr_err("Can't create devices of topology %s %d\n", name, ret);
+
+	release_firmware(fw);
+}
+
 static int __init ttyvs_init(void)
 {
 	int x, ret;
+	unsigned int nbits;
+	struct vs_spec spec;
 
 	/*
 	 * Causes allocation of memory for 'struct tty_port' and
@@ -2114,6 +6177,13 @@ static int __init ttyvs_init(void)
 
 	tty_set_operations(ttyvs_driver, &vs_serial_ops);
 
+	/* per CPU so that delivery can be placed on a given CPU */
+	vs_wq = alloc_workqueue("ttyvs", highpri_wq ? WQ_HIGHPRI : 0, 0);
+	if (!vs_wq) {
+		ret = -ENOMEM;
+		goto failed_wq;
+	}
+
 	ret = tty_register_driver(ttyvs_driver);
 	if (ret)
 		goto failed_register;
@@ -2131,72 +6201,91 @@ static int __init ttyvs_init(void)
 	for (x = 0; x < max_num_vs_dev;  x++)
 		db[x].index = -1;
 
+	nbits = BITS_TO_LONGS(max_num_vs_dev) * BITS_PER_LONG;
+	vs_idx_map = bitmap_zalloc(nbits, GFP_KERNEL);
+	vs_idx_full = bitmap_zalloc(BITS_TO_LONGS(max_num_vs_dev), GFP_KERNEL);
+	if (!vs_idx_map || !vs_idx_full) {
+		ret = -ENOMEM;
+		goto failed_bitmap;
+	}
+
+	/* Indexes beyond max_num_vs_dev are never available */
+	bitmap_set(vs_idx_map, max_num_vs_dev, nbits - max_num_vs_dev);
+
+	/*
+	 * Application should read/write to /dev/ttyvs_card to create/destroy
+	 * tty device and query information associated with them.
+	 */
+	ret = misc_register(&ttyvs_card_dev);
+	if (ret)
+		goto failed_bitmap;
+
+	/* Devices with fixed indexes come first, standard ones fill gaps */
+	if (topology && topology[0])
+		vs_topo_restore(topology);
+
 	/*
 	 * If module was loaded with parameters supplied, create null-modem
 	 * and loopback virtual tty devices as specified.
 	 */
 	if (((2 * init_num_nm_pair) + init_num_lb_dev) <= max_num_vs_dev) {
-		for (x = 0; x < init_num_nm_pair; x++) {
-			ret = vs_card_write(NULL, NULL, 2, NULL);
+		mutex_lock(&adaptlock);
+		if (init_num_nm_pair > 0) {
+			vs_parse_create_cmd(vs_std_nm_cmd, &spec);
+			ret = vs_create_bulk_locked(&spec, init_num_nm_pair);
 			if (ret < 0)
-				pr_err("Can't create null modem pair %d\n", ret);
+				pr_err("Can't create null modem pairs %d\n", ret);
 		}
-		for (x = 0; x < init_num_lb_dev; x++) {
-			ret = vs_card_write(NULL, NULL, 3, NULL);
+		if (init_num_lb_dev > 0) {
+			vs_parse_create_cmd(vs_std_lb_cmd, &spec);
+			ret = vs_create_bulk_locked(&spec, init_num_lb_dev);
 			if (ret < 0)
-				pr_err("Can't create loop back device %d\n", ret);
+				pr_err("Can't create loop back devices %d\n", ret);
 		}
+		mutex_unlock(&adaptlock);
 	} else {
 		pr_err("Specified devices not created. Invalid total.\n");
 	}
 
-	/*
-	 * Application should read/write to /dev/ttyvs_card to create/destroy
-	 * tty device and query information associated with them.
-	 */
-	ret = misc_register(&ttyvs_card_dev);
-	if (ret)
-		goto failed_card;
-
 	pr_info("serial port null modem emulation driver\n");
+
+#ifdef TTYVS_KUNIT
+	vs_kunit_run();
+#endif
 	return 0;
 
-failed_card:
+failed_bitmap:
+	bitmap_free(vs_idx_full);
+	bitmap_free(vs_idx_map);
 	kfree(db);
 failed_alloc:
 	tty_unregister_driver(ttyvs_driver);
 failed_register:
+	destroy_workqueue(vs_wq);
+failed_wq:
 	put_tty_driver(ttyvs_driver);
 	return ret;
 }
 
 static void __exit ttyvs_exit(void)
 {
-	int x;
-	struct vs_dev *vsdev;
-	struct tty_struct *tty;
-
+#ifdef TTYVS_KUNIT
+	vs_kunit_exit();
+#endif
 	misc_deregister(&ttyvs_card_dev);
 
-	for (x = 0; x < max_num_vs_dev; x++) {
-		if (db[x].index != -1) {
-			vsdev = db[x].vsdev;
-			sysfs_remove_group(&vsdev->device->kobj,
-						&vs_info_attr_group);
-			tty_unregister_device(ttyvs_driver, db[x].index);
-			if (vsdev && vsdev->own_tty && vsdev->own_tty->port) {
-				tty = tty_port_tty_get(vsdev->own_tty->port);
-				if (tty) {
-					tty_vhangup(tty);
-					tty_kref_put(tty);
-				}
-				kfree(db[x].vsdev);
-			}
-		}
-	}
+	mutex_lock(&adaptlock);
+	vs_destroy_all_locked();
+	mutex_unlock(&adaptlock);
+
+	/* wait for devices being released after grace period */
+	rcu_barrier();
 
+	bitmap_free(vs_idx_full);
+	bitmap_free(vs_idx_map);
 	kfree(db);
 	tty_unregister_driver(ttyvs_driver);
+	destroy_workqueue(vs_wq);
 	put_tty_driver(ttyvs_driver);
 }
 
@@ -2230,6 +6319,17 @@ module_param(init_num_lb_dev, ushort, 0);
 MODULE_PARM_DESC(init_num_lb_dev,
 		"Standard loopback devices to create initially");
 
+/*
+ * Name of a firmware file holding the topology to be created, see
+ * struct vs_topo_hdr. Devices are created before those asked for by
+ * init_num_nm_pair and init_num_lb_dev:
+ * $ cat /sys/class/misc/ttyvs_card/topology > /lib/firmware/ttyvs.topo
+ * $ insmod ./ttyvs.ko topology=ttyvs.topo
+ */
+module_param(topology, charp, 0);
+MODULE_PARM_DESC(topology,
+		"Firmware file with topology to create initially");
+
 /*
  * Specifies the starting index of the tty device to be used by this
  * driver. This also becomes the first minor number (x) for the device
@@ -2239,6 +6339,10 @@ module_param(minor_begin, int, 0);
 MODULE_PARM_DESC(minor_begin,
 		"Starting minor number of device nodes");
 
+module_param(highpri_wq, bool, 0);
+MODULE_PARM_DESC(highpri_wq,
+		"Deliver data from high priority workqueue, default 0");
+
 MODULE_AUTHOR("Rishi Gupta <gupt21@gmail.com>");
 MODULE_DESCRIPTION("Serial port null modem emulation driver");
 MODULE_LICENSE("GPL v2");
@@ -0,0 +1,390 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Serial port null modem emulation driver, user space interface
+ *
+ * Copyright (c) 2020, Rishi Gupta <gupt21@gmail.com>
+ *
+ * Binary control interface of the virtual card. These ioctls are
+ * executed on /dev/ttyvs_card and work alongside the text commands
+ * written to the same node.
+ */
+
+#ifndef _UAPI_LINUX_TTYVS_H
+#define _UAPI_LINUX_TTYVS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Version of this interface as returned by VS_IOC_GET_VERSION */
+#define VS_IOC_ABI_VERSION  4
+
+/* Pin out configurations definitions (rts_map/dtr_map) */
+#define VS_CON_CTS    0x0001
+#define VS_CON_DCD    0x0002
+#define VS_CON_DSR    0x0004
+#define VS_CON_RI     0x0008
+
+/* Constants for the device type (odevtyp) */
+#define VS_SNM 0x0001
+#define VS_CNM 0x0002
+#define VS_SLB 0x0003
+#define VS_CLB 0x0004
+#define VS_BUS 0x0005
+
+/* Kind of device(s) to be created by VS_IOC_CREATE */
+#define VS_IOC_NULL_MODEM  0x0001
+#define VS_IOC_LOOPBACK    0x0002
+#define VS_IOC_BUS         0x0003
+
+/* Assert DTR when this device is opened */
+#define VS_IOC_F_DTR_AT_OPEN  0x0001
+/* Device is currently open, reported by VS_IOC_QUERY/VS_IOC_ENUM only */
+#define VS_IOC_F_OPEN         0x0002
+/* Detect collisions on RS-485 bus, valid for VS_IOC_BUS only */
+#define VS_IOC_F_BUS_COLLISION  0x0004
+
+/* Returned in vs_ioc_enum.next when there are no more devices */
+#define VS_IOC_ENUM_END    0xFFFFFFFF
+
+/* Information about one virtual tty device */
+struct vs_ioc_dev {
+	/* index of this device, ttyvsX */
+	__u32 index;
+	/*
+	 * index of the connected device, same as index for loopback,
+	 * index of the first member for RS-485 bus
+	 */
+	__u32 peer_index;
+	__u32 rts_map;
+	__u32 dtr_map;
+	/* VS_IOC_F_xxx */
+	__u32 flags;
+	/* VS_SNM, VS_CNM, VS_SLB, VS_CLB or VS_BUS */
+	__u32 type;
+};
+
+/*
+ * Creates 'count' null modem pairs or loopback devices. Element 0
+ * describes first end (or the loopback device), element 1 second
+ * end of a null modem pair. An index of -1 means first free index;
+ * fixed indexes can be given only when count is 1.
+ *
+ * For VS_IOC_BUS one RS-485 bus with 'count' (at least 2) members is
+ * created. Element 0 describes all the members; first member gets
+ * index[0] and the rest first free indexes. Index of the first member
+ * identifies the bus.
+ */
+struct vs_ioc_create {
+	/* VS_IOC_NULL_MODEM, VS_IOC_LOOPBACK or VS_IOC_BUS */
+	__u32 kind;
+	__u32 count;
+	__s32 index[2];
+	__u32 rts_map[2];
+	__u32 dtr_map[2];
+	__u32 flags[2];
+	/*
+	 * out: index of the (first) device created when count is 1,
+	 * index of the first member for VS_IOC_BUS
+	 */
+	__s32 created;
+	__u32 reserved;
+};
+
+/*
+ * Deletes all devices with index in the inclusive range 'first' to
+ * 'last' together with their peers. A 'first' of -1 deletes all the
+ * devices.
+ */
+struct vs_ioc_delete {
+	__s32 first;
+	__s32 last;
+};
+
+/*
+ * Enumerates devices in use starting at index 'start'. On input
+ * 'count' is the number of entries the array at 'devs' can hold, on
+ * output number of entries filled. 'next' gives the index to start
+ * the next call from or VS_IOC_ENUM_END.
+ */
+struct vs_ioc_enum {
+	__u32 start;
+	__u32 count;
+	__u32 next;
+	__u32 reserved;
+	/* user pointer to array of struct vs_ioc_dev */
+	__u64 devs;
+};
+
+/*
+ * Traffic counters of one device. Byte counts are exact; drop_xxx
+ * give bytes written by this device which never reached the other
+ * end and why. On an RS-485 bus drops are counted once for every
+ * member that missed the data.
+ */
+struct vs_ioc_stats {
+	/* in: index of the device, out: same */
+	__u32 index;
+	__u32 reserved;
+	/* bytes accepted from writer */
+	__u64 tx_bytes;
+	/* bytes placed into this device's receive buffer */
+	__u64 rx_bytes;
+	/* number of write() calls made on this device */
+	__u64 write_calls;
+	/* baudrate or frame format of both ends differ */
+	__u64 drop_mismatch;
+	/* faulty cable emulation active */
+	__u64 drop_faulty;
+	/* other end not open, or RS-485 driver of this device disabled */
+	__u64 drop_noreader;
+	/* receive buffer of other end full, or collision on RS-485 bus */
+	__u64 drop_overrun;
+	/* number of times this device throttled its sender */
+	__u64 throttle;
+};
+
+/*
+ * Attaches a read only tap to the given device and the device(s) it
+ * is connected to: its null modem peer or all members of its bus.
+ * Traffic in both directions and line events are recorded into a
+ * ring of 'ring_size' bytes (power of 2, from 4096 to 64 MB). The
+ * ring is mapped by calling mmap() with 'map_size' on the same file
+ * descriptor and the tap lives until that file is closed. One tap
+ * can be attached per file and per device.
+ */
+struct vs_tap_attach {
+	__u32 index;
+	__u32 ring_size;
+	/* out: length to be given to mmap() */
+	__u64 map_size;
+};
+
+/*
+ * First page of the mapping. Records start at 'data_offset' from the
+ * start of the mapping. 'head' and 'tail' are free running byte
+ * counts; the kernel advances 'head' after writing a record and the
+ * reader advances 'tail' after consuming records. Records that do
+ * not fit as reader fell behind are counted in 'lost'. poll() on the
+ * file reports EPOLLIN when head differs from tail.
+ */
+struct vs_tap_hdr {
+	__u32 version;
+	__u32 data_offset;
+	__u64 data_size;
+	__u64 head;
+	__u64 tail;
+	__u64 lost;
+};
+
+#define VS_TAP_VERSION  1
+
+/*
+ * Every record starts at a multiple of VS_TAP_ALIGN and never wraps
+ * around end of the ring; a VS_TAP_PAD record fills the space left
+ * at the end instead. Next record starts at the offset of this one
+ * plus sizeof(struct vs_tap_rec) + len rounded up to VS_TAP_ALIGN.
+ */
+struct vs_tap_rec {
+	/* CLOCK_MONOTONIC */
+	__u64 time_ns;
+	/* device which sent the data, whose lines changed or which read it */
+	__u32 index;
+	/* VS_TAP_xxx */
+	__u16 type;
+	/* bytes following this header */
+	__u16 len;
+};
+
+#define VS_TAP_ALIGN  16
+
+/* filler up to end of ring */
+#define VS_TAP_PAD    0
+/* data sent by the device, 'len' bytes */
+#define VS_TAP_DATA   1
+/* output lines of the device changed, __u32 of TIOCM_DTR/TIOCM_RTS */
+#define VS_TAP_MODEM  2
+/* break condition of the device, __u32 1 on or 0 off */
+#define VS_TAP_BREAK  3
+/*
+ * data written to the device's peer was consumed by line discipline
+ * of the device, struct vs_tap_latency; only while latency of the
+ * device is being measured (see its 'latency' sysfs attribute)
+ */
+#define VS_TAP_LATENCY  4
+
+/* CLOCK_MONOTONIC times of one write, consumed at record's time_ns */
+struct vs_tap_latency {
+	/* write() was called */
+	__u64 write_ns;
+	/* first byte reached the tty buffer of the device */
+	__u64 deliver_ns;
+};
+
+/*
+ * Opens an event channel for devices with index in the inclusive range
+ * 'first' to 'last', including devices created later in that range.
+ * Events of types set in 'mask' (VS_EVT_MASK(type), 0 for all) are
+ * queued to the new file descriptor returned in 'fd'; read() gives
+ * whole struct vs_evt records and poll()/epoll report EPOLLIN when
+ * records are queued. One thread can thus watch line events of many
+ * ports. 'queue_len' is number of records the queue holds (power of
+ * 2 up to 65536, 0 for 1024). 'flags' may have O_NONBLOCK and
+ * O_CLOEXEC. Channel is closed with close(). Current state of lines
+ * is not queued on open, use TIOCMGET for it.
+ */
+struct vs_evt_open {
+	__u32 first;
+	__u32 last;
+	__u32 mask;
+	__u32 queue_len;
+	__u32 flags;
+	/* out: file descriptor of the channel */
+	__s32 fd;
+};
+
+/* One event, 'index' is the device it happened on */
+struct vs_evt {
+	/* CLOCK_MONOTONIC */
+	__u64 time_ns;
+	__u32 index;
+	/* VS_EVT_xxx */
+	__u16 type;
+	__u16 reserved;
+	/* depends on type */
+	__u32 value;
+	/* VS_EVT_MODEM: lines which changed, TIOCM_xxx */
+	__u32 changed;
+};
+
+/* modem status inputs changed, 'value' is TIOCM_CTS/DSR/CAR/RNG now */
+#define VS_EVT_MODEM        1
+/* break received */
+#define VS_EVT_BREAK        2
+/* character received with framing error */
+#define VS_EVT_FRAME        3
+/* character received with parity error */
+#define VS_EVT_PARITY       4
+/* uart overrun, characters lost before reaching receive buffer */
+#define VS_EVT_OVERRUN      5
+/* receive buffer full, 'value' bytes dropped */
+#define VS_EVT_BUF_OVERRUN  6
+/*
+ * queue was full and 'value' events were lost, 'index' is not used;
+ * always delivered
+ */
+#define VS_EVT_LOST         7
+
+#define VS_EVT_MASK(type)   (1U << (type))
+
+/*
+ * Topology of the virtual card, all fields little endian. The module
+ * creates the devices described by the firmware file named by its
+ * 'topology' parameter when it is loaded, and gives current topology
+ * in the same format from /sys/class/misc/ttyvs_card/topology. A
+ * header is followed by 'count' records of 'rec_size' bytes, one for
+ * every device, in any order.
+ */
+struct vs_topo_hdr {
+	/* VS_TOPO_MAGIC */
+	__le32 magic;
+	/* VS_TOPO_VERSION */
+	__le16 version;
+	/* sizeof(struct vs_topo_rec) */
+	__le16 rec_size;
+	__le32 count;
+	__le32 reserved;
+};
+
+#define VS_TOPO_MAGIC    0x54535654
+#define VS_TOPO_VERSION  1
+
+struct vs_topo_rec {
+	/* index of this device, ttyvsX */
+	__le32 index;
+	/*
+	 * index of the connected device for a null modem pair, same as
+	 * index for loopback, index of the first member for RS-485 bus
+	 * (same as index for the first member itself)
+	 */
+	__le32 peer;
+	/* VS_IOC_NULL_MODEM, VS_IOC_LOOPBACK or VS_IOC_BUS */
+	__le16 kind;
+	/*
+	 * VS_IOC_F_DTR_AT_OPEN, VS_IOC_F_BUS_COLLISION; all members of a
+	 * bus take flags and pin mappings of its first member
+	 */
+	__le16 flags;
+	/* VS_CON_xxx */
+	__u8 rts_map;
+	__u8 dtr_map;
+	__le16 reserved;
+};
+
+/*
+ * Framing line discipline (ttyvs_frame.ko). These are executed on the
+ * tty device after selecting the discipline with TIOCSETD; every read()
+ * then returns one complete frame.
+ */
+
+/* frame ends at 'delim' byte which is not returned, empty frames skipped */
+#define VS_FRAME_DELIM   1
+/* frame length is given by a field in its header */
+#define VS_FRAME_LENGTH  2
+/* frame ends when line is silent for 'gap_us' (Modbus RTU) */
+#define VS_FRAME_GAP     3
+
+struct vs_frame_cfg {
+	/* VS_FRAME_xxx */
+	__u32 mode;
+	/* longest frame in bytes, 0 for 4096; longer frames are dropped */
+	__u32 max_len;
+	/* VS_FRAME_DELIM: 0x00 for COBS, 0xC0 for SLIP */
+	__u8 delim;
+	/* VS_FRAME_LENGTH: size of length field, 1, 2 or 4 bytes */
+	__u8 len_bytes;
+	/* VS_FRAME_LENGTH: length field is little endian, else big endian */
+	__u8 len_le;
+	__u8 reserved;
+	/* VS_FRAME_LENGTH: bytes in frame before length field */
+	__u32 len_offset;
+	/*
+	 * VS_FRAME_LENGTH: added to value of length field to give number
+	 * of bytes following the field, for lengths counting the header
+	 * or not counting a checksum
+	 */
+	__s32 len_adjust;
+	/* VS_FRAME_GAP: silence in microseconds, 0 for 3.5 characters */
+	__u32 gap_us;
+};
+
+/* Counters of frames received since discipline was selected */
+struct vs_frame_stats {
+	/* frames queued for reading */
+	__u64 frames;
+	/* longer than max_len */
+	__u64 too_long;
+	/* had parity, framing or break error, or invalid length field */
+	__u64 errors;
+	/* reader fell behind by more than 256 KB of frames */
+	__u64 overruns;
+};
+
+#define VS_IOC_MAGIC  0xF9
+
+#define VS_IOC_GET_VERSION  _IOR(VS_IOC_MAGIC, 0x00, __u32)
+#define VS_IOC_CREATE       _IOWR(VS_IOC_MAGIC, 0x01, struct vs_ioc_create)
+#define VS_IOC_DELETE       _IOW(VS_IOC_MAGIC, 0x02, struct vs_ioc_delete)
+#define VS_IOC_QUERY        _IOWR(VS_IOC_MAGIC, 0x03, struct vs_ioc_dev)
+#define VS_IOC_ENUM         _IOWR(VS_IOC_MAGIC, 0x04, struct vs_ioc_enum)
+#define VS_IOC_GET_STATS    _IOWR(VS_IOC_MAGIC, 0x05, struct vs_ioc_stats)
+/* same as VS_IOC_ENUM but 'devs' points to array of struct vs_ioc_stats */
+#define VS_IOC_ENUM_STATS   _IOWR(VS_IOC_MAGIC, 0x06, struct vs_ioc_enum)
+#define VS_IOC_TAP_ATTACH   _IOWR(VS_IOC_MAGIC, 0x07, struct vs_tap_attach)
+#define VS_IOC_EVT_OPEN     _IOWR(VS_IOC_MAGIC, 0x08, struct vs_evt_open)
+
+/* on a tty using the framing line discipline */
+#define VS_IOC_FRAME_SET    _IOW(VS_IOC_MAGIC, 0x20, struct vs_frame_cfg)
+#define VS_IOC_FRAME_GET    _IOR(VS_IOC_MAGIC, 0x21, struct vs_frame_cfg)
+#define VS_IOC_FRAME_STATS  _IOR(VS_IOC_MAGIC, 0x22, struct vs_frame_stats)
+
+#endif /* _UAPI_LINUX_TTYVS_H */
@@ -0,0 +1,879 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Serial port null modem emulation driver, benchmark
+ *
+ * Copyright (c) 2020, Rishi Gupta <gupt21@gmail.com>
+ *
+ * User space load generator for ttyvs. Creates null modem pairs through
+ * /dev/ttyvs_card, plays ping pong on each pair and prints aggregate
+ * throughput, round trip latency percentiles of each pair and fairness
+ * across pairs as JSON on stdout, so results of two kernels or two
+ * driver versions can be compared by a script.
+ *
+ * First end of a pair writes a message of 'size' bytes, second end
+ * echoes back whatever it reads. Round trip time of a message runs from
+ * its write() until its last byte is read back by first end. With -d
+ * more than one message per pair can be in flight (epoll model only).
+ *
+ * Models:
+ *  thread  two threads per pair, blocking read()/write()
+ *  epoll   one thread for all pairs, non-blocking I/O, level triggered
+ *
+ * $ gcc -O2 -Wall -pthread -o ttyvs_bench ttyvs_bench.c
+ * $ sudo insmod ./ttyvs.ko
+ * $ sudo ./ttyvs_bench -n 16 -s 1,64,1024 -m epoll -d 4 -t 5
+ * $ sudo ./ttyvs_bench -n 4 -s 128 -c canon -b 7 -r > result.json
+ *
+ * Created pairs are deleted when the run ends or is interrupted. Baud
+ * rate only needs to match on both ends; data is not paced to it unless
+ * 'pacing' sysfs attribute of the device is set.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+#include "ttyvs.h"
+
+#define VS_CARD      "/dev/ttyvs_card"
+#define MAX_SIZES    16
+#define MAX_DEPTH    64
+#define MAX_MSG      4096
+/* a pair with messages in flight but no progress for this long is stuck */
+#define STALL_NS     (2 * 1000000000ULL)
+#define POLL_MS      100
+
+/*
+ * Latency histogram: values below 64 ns have a bucket each, above that
+ * every power of 2 is split into 64 buckets, which keeps error within
+ * 1.6%. Values above 2^40 ns (18 minutes) land in the last bucket.
+ */
+#define HIST_SUB_BITS  6
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP   40
+#define HIST_BUCKETS   ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t max;
+	uint32_t b[HIST_BUCKETS];
+};
+
+enum { MODEL_THREAD, MODEL_EPOLL };
+
+struct pair {
+	int idx[2];
+	int fd[2];
+
+	/* first end, written by the thread driving it */
+	uint64_t started;
+	uint64_t done;
+	uint64_t rx_bytes;
+	size_t tx_off;
+	uint64_t t_send[MAX_DEPTH];
+	uint64_t last_progress;
+	int want_out;
+	int stalled;
+	struct hist lat;
+
+	/* second end, bytes read and not yet echoed */
+	size_t echo_len;
+	size_t echo_off;
+	int echo_out;
+	unsigned char echo_buf[MAX_MSG];
+
+	/* thread model */
+	pthread_t thr[2];
+	atomic_int finished;
+};
+
+struct config {
+	int pairs;
+	int model;
+	int canon;
+	int csize;
+	int crtscts;
+	int baud;
+	int depth;
+	int duration;
+	int nsizes;
+	int sizes[MAX_SIZES];
+};
+
+static struct config cfg = {
+	.pairs = 1,
+	.model = MODEL_EPOLL,
+	.csize = 8,
+	.baud = 115200,
+	.depth = 1,
+	.duration = 5,
+};
+
+static struct pair *pairs;
+static int card_fd = -1;
+static int msg_size;
+static unsigned char msg[MAX_MSG];
+static pthread_barrier_t start_barrier;
+static atomic_int stop_run;
+static volatile sig_atomic_t interrupted;
+
+static const struct {
+	int baud;
+	speed_t speed;
+} baud_tbl[] = {
+	{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+	{ 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+	{ 460800, B460800 }, { 921600, B921600 }, { 1000000, B1000000 },
+	{ 2000000, B2000000 }, { 4000000, B4000000 },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	int e, shift, i;
+
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+
+	if (v < HIST_SUB) {
+		h->b[v]++;
+		return;
+	}
+
+	e = 63 - __builtin_clzll(v);
+	if (e > HIST_MAX_EXP) {
+		h->b[HIST_BUCKETS - 1]++;
+		return;
+	}
+	shift = e - HIST_SUB_BITS;
+	i = (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+	h->b[i]++;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	int i;
+
+	to->count += from->count;
+	if (from->max > to->max)
+		to->max = from->max;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->b[i] += from->b[i];
+}
+
+/* Middle of the bucket holding the given fraction of samples */
+static uint64_t hist_pct(const struct hist *h, double p)
+{
+	uint64_t target, seen = 0;
+	int i, shift;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (uint64_t)(p * h->count);
+	if (target < p * h->count || target == 0)
+		target++;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->b[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i == HIST_BUCKETS - 1)
+		return h->max;
+	if (i < HIST_SUB)
+		return i;
+
+	shift = i / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + i % HIST_SUB) << shift)
+		+ ((1ULL << shift) >> 1);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	interrupted = 1;
+	atomic_store(&stop_run, 1);
+}
+
+static void delete_pairs(void)
+{
+	struct vs_ioc_delete del;
+	int i, j;
+
+	if (pairs == NULL)
+		return;
+
+	for (i = 0; i < cfg.pairs; i++) {
+		for (j = 0; j < 2; j++) {
+			if (pairs[i].fd[j] >= 0)
+				close(pairs[i].fd[j]);
+		}
+		if (pairs[i].idx[0] < 0)
+			continue;
+		/* deletes the peer too */
+		del.first = pairs[i].idx[0];
+		del.last = pairs[i].idx[0];
+		if (ioctl(card_fd, VS_IOC_DELETE, &del) < 0)
+			fprintf(stderr, "delete ttyvs%d: %s\n",
+					del.first, strerror(errno));
+	}
+}
+
+/* udev creates the node a little after the device is registered */
+static int open_dev(int idx)
+{
+	char path[64];
+	int fd, tries;
+
+	snprintf(path, sizeof(path), "/dev/ttyvs%d", idx);
+	for (tries = 0; tries < 200; tries++) {
+		fd = open(path, O_RDWR | O_NOCTTY);
+		if (fd >= 0 || (errno != ENOENT && errno != EACCES))
+			break;
+		usleep(10000);
+	}
+	if (fd < 0)
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+
+	return fd;
+}
+
+static int set_termios(int fd)
+{
+	struct termios t;
+	speed_t speed = B0;
+	size_t i;
+
+	for (i = 0; i < sizeof(baud_tbl) / sizeof(baud_tbl[0]); i++) {
+		if (baud_tbl[i].baud == cfg.baud)
+			speed = baud_tbl[i].speed;
+	}
+
+	if (tcgetattr(fd, &t) < 0)
+		return -1;
+
+	cfmakeraw(&t);
+	if (cfg.canon) {
+		/* lines end at '\n', no echo, signals or input mapping */
+		t.c_lflag |= ICANON;
+		t.c_lflag &= ~(ECHO | ECHONL | ISIG | IEXTEN);
+	}
+	t.c_cflag &= ~(CSIZE | CRTSCTS);
+	t.c_cflag |= (cfg.csize == 7) ? CS7 : CS8;
+	t.c_cflag |= CREAD | CLOCAL;
+	if (cfg.crtscts)
+		t.c_cflag |= CRTSCTS;
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	cfsetispeed(&t, speed);
+	cfsetospeed(&t, speed);
+
+	return tcsetattr(fd, TCSANOW, &t);
+}
+
+static int create_pairs(void)
+{
+	struct vs_ioc_create req;
+	struct vs_ioc_dev dev;
+	int i, j;
+
+	pairs = calloc(cfg.pairs, sizeof(struct pair));
+	if (pairs == NULL)
+		return -1;
+	for (i = 0; i < cfg.pairs; i++) {
+		pairs[i].idx[0] = pairs[i].idx[1] = -1;
+		pairs[i].fd[0] = pairs[i].fd[1] = -1;
+	}
+
+	for (i = 0; i < cfg.pairs; i++) {
+		/* standard null modem, RTS to CTS and DTR to DSR/DCD */
+		memset(&req, 0, sizeof(req));
+		req.kind = VS_IOC_NULL_MODEM;
+		req.count = 1;
+		for (j = 0; j < 2; j++) {
+			req.index[j] = -1;
+			req.rts_map[j] = VS_CON_CTS;
+			req.dtr_map[j] = VS_CON_DSR | VS_CON_DCD;
+			req.flags[j] = VS_IOC_F_DTR_AT_OPEN;
+		}
+		if (ioctl(card_fd, VS_IOC_CREATE, &req) < 0) {
+			fprintf(stderr, "create pair %d: %s\n",
+					i, strerror(errno));
+			return -1;
+		}
+		pairs[i].idx[0] = req.created;
+
+		memset(&dev, 0, sizeof(dev));
+		dev.index = req.created;
+		if (ioctl(card_fd, VS_IOC_QUERY, &dev) < 0) {
+			fprintf(stderr, "query ttyvs%d: %s\n",
+					req.created, strerror(errno));
+			return -1;
+		}
+		pairs[i].idx[1] = dev.peer_index;
+
+		for (j = 0; j < 2; j++) {
+			pairs[i].fd[j] = open_dev(pairs[i].idx[j]);
+			if (pairs[i].fd[j] < 0)
+				return -1;
+			if (set_termios(pairs[i].fd[j]) < 0) {
+				fprintf(stderr, "termios ttyvs%d: %s\n",
+						pairs[i].idx[j],
+						strerror(errno));
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void reset_pair(struct pair *p)
+{
+	tcflush(p->fd[0], TCIOFLUSH);
+	tcflush(p->fd[1], TCIOFLUSH);
+
+	p->started = 0;
+	p->done = 0;
+	p->rx_bytes = 0;
+	p->tx_off = 0;
+	p->want_out = 0;
+	p->stalled = 0;
+	p->echo_len = 0;
+	p->echo_off = 0;
+	p->echo_out = 0;
+	memset(&p->lat, 0, sizeof(p->lat));
+	atomic_store(&p->finished, 0);
+}
+
+/* Account bytes read back by first end, completing messages */
+static void rx_account(struct pair *p, size_t n, uint64_t t)
+{
+	p->rx_bytes += n;
+	p->last_progress = t;
+
+	while (p->rx_bytes >= (p->done + 1) * (uint64_t)msg_size) {
+		hist_add(&p->lat, t - p->t_send[p->done % cfg.depth]);
+		p->done++;
+	}
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void *thread_first(void *arg)
+{
+	struct pair *p = arg;
+	struct pollfd pfd = { .fd = p->fd[0], .events = POLLIN };
+	unsigned char buf[MAX_MSG];
+	uint64_t t;
+	ssize_t n;
+	int ret;
+
+	pthread_barrier_wait(&start_barrier);
+	p->last_progress = now_ns();
+
+	while (!atomic_load(&stop_run)) {
+		p->t_send[p->started % cfg.depth] = now_ns();
+		if (write_all(p->fd[0], msg, msg_size) < 0)
+			break;
+		p->started++;
+
+		while (p->done < p->started) {
+			ret = poll(&pfd, 1, POLL_MS);
+			t = now_ns();
+			if (ret == 0) {
+				if (t - p->last_progress > STALL_NS) {
+					p->stalled = 1;
+					goto out;
+				}
+				continue;
+			}
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				goto out;
+			}
+			n = read(p->fd[0], buf, sizeof(buf));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				goto out;
+			rx_account(p, n, now_ns());
+		}
+	}
+
+out:
+	atomic_store(&p->finished, 1);
+	return NULL;
+}
+
+static void *thread_echo(void *arg)
+{
+	struct pair *p = arg;
+	struct pollfd pfd = { .fd = p->fd[1], .events = POLLIN };
+	unsigned char buf[MAX_MSG];
+	ssize_t n;
+	int ret;
+
+	pthread_barrier_wait(&start_barrier);
+
+	while (!atomic_load(&p->finished)) {
+		ret = poll(&pfd, 1, POLL_MS);
+		if (ret <= 0)
+			continue;
+		n = read(p->fd[1], buf, sizeof(buf));
+		if (n <= 0)
+			continue;
+		if (write_all(p->fd[1], buf, n) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static int run_threads(void)
+{
+	int i, ret;
+
+	pthread_barrier_init(&start_barrier, NULL, 2 * cfg.pairs + 1);
+
+	for (i = 0; i < cfg.pairs; i++) {
+		ret = pthread_create(&pairs[i].thr[0], NULL,
+				thread_first, &pairs[i]);
+		if (ret == 0)
+			ret = pthread_create(&pairs[i].thr[1], NULL,
+					thread_echo, &pairs[i]);
+		if (ret) {
+			/* threads already waiting would never be released */
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	sleep(cfg.duration);
+	atomic_store(&stop_run, 1);
+
+	for (i = 0; i < cfg.pairs; i++) {
+		pthread_join(pairs[i].thr[0], NULL);
+		pthread_join(pairs[i].thr[1], NULL);
+	}
+
+	pthread_barrier_destroy(&start_barrier);
+	return 0;
+}
+
+static void ep_mod(int ep, struct pair *p, int end, uint32_t events)
+{
+	struct epoll_event ev = { .events = events };
+
+	ev.data.u64 = ((uint64_t)(p - pairs) << 1) | end;
+	epoll_ctl(ep, EPOLL_CTL_MOD, p->fd[end], &ev);
+}
+
+/* Keep up to 'depth' messages in flight, finishing a partial one first */
+static void ep_send(int ep, struct pair *p, int stop)
+{
+	int want_out = 0;
+	ssize_t n;
+
+	while (p->tx_off || (!stop && p->started - p->done < (uint64_t)cfg.depth)) {
+		if (p->tx_off == 0)
+			p->t_send[p->started % cfg.depth] = now_ns();
+		n = write(p->fd[0], msg + p->tx_off, msg_size - p->tx_off);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				want_out = 1;
+			break;
+		}
+		p->tx_off += n;
+		if (p->tx_off == (size_t)msg_size) {
+			p->tx_off = 0;
+			p->started++;
+		}
+	}
+
+	if (want_out != p->want_out) {
+		p->want_out = want_out;
+		ep_mod(ep, p, 0, EPOLLIN | (want_out ? EPOLLOUT : 0));
+	}
+}
+
+static void ep_echo(int ep, struct pair *p, uint32_t events)
+{
+	ssize_t n;
+
+	if (p->echo_len == 0 && (events & EPOLLIN)) {
+		n = read(p->fd[1], p->echo_buf, sizeof(p->echo_buf));
+		if (n <= 0)
+			return;
+		p->echo_len = n;
+		p->echo_off = 0;
+	}
+
+	while (p->echo_off < p->echo_len) {
+		n = write(p->fd[1], p->echo_buf + p->echo_off,
+				p->echo_len - p->echo_off);
+		if (n < 0)
+			break;
+		p->echo_off += n;
+	}
+
+	if (p->echo_off == p->echo_len)
+		p->echo_len = p->echo_off = 0;
+
+	/* stop reading until what was read has been written back */
+	if (!!p->echo_len != p->echo_out) {
+		p->echo_out = !!p->echo_len;
+		ep_mod(ep, p, 1, p->echo_out ? EPOLLOUT : EPOLLIN);
+	}
+}
+
+static int run_epoll(void)
+{
+	struct epoll_event ev, *evs;
+	uint64_t t, end_time;
+	struct pair *p;
+	int ep, i, j, n, stop, busy;
+
+	evs = calloc(2 * cfg.pairs, sizeof(struct epoll_event));
+	ep = epoll_create1(0);
+	if (evs == NULL || ep < 0) {
+		free(evs);
+		return -1;
+	}
+
+	for (i = 0; i < cfg.pairs; i++) {
+		for (j = 0; j < 2; j++) {
+			fcntl(pairs[i].fd[j], F_SETFL,
+				fcntl(pairs[i].fd[j], F_GETFL) | O_NONBLOCK);
+			ev.events = EPOLLIN;
+			ev.data.u64 = ((uint64_t)i << 1) | j;
+			epoll_ctl(ep, EPOLL_CTL_ADD, pairs[i].fd[j], &ev);
+		}
+	}
+
+	t = now_ns();
+	end_time = t + cfg.duration * 1000000000ULL;
+	for (i = 0; i < cfg.pairs; i++) {
+		pairs[i].last_progress = t;
+		ep_send(ep, &pairs[i], 0);
+	}
+
+	for (;;) {
+		n = epoll_wait(ep, evs, 2 * cfg.pairs, POLL_MS);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		t = now_ns();
+		if (t >= end_time)
+			atomic_store(&stop_run, 1);
+		stop = atomic_load(&stop_run);
+
+		for (i = 0; i < n; i++) {
+			p = &pairs[evs[i].data.u64 >> 1];
+			if (evs[i].data.u64 & 1) {
+				ep_echo(ep, p, evs[i].events);
+				continue;
+			}
+			if (evs[i].events & EPOLLIN) {
+				unsigned char buf[MAX_MSG];
+				ssize_t r;
+
+				r = read(p->fd[0], buf, sizeof(buf));
+				if (r > 0)
+					rx_account(p, r, now_ns());
+			}
+			ep_send(ep, p, stop);
+		}
+
+		if (!stop)
+			continue;
+
+		/* wait for messages in flight, give up on stuck pairs */
+		busy = 0;
+		for (i = 0; i < cfg.pairs; i++) {
+			p = &pairs[i];
+			if (p->stalled || p->done == p->started)
+				continue;
+			if (t - p->last_progress > STALL_NS)
+				p->stalled = 1;
+			else
+				busy = 1;
+		}
+		if (!busy)
+			break;
+	}
+
+	for (i = 0; i < cfg.pairs; i++) {
+		for (j = 0; j < 2; j++) {
+			epoll_ctl(ep, EPOLL_CTL_DEL, pairs[i].fd[j], NULL);
+			fcntl(pairs[i].fd[j], F_SETFL,
+				fcntl(pairs[i].fd[j], F_GETFL) & ~O_NONBLOCK);
+		}
+	}
+	close(ep);
+	free(evs);
+
+	return 0;
+}
+
+static void print_run(int size, double elapsed, int first)
+{
+	static struct hist all;
+	double sum = 0, sum_sq = 0, min = -1, max = 0, bps, jain;
+	uint64_t msgs = 0, bytes = 0;
+	int i, stalled = 0;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < cfg.pairs; i++) {
+		bps = pairs[i].done * (double)size / elapsed;
+		sum += bps;
+		sum_sq += bps * bps;
+		if (min < 0 || bps < min)
+			min = bps;
+		if (bps > max)
+			max = bps;
+		msgs += pairs[i].done;
+		bytes += pairs[i].done * (uint64_t)size;
+		stalled += pairs[i].stalled;
+		hist_merge(&all, &pairs[i].lat);
+	}
+	/* Jain's index, 1.0 when all pairs got the same throughput */
+	jain = sum_sq > 0 ? (sum * sum) / (cfg.pairs * sum_sq) : 0;
+
+	printf("%s    {\n", first ? "" : ",\n");
+	printf("      \"size\": %d,\n", size);
+	printf("      \"elapsed_s\": %.6f,\n", elapsed);
+	printf("      \"messages\": %llu,\n", (unsigned long long)msgs);
+	printf("      \"bytes\": %llu,\n", (unsigned long long)bytes);
+	printf("      \"throughput_Bps\": %.0f,\n", bytes / elapsed);
+	printf("      \"messages_per_s\": %.0f,\n", msgs / elapsed);
+	printf("      \"stalled_pairs\": %d,\n", stalled);
+	printf("      \"latency_ns\": { \"p50\": %llu, \"p99\": %llu, "
+			"\"p999\": %llu, \"max\": %llu },\n",
+			(unsigned long long)hist_pct(&all, 0.50),
+			(unsigned long long)hist_pct(&all, 0.99),
+			(unsigned long long)hist_pct(&all, 0.999),
+			(unsigned long long)all.max);
+	printf("      \"fairness\": { \"jain\": %.4f, \"min_Bps\": %.0f, "
+			"\"max_Bps\": %.0f },\n", jain, min, max);
+	printf("      \"pairs\": [\n");
+	for (i = 0; i < cfg.pairs; i++) {
+		struct pair *p = &pairs[i];
+
+		printf("        { \"dev\": [%d, %d], \"messages\": %llu, "
+			"\"throughput_Bps\": %.0f, \"p50_ns\": %llu, "
+			"\"p99_ns\": %llu, \"p999_ns\": %llu, "
+			"\"max_ns\": %llu, \"stalled\": %s }%s\n",
+			p->idx[0], p->idx[1],
+			(unsigned long long)p->done,
+			p->done * (double)size / elapsed,
+			(unsigned long long)hist_pct(&p->lat, 0.50),
+			(unsigned long long)hist_pct(&p->lat, 0.99),
+			(unsigned long long)hist_pct(&p->lat, 0.999),
+			(unsigned long long)p->lat.max,
+			p->stalled ? "true" : "false",
+			(i == cfg.pairs - 1) ? "" : ",");
+	}
+	printf("      ]\n");
+	printf("    }");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -n pairs     null modem pairs to create (1)\n"
+		"  -s sizes     message sizes, comma separated, 1-4096 (64)\n"
+		"  -t seconds   duration of each size (5)\n"
+		"  -m model     thread or epoll (epoll)\n"
+		"  -d depth     messages in flight per pair, epoll only (1)\n"
+		"  -c mode      raw or canon (raw)\n"
+		"  -b bits      data bits, 7 or 8 (8)\n"
+		"  -r           enable CRTSCTS flow control\n"
+		"  -B baud      baud rate of both ends (115200)\n", prog);
+	exit(2);
+}
+
+static void parse_sizes(char *arg, const char *prog)
+{
+	char *tok, *save = NULL;
+
+	cfg.nsizes = 0;
+	for (tok = strtok_r(arg, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		if (cfg.nsizes == MAX_SIZES)
+			usage(prog);
+		cfg.sizes[cfg.nsizes++] = atoi(tok);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	uint64_t t0;
+	double elapsed;
+	int opt, i, ret = 0;
+	size_t k;
+
+	while ((opt = getopt(argc, argv, "n:s:t:m:d:c:b:rB:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			cfg.pairs = atoi(optarg);
+			break;
+		case 's':
+			parse_sizes(optarg, argv[0]);
+			break;
+		case 't':
+			cfg.duration = atoi(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "thread"))
+				cfg.model = MODEL_THREAD;
+			else if (!strcmp(optarg, "epoll"))
+				cfg.model = MODEL_EPOLL;
+			else
+				usage(argv[0]);
+			break;
+		case 'd':
+			cfg.depth = atoi(optarg);
+			break;
+		case 'c':
+			if (!strcmp(optarg, "canon"))
+				cfg.canon = 1;
+			else if (strcmp(optarg, "raw"))
+				usage(argv[0]);
+			break;
+		case 'b':
+			cfg.csize = atoi(optarg);
+			break;
+		case 'r':
+			cfg.crtscts = 1;
+			break;
+		case 'B':
+			cfg.baud = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (cfg.nsizes == 0) {
+		cfg.sizes[0] = 64;
+		cfg.nsizes = 1;
+	}
+	for (i = 0; i < cfg.nsizes; i++) {
+		/* canonical line holds 4095 bytes including '\n' */
+		if (cfg.sizes[i] < 1 + cfg.canon ||
+				cfg.sizes[i] > MAX_MSG - cfg.canon)
+			usage(argv[0]);
+	}
+	for (k = 0; k < sizeof(baud_tbl) / sizeof(baud_tbl[0]); k++) {
+		if (baud_tbl[k].baud == cfg.baud)
+			break;
+	}
+	if (cfg.pairs < 1 || cfg.duration < 1 || cfg.depth < 1 ||
+			cfg.depth > MAX_DEPTH || (cfg.csize != 7 &&
+			cfg.csize != 8) || k == sizeof(baud_tbl) /
+			sizeof(baud_tbl[0]))
+		usage(argv[0]);
+	/* blocking ping pong has exactly one message in flight */
+	if (cfg.model == MODEL_THREAD && cfg.depth != 1)
+		usage(argv[0]);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	card_fd = open(VS_CARD, O_RDWR);
+	if (card_fd < 0) {
+		fprintf(stderr, "open %s: %s\n", VS_CARD, strerror(errno));
+		return 1;
+	}
+
+	if (create_pairs() < 0) {
+		ret = 1;
+		goto out;
+	}
+
+	printf("{\n");
+	printf("  \"tool\": \"ttyvs_bench\",\n");
+	printf("  \"config\": { \"pairs\": %d, \"model\": \"%s\", "
+		"\"depth\": %d, \"mode\": \"%s\", \"csize\": %d, "
+		"\"crtscts\": %s, \"baud\": %d, \"duration_s\": %d },\n",
+		cfg.pairs, cfg.model == MODEL_THREAD ? "thread" : "epoll",
+		cfg.depth, cfg.canon ? "canon" : "raw", cfg.csize,
+		cfg.crtscts ? "true" : "false", cfg.baud, cfg.duration);
+	printf("  \"runs\": [\n");
+
+	for (i = 0; i < cfg.nsizes && !interrupted; i++) {
+		msg_size = cfg.sizes[i];
+		for (k = 0; k < (size_t)msg_size; k++)
+			msg[k] = 'a' + k % 26;
+		if (cfg.canon)
+			msg[msg_size - 1] = '\n';
+
+		for (k = 0; k < (size_t)cfg.pairs; k++)
+			reset_pair(&pairs[k]);
+		atomic_store(&stop_run, 0);
+
+		t0 = now_ns();
+		if (cfg.model == MODEL_THREAD)
+			run_threads();
+		else
+			run_epoll();
+		elapsed = (now_ns() - t0) / 1e9;
+
+		print_run(msg_size, elapsed, i == 0);
+	}
+
+	printf("\n  ]\n}\n");
+	fflush(stdout);
+
+out:
+	delete_pairs();
+	free(pairs);
+	close(card_fd);
+	return ret;
+}
@@ -0,0 +1,611 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Serial port null modem emulation driver, framing line discipline
+ *
+ * Copyright (c) 2020, Rishi Gupta <gupt21@gmail.com>
+ *
+ * Assembles received bytes into frames and returns one complete frame
+ * from every read(). The reader is woken once per frame rather than
+ * once per chunk of bytes pushed by the tty core. A frame ends at:
+ *  - a delimiter byte, 0x00 for COBS or 0xC0 for SLIP
+ *  - the length given by a field in the frame header
+ *  - a silent line for 3.5 character times (Modbus RTU) or the given
+ *    number of microseconds
+ *
+ * Meant for ttyvs devices but works with any tty. Load the module,
+ * select the discipline on an open port and set the framing (see
+ * struct vs_frame_cfg in ttyvs.h):
+ *
+ * $ insmod ttyvs_frame.ko ldisc=29
+ *
+ * int ld = 29;
+ * ioctl(fd, TIOCSETD, &ld);
+ * ioctl(fd, VS_IOC_FRAME_SET, &cfg);
+ * n = read(fd, buf, sizeof(buf));
+ *
+ * If the read() buffer is smaller than the frame, the reader gets the
+ * start of the frame and the rest is discarded. FIONREAD gives the
+ * size of the next frame. Written data goes to the driver unchanged.
+ *
+ * Written against line discipline API of Linux 5.12 and 5.13, same as
+ * ttyvs.c: read() with cookie, receive_buf() with non const flags and
+ * tty_register_ldisc() taking the discipline number.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/tty.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "ttyvs.h"
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)) || \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
+#error "ttyvs_frame supports Linux 5.12 and 5.13 only"
+#endif
+
+/* Free for development use, taken by kernel only in later releases */
+#ifndef N_DEVELOPMENT
+#define N_DEVELOPMENT 29
+#endif
+
+#define VS_FRAME_DEF_LEN  4096
+#define VS_FRAME_MAX_LEN  65536
+/* Bytes of complete frames waiting for the reader */
+#define VS_FRAME_QUEUE    (256 * 1024)
+#define VS_FRAME_GAP_MAX  (10 * USEC_PER_SEC)
+
+static int ldisc = N_DEVELOPMENT;
+
+struct vs_frame {
+	struct list_head list;
+	unsigned int len;
+	unsigned char data[];
+};
+
+struct vs_framer {
+	struct tty_struct *tty;
+	/* protects everything below against gap timer */
+	spinlock_t lock;
+	struct vs_frame_cfg cfg;
+	/* frame being assembled, bytes beyond max_len are not kept */
+	unsigned char *buf;
+	u64 count;
+	/* VS_FRAME_LENGTH: size of frame once header is in, else 0 */
+	u64 need;
+	bool error;
+	/* complete frames and their total length */
+	struct list_head frames;
+	unsigned int queued;
+	struct hrtimer gap;
+	struct vs_frame_stats stats;
+};
+
+/*
+ * Ends the frame being assembled. Returns true if a frame has been
+ * queued and the reader should be woken up. Called with lock held.
+ */
+static bool vs_frame_end(struct vs_framer *fr)
+{
+	struct vs_frame *frame = NULL;
+	unsigned int len = fr->count;
+
+	if (!fr->count) {
+		/* back to back delimiters */
+	} else if (fr->count > fr->cfg.max_len) {
+		fr->stats.too_long++;
+	} else if (fr->error) {
+		fr->stats.errors++;
+	} else if (fr->queued + len > VS_FRAME_QUEUE) {
+		fr->stats.overruns++;
+	} else {
+		frame = kmalloc(struct_size(frame, data, len), GFP_ATOMIC);
+		if (frame) {
+			frame->len = len;
+			memcpy(frame->data, fr->buf, len);
+			list_add_tail(&frame->list, &fr->frames);
+			fr->queued += len;
+			fr->stats.frames++;
+		} else {
+			fr->stats.overruns++;
+		}
+	}
+
+	fr->count = 0;
+	fr->need = 0;
+	fr->error = false;
+	return frame != NULL;
+}
+
+static inline void vs_frame_add(struct vs_framer *fr, unsigned char c)
+{
+	if (fr->count < fr->cfg.max_len)
+		fr->buf[fr->count] = c;
+	fr->count++;
+}
+
+/* Size of the whole frame from the length field in its header */
+static u64 vs_frame_need(struct vs_framer *fr)
+{
+	const struct vs_frame_cfg *cfg = &fr->cfg;
+	const unsigned char *p = fr->buf + cfg->len_offset;
+	unsigned int hdr = cfg->len_offset + cfg->len_bytes;
+	s64 value = 0;
+	int i;
+
+	for (i = 0; i < cfg->len_bytes; i++) {
+		if (cfg->len_le)
+			value |= (s64)p[i] << (8 * i);
+		else
+			value = (value << 8) | p[i];
+	}
+
+	value += cfg->len_adjust;
+	if (value < 0) {
+		/* nothing sensible to skip, drop the header alone */
+		fr->error = true;
+		return hdr;
+	}
+
+	return hdr + value;
+}
+
+static u64 vs_frame_gap_ns(struct vs_framer *fr, speed_t baud)
+{
+	if (fr->cfg.gap_us)
+		return (u64)fr->cfg.gap_us * NSEC_PER_USEC;
+
+	/*
+	 * Modbus over serial line: 3.5 characters of 11 bits, fixed at
+	 * 1750 us above 19200 baud.
+	 */
+	if (!baud || baud > 19200)
+		return 1750 * NSEC_PER_USEC;
+
+	return div_u64(35ULL * 11 * NSEC_PER_SEC + 10 * baud - 1, 10 * baud);
+}
+
+static enum hrtimer_restart vs_frame_gap(struct hrtimer *timer)
+{
+	struct vs_framer *fr = container_of(timer, struct vs_framer, gap);
+	unsigned long flags;
+	bool wake;
+
+	spin_lock_irqsave(&fr->lock, flags);
+	wake = vs_frame_end(fr);
+	spin_unlock_irqrestore(&fr->lock, flags);
+
+	if (wake)
+		wake_up_interruptible(&fr->tty->read_wait);
+
+	return HRTIMER_NORESTART;
+}
+
+static void vs_frame_receive_buf(struct tty_struct *tty,
+		const unsigned char *cp, char *fp, int count)
+{
+	struct vs_framer *fr = tty->disc_data;
+	const struct vs_frame_cfg *cfg = &fr->cfg;
+	speed_t baud = tty_get_baud_rate(tty);
+	unsigned long flags;
+	unsigned int hdr;
+	ktime_t gap;
+	bool wake = false;
+	bool bad;
+	int i;
+
+	spin_lock_irqsave(&fr->lock, flags);
+
+	hdr = cfg->len_offset + cfg->len_bytes;
+
+	for (i = 0; i < count; i++) {
+		/* byte with error is kept but never ends a frame */
+		bad = fp && fp[i] != TTY_NORMAL;
+		if (bad)
+			fr->error = true;
+
+		switch (cfg->mode) {
+		case VS_FRAME_DELIM:
+			if (cp[i] == cfg->delim && !bad)
+				wake |= vs_frame_end(fr);
+			else
+				vs_frame_add(fr, cp[i]);
+			break;
+		case VS_FRAME_LENGTH:
+			vs_frame_add(fr, cp[i]);
+			if (!fr->need && fr->count == hdr)
+				fr->need = vs_frame_need(fr);
+			if (fr->need && fr->count == fr->need)
+				wake |= vs_frame_end(fr);
+			break;
+		case VS_FRAME_GAP:
+			vs_frame_add(fr, cp[i]);
+			break;
+		}
+	}
+
+	if (cfg->mode == VS_FRAME_GAP && count) {
+		gap = ns_to_ktime(vs_frame_gap_ns(fr, baud));
+		hrtimer_start(&fr->gap, gap, HRTIMER_MODE_REL_SOFT);
+	}
+
+	spin_unlock_irqrestore(&fr->lock, flags);
+
+	if (wake)
+		wake_up_interruptible(&tty->read_wait);
+}
+
+static struct vs_frame *vs_frame_pop(struct vs_framer *fr)
+{
+	struct vs_frame *frame;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fr->lock, flags);
+	frame = list_first_entry_or_null(&fr->frames, struct vs_frame, list);
+	if (frame) {
+		list_del(&frame->list);
+		fr->queued -= frame->len;
+	}
+	spin_unlock_irqrestore(&fr->lock, flags);
+
+	return frame;
+}
+
+/* Drops queued frames and the one being assembled */
+static void vs_frame_flush(struct vs_framer *fr)
+{
+	struct vs_frame *frame, *tmp;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&fr->lock, flags);
+	list_splice_init(&fr->frames, &list);
+	fr->queued = 0;
+	fr->count = 0;
+	fr->need = 0;
+	fr->error = false;
+	spin_unlock_irqrestore(&fr->lock, flags);
+
+	list_for_each_entry_safe(frame, tmp, &list, list)
+		kfree(frame);
+}
+
+static void vs_frame_flush_buffer(struct tty_struct *tty)
+{
+	vs_frame_flush(tty->disc_data);
+}
+
+/*
+ * Called by tty core with a kernel buffer of at most 64 bytes at a time.
+ * A frame not fully returned is kept in the cookie and tty core calls
+ * again with 'offset' advanced. Once the user buffer is full tty core
+ * calls with 'nr' of 0; the rest of the frame is then dropped and 0
+ * returned, so read() gives the bytes copied so far.
+ */
+static ssize_t vs_frame_read(struct tty_struct *tty, struct file *file,
+		unsigned char *kbuf, size_t nr, void **cookie,
+		unsigned long offset)
+{
+	struct vs_framer *fr = tty->disc_data;
+	struct vs_frame *frame = *cookie;
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+	ssize_t ret = 0;
+
+	if (!nr) {
+		/* user buffer is full, rest of the frame is discarded */
+		*cookie = NULL;
+		kfree(frame);
+		return 0;
+	}
+
+	if (frame)
+		goto have_frame;
+
+	add_wait_queue(&tty->read_wait, &wait);
+	for (;;) {
+		if (test_bit(TTY_OTHER_CLOSED, &tty->flags)) {
+			ret = -EIO;
+			break;
+		}
+		if (tty_hung_up_p(file))
+			break;
+
+		frame = vs_frame_pop(fr);
+		if (frame)
+			break;
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		wait_woken(&wait, TASK_INTERRUPTIBLE, MAX_SCHEDULE_TIMEOUT);
+	}
+	remove_wait_queue(&tty->read_wait, &wait);
+
+	if (!frame)
+		return ret;
+
+have_frame:
+	ret = min_t(size_t, frame->len - offset, nr);
+	memcpy(kbuf, frame->data + offset, ret);
+	if (offset + ret < frame->len) {
+		*cookie = frame;
+		return ret;
+	}
+
+	*cookie = NULL;
+	kfree(frame);
+	return ret;
+}
+
+static ssize_t vs_frame_write(struct tty_struct *tty, struct file *file,
+		const unsigned char *buf, size_t nr)
+{
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+	ssize_t done = 0;
+	int ret;
+
+	add_wait_queue(&tty->write_wait, &wait);
+	for (;;) {
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		if (tty_hung_up_p(file)) {
+			ret = -EIO;
+			break;
+		}
+
+		ret = tty->ops->write(tty, buf + done, nr - done);
+		if (ret < 0)
+			break;
+		done += ret;
+		if (done == nr)
+			break;
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		/* tty_wakeup() wakes us once the driver has room again */
+		wait_woken(&wait, TASK_INTERRUPTIBLE, MAX_SCHEDULE_TIMEOUT);
+	}
+	remove_wait_queue(&tty->write_wait, &wait);
+
+	return done ? done : ret;
+}
+
+static __poll_t vs_frame_poll(struct tty_struct *tty, struct file *file,
+		poll_table *wait)
+{
+	struct vs_framer *fr = tty->disc_data;
+	unsigned long flags;
+	__poll_t mask = 0;
+
+	poll_wait(file, &tty->read_wait, wait);
+	poll_wait(file, &tty->write_wait, wait);
+
+	spin_lock_irqsave(&fr->lock, flags);
+	if (!list_empty(&fr->frames))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	spin_unlock_irqrestore(&fr->lock, flags);
+	if (tty_hung_up_p(file) || test_bit(TTY_OTHER_CLOSED, &tty->flags))
+		mask |= EPOLLHUP;
+	if (tty_write_room(tty) > 0)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static int vs_frame_check(struct vs_frame_cfg *cfg)
+{
+	if (cfg->reserved)
+		return -EINVAL;
+
+	if (!cfg->max_len)
+		cfg->max_len = VS_FRAME_DEF_LEN;
+	if (cfg->max_len > VS_FRAME_MAX_LEN)
+		return -EINVAL;
+
+	switch (cfg->mode) {
+	case VS_FRAME_DELIM:
+		break;
+	case VS_FRAME_LENGTH:
+		if (cfg->len_bytes != 1 && cfg->len_bytes != 2 &&
+				cfg->len_bytes != 4)
+			return -EINVAL;
+		if ((u64)cfg->len_offset + cfg->len_bytes > cfg->max_len)
+			return -EINVAL;
+		break;
+	case VS_FRAME_GAP:
+		if (cfg->gap_us > VS_FRAME_GAP_MAX)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int vs_frame_set(struct vs_framer *fr, struct vs_frame_cfg *cfg)
+{
+	unsigned char *buf, *old;
+	unsigned long flags;
+	int ret;
+
+	ret = vs_frame_check(cfg);
+	if (ret)
+		return ret;
+
+	buf = kmalloc(cfg->max_len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	/* timer takes the lock, stop it first; partial frame is dropped */
+	hrtimer_cancel(&fr->gap);
+
+	spin_lock_irqsave(&fr->lock, flags);
+	old = fr->buf;
+	fr->buf = buf;
+	fr->cfg = *cfg;
+	fr->count = 0;
+	fr->need = 0;
+	fr->error = false;
+	spin_unlock_irqrestore(&fr->lock, flags);
+
+	kfree(old);
+	return 0;
+}
+
+static int vs_frame_ioctl(struct tty_struct *tty, struct file *file,
+		unsigned int cmd, unsigned long arg)
+{
+	struct vs_framer *fr = tty->disc_data;
+	void __user *argp = (void __user *)arg;
+	struct vs_frame_stats stats;
+	struct vs_frame_cfg cfg;
+	struct vs_frame *frame;
+	unsigned long flags;
+	int ret;
+
+	switch (cmd) {
+	case VS_IOC_FRAME_SET:
+		if (copy_from_user(&cfg, argp, sizeof(cfg)))
+			return -EFAULT;
+		return vs_frame_set(fr, &cfg);
+
+	case VS_IOC_FRAME_GET:
+		spin_lock_irqsave(&fr->lock, flags);
+		cfg = fr->cfg;
+		spin_unlock_irqrestore(&fr->lock, flags);
+		if (copy_to_user(argp, &cfg, sizeof(cfg)))
+			return -EFAULT;
+		return 0;
+
+	case VS_IOC_FRAME_STATS:
+		spin_lock_irqsave(&fr->lock, flags);
+		stats = fr->stats;
+		spin_unlock_irqrestore(&fr->lock, flags);
+		if (copy_to_user(argp, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+
+	case FIONREAD:
+		spin_lock_irqsave(&fr->lock, flags);
+		frame = list_first_entry_or_null(&fr->frames,
+					struct vs_frame, list);
+		ret = frame ? frame->len : 0;
+		spin_unlock_irqrestore(&fr->lock, flags);
+		return put_user(ret, (int __user *)argp);
+
+	default:
+		return n_tty_ioctl_helper(tty, file, cmd, arg);
+	}
+}
+
+static int vs_frame_open(struct tty_struct *tty)
+{
+	struct vs_framer *fr;
+
+	fr = kzalloc(sizeof(*fr), GFP_KERNEL);
+	if (!fr)
+		return -ENOMEM;
+
+	fr->cfg.mode = VS_FRAME_DELIM;
+	fr->cfg.max_len = VS_FRAME_DEF_LEN;
+	fr->buf = kmalloc(fr->cfg.max_len, GFP_KERNEL);
+	if (!fr->buf) {
+		kfree(fr);
+		return -ENOMEM;
+	}
+
+	fr->tty = tty;
+	spin_lock_init(&fr->lock);
+	INIT_LIST_HEAD(&fr->frames);
+	hrtimer_init(&fr->gap, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	fr->gap.function = vs_frame_gap;
+
+	tty->disc_data = fr;
+	tty->receive_room = 65536;
+	return 0;
+}
+
+static void vs_frame_close(struct tty_struct *tty)
+{
+	struct vs_framer *fr = tty->disc_data;
+
+	hrtimer_cancel(&fr->gap);
+	vs_frame_flush(fr);
+	tty->disc_data = NULL;
+	kfree(fr->buf);
+	kfree(fr);
+}
+
+static struct tty_ldisc_ops vs_frame_ldisc = {
+	.magic        = TTY_LDISC_MAGIC,
+	.owner        = THIS_MODULE,
+	.name         = "ttyvs_frame",
+	.open         = vs_frame_open,
+	.close        = vs_frame_close,
+	.flush_buffer = vs_frame_flush_buffer,
+	.read         = vs_frame_read,
+	.write        = vs_frame_write,
+	.ioctl        = vs_frame_ioctl,
+	.poll         = vs_frame_poll,
+	.receive_buf  = vs_frame_receive_buf,
+};
+
+static int __init vs_frame_init(void)
+{
+	int ret;
+
+	ret = tty_register_ldisc(ldisc, &vs_frame_ldisc);
+	if (ret) {
+		pr_err("can't register line discipline %d %d\n", ldisc, ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void __exit vs_frame_exit(void)
+{
+	tty_unregister_ldisc(ldisc);
+}
+
+module_init(vs_frame_init);
+module_exit(vs_frame_exit);
+
+/*
+ * Line discipline number to be given to TIOCSETD. Must be below
+ * NR_LDISCS and not used by another discipline.
+ */
+module_param(ldisc, int, 0444);
+MODULE_PARM_DESC(ldisc,
+		"Line discipline number, default 29 (N_DEVELOPMENT)");
+
+MODULE_AUTHOR("Rishi Gupta <gupt21@gmail.com>");
+MODULE_DESCRIPTION("Framing line discipline for virtual serial ports");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,631 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Serial port null modem emulation driver, KUnit tests
+ *
+ * Copyright (c) 2020, Rishi Gupta <gupt21@gmail.com>
+ *
+ * Included by ttyvs.c when built with TTYVS_KUNIT=1, so that the tests
+ * can reach static functions of the driver. TTYVS_KUNIT=1 builds the
+ * tty2com suite of tty2com_kunit.c into tty2com.ko as well. Tests need
+ * no hardware and run under UML or QEMU on a 5.12 or 5.13 kernel with
+ * CONFIG_KUNIT. In a module, suites run at the end of module init, once
+ * the driver is set up, and results go to the kernel log in KTAP format:
+ *
+ * $ make TTYVS_KUNIT=1
+ * $ insmod ./ttyvs.ko
+ * $ dmesg | grep -A40 "# Subtest: ttyvs"
+ *
+ * Built into a kernel tree instead (see Kconfig), the suites are found
+ * by kunit.py like any in-tree suite:
+ *
+ * $ ./tools/testing/kunit/kunit.py run \
+ *	--kunitconfig=drivers/tty/tty2com/.kunitconfig
+ *
+ * Every data path case opens both ends of a fresh null modem pair
+ * from the kernel. Bytes reaching the receiver's tty buffer are
+ * captured in place of the line discipline, so the cases exercise
+ * vs_write() through the transmit ring, delivery work and the flip
+ * buffer, just as a user space writer would. Tap cases drive card
+ * files the way a tap reader does, reading the ring in place of mmap().
+ *
+ * The ttyvs_bench suite reports bytes/s and ns/write for a range of
+ * write sizes; a drop between two kernels points to the data path. It
+ * pushes several MiB through a pair, so it is built only with
+ * TTYVS_KUNIT_BENCH=1 (which implies TTYVS_KUNIT=1):
+ *
+ * $ make TTYVS_KUNIT_BENCH=1
+ */
+
+#include <kunit/test.h>
+
+#define VS_TEST_BUF      4096
+#define VS_TEST_TIMEOUT  (2 * HZ)
+
+struct vs_test_ctx {
+	int idx[2];
+	struct tty_struct *tty[2];
+	/* received by each end, first VS_TEST_BUF bytes are kept */
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	size_t rx_total[2];
+	unsigned char rx[2][VS_TEST_BUF];
+};
+
+/* Client operations of the ports point to the running test */
+static struct vs_test_ctx *vs_test_cur;
+
+static int vs_test_receive_buf(struct tty_port *port,
+		const unsigned char *p, const unsigned char *f, size_t count)
+{
+	int end;
+	size_t off, n;
+	unsigned long flags;
+	struct vs_test_ctx *ctx = vs_test_cur;
+
+	end = (port == ctx->tty[0]->port) ? 0 : 1;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	off = ctx->rx_total[end];
+	if (off < VS_TEST_BUF) {
+		n = min_t(size_t, count, VS_TEST_BUF - off);
+		memcpy(&ctx->rx[end][off], p, n);
+	}
+	ctx->rx_total[end] += count;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	wake_up(&ctx->wait);
+	return count;
+}
+
+static const struct tty_port_client_operations vs_test_client_ops = {
+	.receive_buf  = vs_test_receive_buf,
+	.write_wakeup = vs_port_write_wakeup,
+};
+
+static size_t vs_test_rx_total(struct vs_test_ctx *ctx, int end)
+{
+	size_t n;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	n = ctx->rx_total[end];
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return n;
+}
+
+/* Waits until end has received at least n bytes, returns 0 on timeout */
+static int vs_test_wait_rx(struct vs_test_ctx *ctx, int end, size_t n)
+{
+	return wait_event_timeout(ctx->wait,
+			vs_test_rx_total(ctx, end) >= n, VS_TEST_TIMEOUT);
+}
+
+/* Opens device at given index as tty core would for open() */
+static struct tty_struct *vs_test_open(int idx)
+{
+	int ret;
+	struct tty_struct *tty;
+
+	tty = tty_kopen_exclusive(MKDEV(ttyvs_driver->major,
+				ttyvs_driver->minor_start + idx));
+	if (IS_ERR(tty))
+		return tty;
+
+	/* no file, tty_port_open() does not wait for carrier */
+	ret = vs_open(tty, NULL);
+	tty_unlock(tty);
+	if (ret) {
+		tty_kclose(tty);
+		return ERR_PTR(ret);
+	}
+
+	tty->port->client_ops = &vs_test_client_ops;
+	return tty;
+}
+
+static void vs_test_close(struct tty_struct *tty)
+{
+	struct vs_dev *vsdev = tty->driver_data;
+
+	tty_lock(tty);
+	tty_port_close(tty->port, tty, NULL);
+	/* as vs_close() does on last close */
+	vsdev->is_open = 0;
+	vs_tty_clear(vsdev, tty);
+	tty_unlock(tty);
+	tty_kclose(tty);
+}
+
+/* Applies same c_cflag to both ends, as mismatched ends drop data */
+static void vs_test_set_cflag(struct vs_test_ctx *ctx, tcflag_t cflag)
+{
+	int x;
+	struct ktermios kt;
+
+	for (x = 0; x < 2; x++) {
+		kt = ctx->tty[x]->termios;
+		kt.c_cflag = cflag;
+		tty_set_termios(ctx->tty[x], &kt);
+	}
+}
+
+/*
+ * KUnit calls exit even when init failed, so the context is given to
+ * the test before anything needs undoing and exit undoes only what
+ * init got done.
+ */
+static int vs_test_init(struct kunit *test)
+{
+	int x, ret;
+	struct vs_spec spec;
+	struct vs_test_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if (ctx == NULL)
+		return -ENOMEM;
+
+	ctx->idx[0] = ctx->idx[1] = -1;
+	spin_lock_init(&ctx->lock);
+	init_waitqueue_head(&ctx->wait);
+	test->priv = ctx;
+
+	vs_parse_create_cmd(vs_std_nm_cmd, &spec);
+	mutex_lock(&adaptlock);
+	ret = vs_create_locked(&spec);
+	if (ret >= 0) {
+		ctx->idx[0] = ret;
+		ctx->idx[1] = vs_dev_locked(ret)->peer_index;
+	}
+	mutex_unlock(&adaptlock);
+	if (ret < 0)
+		return ret;
+
+	vs_test_cur = ctx;
+	for (x = 0; x < 2; x++) {
+		ctx->tty[x] = vs_test_open(ctx->idx[x]);
+		if (IS_ERR(ctx->tty[x])) {
+			ret = PTR_ERR(ctx->tty[x]);
+			ctx->tty[x] = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void vs_test_exit(struct kunit *test)
+{
+	int x;
+	struct vs_test_ctx *ctx = test->priv;
+
+	if (ctx == NULL)
+		return;
+
+	for (x = 0; x < 2; x++) {
+		if (ctx->tty[x])
+			vs_test_close(ctx->tty[x]);
+	}
+
+	if (ctx->idx[0] >= 0) {
+		mutex_lock(&adaptlock);
+		vs_destroy_locked(ctx->idx[0]);
+		mutex_unlock(&adaptlock);
+	}
+	vs_test_cur = NULL;
+}
+
+/* Both ends exist, point to each other and carry standard mappings */
+static void vs_test_pair_create(struct kunit *test)
+{
+	int x;
+	struct vs_dev *vsdev[2];
+	struct vs_test_ctx *ctx = test->priv;
+
+	mutex_lock(&adaptlock);
+	for (x = 0; x < 2; x++)
+		vsdev[x] = vs_dev_locked(ctx->idx[x]);
+	mutex_unlock(&adaptlock);
+
+	KUNIT_ASSERT_NOT_NULL(test, vsdev[0]);
+	KUNIT_ASSERT_NOT_NULL(test, vsdev[1]);
+	KUNIT_EXPECT_NE(test, ctx->idx[0], ctx->idx[1]);
+
+	for (x = 0; x < 2; x++) {
+		KUNIT_EXPECT_EQ(test, vsdev[x]->own_index,
+				(unsigned int)ctx->idx[x]);
+		KUNIT_EXPECT_EQ(test, vsdev[x]->peer_index,
+				(unsigned int)ctx->idx[!x]);
+		KUNIT_EXPECT_TRUE(test,
+			rcu_access_pointer(vsdev[x]->peer) == vsdev[!x]);
+		KUNIT_EXPECT_EQ(test, vsdev[x]->rts_mappings, VS_CON_CTS);
+		KUNIT_EXPECT_EQ(test, vsdev[x]->dtr_mappings,
+				VS_CON_DSR | VS_CON_DCD);
+		KUNIT_EXPECT_EQ(test, vsdev[x]->odevtyp, VS_SNM);
+		KUNIT_EXPECT_EQ(test, vsdev[x]->is_open, 1);
+	}
+}
+
+/* Data written on one end arrives unchanged on the other, both ways */
+static void vs_test_write_delivery(struct kunit *test)
+{
+	int x, ret;
+	unsigned char buf[300];
+	struct vs_test_ctx *ctx = test->priv;
+
+	for (x = 0; x < sizeof(buf); x++)
+		buf[x] = x;
+
+	for (x = 0; x < 2; x++) {
+		ret = vs_write(ctx->tty[x], buf, sizeof(buf));
+		KUNIT_EXPECT_EQ(test, ret, (int)sizeof(buf));
+
+		KUNIT_ASSERT_TRUE(test, vs_test_wait_rx(ctx, !x, sizeof(buf)));
+		KUNIT_EXPECT_EQ(test, vs_test_rx_total(ctx, !x), sizeof(buf));
+		KUNIT_EXPECT_EQ(test, memcmp(ctx->rx[!x], buf, sizeof(buf)), 0);
+	}
+
+	KUNIT_EXPECT_EQ(test, vs_chars_in_buffer(ctx->tty[0]), 0);
+}
+
+/* vs_put_char() staged bytes go out on vs_flush_chars() */
+static void vs_test_put_char(struct kunit *test)
+{
+	struct vs_test_ctx *ctx = test->priv;
+
+	KUNIT_EXPECT_EQ(test, vs_put_char(ctx->tty[0], 'a'), 1);
+	KUNIT_EXPECT_EQ(test, vs_put_char(ctx->tty[0], 'b'), 1);
+	vs_flush_chars(ctx->tty[0]);
+
+	KUNIT_ASSERT_TRUE(test, vs_test_wait_rx(ctx, 1, 2));
+	KUNIT_EXPECT_EQ(test, ctx->rx[1][0], (unsigned char)'a');
+	KUNIT_EXPECT_EQ(test, ctx->rx[1][1], (unsigned char)'b');
+}
+
+/* Upper bits beyond character size are lost as on a real line */
+static void vs_test_data_bits(struct kunit *test)
+{
+	static const struct {
+		tcflag_t csize;
+		unsigned char mask;
+	} sizes[] = {
+		{ CS5, 0x1F }, { CS6, 0x3F }, { CS7, 0x7F }, { CS8, 0xFF },
+	};
+	int x, y;
+	size_t done = 0;
+	unsigned char buf[64];
+	struct vs_test_ctx *ctx = test->priv;
+	tcflag_t cflag = ctx->tty[0]->termios.c_cflag & ~CSIZE;
+
+	memset(buf, 0xFF, sizeof(buf));
+	buf[0] = 0xA5;
+
+	for (x = 0; x < ARRAY_SIZE(sizes); x++) {
+		vs_test_set_cflag(ctx, cflag | sizes[x].csize);
+
+		KUNIT_EXPECT_EQ(test, vs_write(ctx->tty[0], buf, sizeof(buf)),
+				(int)sizeof(buf));
+		done += sizeof(buf);
+		KUNIT_ASSERT_TRUE(test, vs_test_wait_rx(ctx, 1, done));
+
+		KUNIT_EXPECT_EQ(test, ctx->rx[1][done - sizeof(buf)],
+				(unsigned char)(0xA5 & sizes[x].mask));
+		for (y = 1; y < sizeof(buf); y++)
+			KUNIT_EXPECT_EQ(test,
+				ctx->rx[1][done - sizeof(buf) + y],
+				sizes[x].mask);
+	}
+}
+
+/* Word at a time masking matches byte at a time for any alignment */
+static void vs_test_mask_data_bits(struct kunit *test)
+{
+	int off, len, x;
+	unsigned char src[40], buf[40];
+
+	for (x = 0; x < sizeof(src); x++)
+		src[x] = 0x80 | (x * 37);
+
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len <= sizeof(buf) - 8; len++) {
+			memcpy(buf, src, sizeof(buf));
+			vs_mask_data_bits(buf + off, len, 0x3F);
+			for (x = 0; x < sizeof(buf); x++) {
+				if ((x >= off) && (x < off + len))
+					KUNIT_EXPECT_EQ(test, buf[x],
+							(unsigned char)(src[x] & 0x3F));
+				else
+					KUNIT_EXPECT_EQ(test, buf[x], src[x]);
+			}
+		}
+	}
+}
+
+/*
+ * With RTS/CTS flow control, a throttled receiver drops its RTS and
+ * with it CTS of the sender, which stops taking data until unthrottled.
+ */
+static void vs_test_throttle(struct kunit *test)
+{
+	unsigned char ch = 'x';
+	struct vs_dev *tx_vsdev;
+	struct vs_test_ctx *ctx = test->priv;
+
+	tx_vsdev = ctx->tty[0]->driver_data;
+	vs_test_set_cflag(ctx, ctx->tty[0]->termios.c_cflag | CRTSCTS);
+	KUNIT_EXPECT_TRUE(test, vs_tiocmget(ctx->tty[0]) & TIOCM_CTS);
+
+	vs_throttle(ctx->tty[1]);
+	KUNIT_EXPECT_FALSE(test, vs_tiocmget(ctx->tty[1]) & TIOCM_RTS);
+	KUNIT_EXPECT_FALSE(test, vs_tiocmget(ctx->tty[0]) & TIOCM_CTS);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(tx_vsdev->tx_paused), 1);
+	KUNIT_EXPECT_EQ(test, vs_write_room(ctx->tty[0]), 0);
+	KUNIT_EXPECT_EQ(test, vs_write(ctx->tty[0], &ch, 1), 0);
+
+	vs_unthrottle(ctx->tty[1]);
+	KUNIT_EXPECT_TRUE(test, vs_tiocmget(ctx->tty[1]) & TIOCM_RTS);
+	KUNIT_EXPECT_TRUE(test, vs_tiocmget(ctx->tty[0]) & TIOCM_CTS);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(tx_vsdev->tx_paused), 0);
+	KUNIT_EXPECT_GT(test, vs_write_room(ctx->tty[0]), 0);
+
+	KUNIT_EXPECT_EQ(test, vs_write(ctx->tty[0], &ch, 1), 1);
+	KUNIT_EXPECT_TRUE(test, vs_test_wait_rx(ctx, 1, 1));
+}
+
+/* Standard pin out: RTS drives peer's CTS, DTR drives its DSR and DCD */
+static void vs_test_modem_lines(struct kunit *test)
+{
+	int msr;
+	struct vs_test_ctx *ctx = test->priv;
+
+	vs_tiocmset(ctx->tty[0], 0, TIOCM_RTS | TIOCM_DTR);
+	msr = vs_tiocmget(ctx->tty[1]);
+	KUNIT_EXPECT_FALSE(test, msr & (TIOCM_CTS | TIOCM_DSR | TIOCM_CAR));
+
+	vs_tiocmset(ctx->tty[0], TIOCM_RTS, 0);
+	msr = vs_tiocmget(ctx->tty[1]);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_CTS);
+	KUNIT_EXPECT_FALSE(test, msr & (TIOCM_DSR | TIOCM_CAR));
+
+	vs_tiocmset(ctx->tty[0], TIOCM_DTR, TIOCM_RTS);
+	msr = vs_tiocmget(ctx->tty[1]);
+	KUNIT_EXPECT_FALSE(test, msr & TIOCM_CTS);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_DSR);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_CAR);
+	KUNIT_EXPECT_FALSE(test, msr & TIOCM_RI);
+
+	/* lines of the writer itself follow what it set */
+	msr = vs_tiocmget(ctx->tty[0]);
+	KUNIT_EXPECT_TRUE(test, msr & TIOCM_DTR);
+	KUNIT_EXPECT_FALSE(test, msr & TIOCM_RTS);
+}
+
+/*
+ * A card file without a tap has nothing to map or poll. Closing it
+ * must not release what misc_open() left in private_data.
+ */
+static void vs_test_tap_plain(struct kunit *test)
+{
+	struct file *file;
+
+	file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, file);
+
+	file->private_data = test;
+	KUNIT_EXPECT_EQ(test, vs_card_open(NULL, file), 0);
+	KUNIT_EXPECT_TRUE(test, file->private_data == NULL);
+	KUNIT_EXPECT_EQ(test, vs_card_mmap(file, NULL), -ENODEV);
+	KUNIT_EXPECT_TRUE(test, vs_card_poll(file, NULL) == EPOLLERR);
+	KUNIT_EXPECT_EQ(test, vs_card_close(NULL, file), 0);
+}
+
+/* Looks for a data record sent by 'idx' holding 'len' bytes at 'p' */
+static int vs_test_tap_find(const struct vs_tap_hdr *hdr, u32 idx,
+		const void *p, size_t len)
+{
+	const unsigned char *data = (const unsigned char *)hdr +
+					hdr->data_offset;
+	const struct vs_tap_rec *rec;
+	u64 pos = READ_ONCE(hdr->tail);
+	u64 head = smp_load_acquire(&hdr->head);
+	u64 off;
+
+	while (pos < head) {
+		off = pos & (hdr->data_size - 1);
+		rec = (const struct vs_tap_rec *)(data + off);
+		if (rec->type == VS_TAP_PAD) {
+			pos += hdr->data_size - off;
+			continue;
+		}
+		if ((rec->type == VS_TAP_DATA) && (rec->index == idx) &&
+				(rec->len == len) && !memcmp(rec + 1, p, len))
+			return 1;
+		pos += ALIGN(sizeof(*rec) + rec->len, VS_TAP_ALIGN);
+	}
+
+	return 0;
+}
+
+/*
+ * A tap records data sent over the pair, takes one device only once
+ * and goes away with its file, after which the device takes another.
+ */
+static void vs_test_tap(struct kunit *test)
+{
+	static const char msg[] = "ttyvs tap";
+	int x, ret;
+	struct file *file[2];
+	struct vs_tap *tap;
+	struct vs_tap_attach req;
+	struct vs_test_ctx *ctx = test->priv;
+
+	for (x = 0; x < 2; x++) {
+		file[x] = kunit_kzalloc(test, sizeof(struct file), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, file[x]);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.index = ctx->idx[0];
+	req.ring_size = PAGE_SIZE;
+	ret = vs_tap_attach(file[0], &req);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	if (ret)
+		return;
+	KUNIT_EXPECT_GT(test, req.map_size, (u64)PAGE_SIZE);
+
+	/* one tap per file, one tap per device */
+	KUNIT_EXPECT_EQ(test, vs_tap_attach(file[0], &req), -EBUSY);
+	req.index = ctx->idx[1];
+	KUNIT_EXPECT_EQ(test, vs_tap_attach(file[1], &req), -EBUSY);
+
+	tap = file[0]->private_data;
+	KUNIT_EXPECT_EQ(test, tap->hdr->version, (u32)VS_TAP_VERSION);
+	KUNIT_EXPECT_EQ(test, tap->hdr->data_size, (u64)PAGE_SIZE);
+	KUNIT_EXPECT_LE(test, tap->hdr->data_offset + tap->hdr->data_size,
+			req.map_size);
+	KUNIT_EXPECT_TRUE(test, vs_card_poll(file[0], NULL) == 0);
+
+	KUNIT_EXPECT_EQ(test, vs_write(ctx->tty[0], msg, sizeof(msg) - 1),
+			(int)sizeof(msg) - 1);
+	KUNIT_EXPECT_TRUE(test, vs_test_wait_rx(ctx, 1, sizeof(msg) - 1));
+	KUNIT_EXPECT_TRUE(test, vs_card_poll(file[0], NULL) & EPOLLIN);
+	KUNIT_EXPECT_TRUE(test, vs_test_tap_find(tap->hdr, ctx->idx[0],
+				msg, sizeof(msg) - 1));
+
+	vs_card_close(NULL, file[0]);
+
+	ret = vs_tap_attach(file[1], &req);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	if (ret == 0)
+		vs_card_close(NULL, file[1]);
+}
+
+static struct kunit_case vs_test_cases[] = {
+	KUNIT_CASE(vs_test_pair_create),
+	KUNIT_CASE(vs_test_write_delivery),
+	KUNIT_CASE(vs_test_put_char),
+	KUNIT_CASE(vs_test_data_bits),
+	KUNIT_CASE(vs_test_mask_data_bits),
+	KUNIT_CASE(vs_test_throttle),
+	KUNIT_CASE(vs_test_modem_lines),
+	KUNIT_CASE(vs_test_tap_plain),
+	KUNIT_CASE(vs_test_tap),
+	{}
+};
+
+static struct kunit_suite vs_test_suite = {
+	.name = "ttyvs",
+	.init = vs_test_init,
+	.exit = vs_test_exit,
+	.test_cases = vs_test_cases,
+};
+
+#ifdef TTYVS_KUNIT_BENCH
+
+/*
+ * Writes 'total' bytes in writes of 'size' bytes as fast as the pair
+ * takes them and times until the last byte reached the receiver.
+ */
+static void vs_bench_one(struct kunit *test, int size, size_t total)
+{
+	int ret;
+	u64 ns, writes = 0;
+	size_t done = 0;
+	ktime_t start;
+	unsigned char *buf;
+	struct vs_test_ctx *ctx = test->priv;
+	size_t base = vs_test_rx_total(ctx, 1);
+
+	buf = kunit_kmalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	memset(buf, 0x55, size);
+
+	start = ktime_get();
+	while (done < total) {
+		ret = vs_write(ctx->tty[0], buf,
+				min_t(size_t, size, total - done));
+		KUNIT_ASSERT_GE(test, ret, 0);
+		if (ret == 0) {
+			/* transmit ring full, let delivery drain it */
+			KUNIT_ASSERT_TRUE(test, wait_event_timeout(ctx->wait,
+					vs_write_room(ctx->tty[0]) > 0,
+					VS_TEST_TIMEOUT));
+			continue;
+		}
+		done += ret;
+		writes++;
+	}
+	KUNIT_ASSERT_TRUE(test, vs_test_wait_rx(ctx, 1, base + total));
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start)) ? : 1;
+
+	kunit_info(test, "write size %4d: %llu bytes/s, %llu ns/write\n",
+			size, div64_u64((u64)total * NSEC_PER_SEC, ns),
+			div64_u64(ns, writes));
+}
+
+static void vs_bench_write(struct kunit *test)
+{
+	static const int sizes[] = { 1, 16, 64, 256, 1024, 4096 };
+	int x;
+
+	for (x = 0; x < ARRAY_SIZE(sizes); x++)
+		vs_bench_one(test, sizes[x],
+			(sizes[x] == 1) ? (64 * 1024) : (4 * 1024 * 1024));
+}
+
+static struct kunit_case vs_bench_cases[] = {
+	KUNIT_CASE(vs_bench_write),
+	{}
+};
+
+static struct kunit_suite vs_bench_suite = {
+	.name = "ttyvs_bench",
+	.init = vs_test_init,
+	.exit = vs_test_exit,
+	.test_cases = vs_bench_cases,
+};
+
+#endif
+
+#ifdef MODULE
+
+static struct kunit_suite *vs_kunit_suites[] = {
+	&vs_test_suite,
+#ifdef TTYVS_KUNIT_BENCH
+	&vs_bench_suite,
+#endif
+	NULL,
+};
+
+/*
+ * Called at the end of ttyvs_init() and start of ttyvs_exit(). Suites
+ * are not registered with kunit_test_suites() as in a module that
+ * would add a second module_init.
+ */
+static void vs_kunit_run(void)
+{
+	__kunit_test_suites_init(vs_kunit_suites);
+}
+
+static void vs_kunit_exit(void)
+{
+	__kunit_test_suites_exit(vs_kunit_suites);
+}
+
+#else
+
+/* Built in, KUnit runs the suites once all initcalls are done */
+kunit_test_suites(&vs_test_suite);
+#ifdef TTYVS_KUNIT_BENCH
+kunit_test_suites(&vs_bench_suite);
+#endif
+
+static void vs_kunit_run(void)
+{
+}
+
+static void vs_kunit_exit(void)
+{
+}
+
+#endif
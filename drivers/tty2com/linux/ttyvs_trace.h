@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Serial port null modem emulation driver, tracepoints
+ *
+ * Copyright (c) 2020, Rishi Gupta <gupt21@gmail.com>
+ *
+ * Events are found under /sys/kernel/tracing/events/ttyvs and can be
+ * used with ftrace, perf or bpftrace. A disabled event costs a static
+ * branch only.
+ *
+ * $ echo 1 > /sys/kernel/tracing/events/ttyvs/enable
+ * $ cat /sys/kernel/tracing/trace_pipe
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ttyvs
+
+#if !defined(_TTYVS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TTYVS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Data given by tty core to the driver. 'ret' is the value returned to
+ * tty core, 'result' tells what happened to the data: queued, full,
+ * stopped, break, faulty, mismatch or noreader. Data is accepted and
+ * dropped in the last three cases.
+ */
+DECLARE_EVENT_CLASS(ttyvs_tx,
+	TP_PROTO(unsigned int index, int count, int ret, const char *result),
+	TP_ARGS(index, count, ret, result),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(int, count)
+		__field(int, ret)
+		__string(result, result)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->count = count;
+		__entry->ret = ret;
+		__assign_str(result, result);
+	),
+
+	TP_printk("ttyvs%u count=%d ret=%d %s", __entry->index,
+		__entry->count, __entry->ret, __get_str(result))
+);
+
+DEFINE_EVENT(ttyvs_tx, ttyvs_write,
+	TP_PROTO(unsigned int index, int count, int ret, const char *result),
+	TP_ARGS(index, count, ret, result)
+);
+
+DEFINE_EVENT(ttyvs_tx, ttyvs_put_char,
+	TP_PROTO(unsigned int index, int count, int ret, const char *result),
+	TP_ARGS(index, count, ret, result)
+);
+
+/* Data sent by device 'from' pushed into tty buffer of device 'index' */
+TRACE_EVENT(ttyvs_flip_push,
+	TP_PROTO(unsigned int index, unsigned int from, int count),
+	TP_ARGS(index, from, count),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(unsigned int, from)
+		__field(int, count)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->from = from;
+		__entry->count = count;
+	),
+
+	TP_printk("ttyvs%u from=ttyvs%u count=%d", __entry->index,
+		__entry->from, __entry->count)
+);
+
+/* tty core called the given operation of device 'index' */
+DECLARE_EVENT_CLASS(ttyvs_port,
+	TP_PROTO(unsigned int index),
+	TP_ARGS(index),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+	),
+
+	TP_printk("ttyvs%u", __entry->index)
+);
+
+DEFINE_EVENT(ttyvs_port, ttyvs_throttle,
+	TP_PROTO(unsigned int index),
+	TP_ARGS(index)
+);
+
+DEFINE_EVENT(ttyvs_port, ttyvs_unthrottle,
+	TP_PROTO(unsigned int index),
+	TP_ARGS(index)
+);
+
+DEFINE_EVENT(ttyvs_port, ttyvs_stop,
+	TP_PROTO(unsigned int index),
+	TP_ARGS(index)
+);
+
+DEFINE_EVENT(ttyvs_port, ttyvs_start,
+	TP_PROTO(unsigned int index),
+	TP_ARGS(index)
+);
+
+DEFINE_EVENT(ttyvs_port, ttyvs_hangup,
+	TP_PROTO(unsigned int index),
+	TP_ARGS(index)
+);
+
+/*
+ * Modem control register of device 'index' and modem status register
+ * of device 'peer' it drives, as VS_MCR_xxx and VS_MSR_xxx bits.
+ */
+TRACE_EVENT(ttyvs_modem,
+	TP_PROTO(unsigned int index, unsigned int peer, int old_mcr,
+		int new_mcr, int old_msr, int new_msr),
+	TP_ARGS(index, peer, old_mcr, new_mcr, old_msr, new_msr),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(unsigned int, peer)
+		__field(int, old_mcr)
+		__field(int, new_mcr)
+		__field(int, old_msr)
+		__field(int, new_msr)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->peer = peer;
+		__entry->old_mcr = old_mcr;
+		__entry->new_mcr = new_mcr;
+		__entry->old_msr = old_msr;
+		__entry->new_msr = new_msr;
+	),
+
+	TP_printk("ttyvs%u mcr=0x%x->0x%x ttyvs%u msr=0x%x->0x%x",
+		__entry->index, __entry->old_mcr, __entry->new_mcr,
+		__entry->peer, __entry->old_msr, __entry->new_msr)
+);
+
+TRACE_EVENT(ttyvs_break,
+	TP_PROTO(unsigned int index, int state),
+	TP_ARGS(index, state),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(int, state)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->state = state;
+	),
+
+	TP_printk("ttyvs%u %s", __entry->index,
+		__entry->state ? "on" : "off")
+);
+
+/* Device 'index' connected to 'peer' added to or removed from card */
+DECLARE_EVENT_CLASS(ttyvs_dev,
+	TP_PROTO(unsigned int index, unsigned int peer),
+	TP_ARGS(index, peer),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(unsigned int, peer)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->peer = peer;
+	),
+
+	TP_printk("ttyvs%u peer=ttyvs%u", __entry->index, __entry->peer)
+);
+
+DEFINE_EVENT(ttyvs_dev, ttyvs_dev_create,
+	TP_PROTO(unsigned int index, unsigned int peer),
+	TP_ARGS(index, peer)
+);
+
+DEFINE_EVENT(ttyvs_dev, ttyvs_dev_delete,
+	TP_PROTO(unsigned int index, unsigned int peer),
+	TP_ARGS(index, peer)
+);
+
+#endif /* _TTYVS_TRACE_H */
+
+/* Header is next to ttyvs.c, Makefile adds its directory to include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ttyvs_trace
+#include <trace/define_trace.h>